@@ -0,0 +1,341 @@
+/*
+ * FlashEmulator.cpp
+ *
+ * File-backed emulation of the SPI flash, the partition table and the SPIFFS file system of an ESP32 module.
+ */
+
+#include "FlashEmulator.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "esp_partition.h"
+#include "esp_spiffs.h"
+
+// The partitions of partitions.esp32.csv
+static const esp_partition_t partitions[] =
+{
+	{ ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x9000, 0x6000, "nvs", false },
+	{ ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x33e000, 0x40000, "scratch", false },
+	{ ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x37e000, 0x80000, "kvs", false },
+};
+
+static constexpr size_t PageSize = 256;
+
+// Static data
+const FlashEmulator::Timing FlashEmulator::DefaultTiming = { 1000, 25, 700, 45000 };
+
+uint8_t *FlashEmulator::image = nullptr;
+FlashEmulator::Timing FlashEmulator::timing = FlashEmulator::DefaultTiming;
+bool FlashEmulator::sleep = false;
+long FlashEmulator::powerFailBudget = -1;
+bool FlashEmulator::readFail = false;
+FlashEmulator::Stats FlashEmulator::stats = { 0 };
+const char *FlashEmulator::spiffsDir = nullptr;
+const char *FlashEmulator::spiffsBase = nullptr;
+
+// The file system calls are wrapped by the linker, so the emulator reaches the host files through these
+extern "C" int __real_open(const char *path, int flags, ...);
+extern "C" int __real_stat(const char *path, struct stat *st);
+
+// Map the image file, creating it erased if 'blank' is true
+/*static*/ bool FlashEmulator::Open(const char *path, bool blank)
+{
+	Close();
+
+	const int f = __real_open(path, O_RDWR | O_CREAT | (blank ? O_TRUNC : 0), 0644);
+	if (f < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	bool ok = (!blank || ftruncate(f, FlashSize) == 0) && fstat(f, &st) == 0 && st.st_size == (off_t)FlashSize;
+	if (ok)
+	{
+		void *p = mmap(nullptr, FlashSize, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+		ok = (p != MAP_FAILED);
+		if (ok)
+		{
+			image = static_cast<uint8_t*>(p);
+			if (blank)
+			{
+				memset(image, 0xFF, FlashSize);
+			}
+		}
+	}
+
+	close(f);
+	ResetStats();
+	return ok;
+}
+
+/*static*/ void FlashEmulator::Close()
+{
+	if (image)
+	{
+		munmap(image, FlashSize);
+		image = nullptr;
+	}
+	powerFailBudget = -1;
+	readFail = false;
+}
+
+/*static*/ void FlashEmulator::SetTiming(const Timing& t, bool s)
+{
+	timing = t;
+	sleep = s;
+}
+
+/*static*/ void FlashEmulator::SetPowerFail(long operations)
+{
+	powerFailBudget = operations;
+}
+
+/*static*/ void FlashEmulator::SetReadFail(bool fail)
+{
+	readFail = fail;
+}
+
+/*static*/ void FlashEmulator::SetSpiffsDir(const char *dir)
+{
+	spiffsDir = dir;
+}
+
+/*static*/ void FlashEmulator::ResetStats()
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+/*static*/ void FlashEmulator::Charge(uint64_t ns)
+{
+	stats.flashNs += ns;
+	if (sleep)
+	{
+		const timespec t = { (time_t)(ns / 1000000000), (long)(ns % 1000000000) };
+		nanosleep(&t, nullptr);
+	}
+}
+
+// The contents of the image file are all that survive, as the flash contents do on the module
+/*static*/ void FlashEmulator::PowerFail()
+{
+	_exit(PowerFailExitCode);
+}
+
+/*static*/ bool FlashEmulator::Read(size_t address, void *data, size_t length)
+{
+	if (!image || readFail || address + length > FlashSize)
+	{
+		return false;
+	}
+
+	memcpy(data, image + address, length);
+	++stats.reads;
+	stats.readBytes += length;
+	Charge(timing.readSetupNs + (uint64_t)length * timing.readByteNs);
+	return true;
+}
+
+/*static*/ bool FlashEmulator::Write(size_t address, const void *data, size_t length)
+{
+	if (!image || address + length > FlashSize)
+	{
+		return false;
+	}
+
+	const uint8_t *src = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < length; ++i)
+	{
+		if (powerFailBudget == 0)
+		{
+			PowerFail();
+		}
+		if (powerFailBudget > 0)
+		{
+			--powerFailBudget;
+		}
+		image[address + i] &= src[i];
+	}
+
+	++stats.writes;
+	stats.writeBytes += length;
+	if (length != 0)
+	{
+		Charge((uint64_t)((address + length + PageSize - 1)/PageSize - address/PageSize) * timing.programPageUs * 1000);
+	}
+	return true;
+}
+
+/*static*/ bool FlashEmulator::Erase(size_t address, size_t length)
+{
+	if (!image || address + length > FlashSize || address % SPI_FLASH_SEC_SIZE != 0 || length % SPI_FLASH_SEC_SIZE != 0)
+	{
+		return false;
+	}
+
+	for (size_t sector = address; sector < address + length; sector += SPI_FLASH_SEC_SIZE)
+	{
+		if (powerFailBudget == 0)
+		{
+			// An interrupted erase leaves the sector neither erased nor as it was
+			memset(image + sector, 0xFF, SPI_FLASH_SEC_SIZE/2);
+			PowerFail();
+		}
+		if (powerFailBudget > 0)
+		{
+			--powerFailBudget;
+		}
+		memset(image + sector, 0xFF, SPI_FLASH_SEC_SIZE);
+		++stats.erases;
+		Charge((uint64_t)timing.eraseSectorUs * 1000);
+	}
+	return true;
+}
+
+// Return the host path of a file in the mounted SPIFFS file system, or the path unchanged if it isn't in it
+/*static*/ const char *FlashEmulator::MapSpiffsPath(const char *path, char *buff, size_t length)
+{
+	const size_t baseLength = (spiffsBase) ? strlen(spiffsBase) : 0;
+	if (baseLength != 0 && path && strncmp(path, spiffsBase, baseLength) == 0 && path[baseLength] == '/')
+	{
+		const int res = snprintf(buff, length, "%s%s", spiffsDir, path + baseLength);
+		if (res > 0 && (size_t)res < length)
+		{
+			return buff;
+		}
+	}
+	return path;
+}
+
+/*static*/ bool FlashEmulator::MountSpiffs(const char *basePath)
+{
+	struct stat st;
+	if (!spiffsDir || !basePath || __real_stat(spiffsDir, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		return false;
+	}
+	spiffsBase = basePath;
+	return true;
+}
+
+/*static*/ void FlashEmulator::UnmountSpiffs()
+{
+	spiffsBase = nullptr;
+}
+
+// SDK calls
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+	for (const esp_partition_t& p : partitions)
+	{
+		if (p.type == type && (subtype == ESP_PARTITION_SUBTYPE_ANY || p.subtype == subtype)
+			&& (!label || strcmp(label, p.label) == 0))
+		{
+			return &p;
+		}
+	}
+	return nullptr;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+	if (!partition || src_offset + size > partition->size)
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+	return FlashEmulator::Read(partition->address + src_offset, dst, size) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+	if (!partition || dst_offset + size > partition->size)
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+	return FlashEmulator::Write(partition->address + dst_offset, src, size) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+	if (!partition || offset + size > partition->size)
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+	return FlashEmulator::Erase(partition->address + offset, size) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+							spi_flash_mmap_memory_t memory, const void **out_ptr, spi_flash_mmap_handle_t *out_handle)
+{
+	if (!partition || offset + size > partition->size || !FlashEmulator::GetImage())
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+	*out_ptr = FlashEmulator::GetImage() + partition->address + offset;
+	*out_handle = 1;
+	return ESP_OK;
+}
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+}
+
+esp_err_t spi_flash_erase_range(size_t start_address, size_t size)
+{
+	return FlashEmulator::Erase(start_address, size) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t spi_flash_write(size_t dest_addr, const void *src, size_t size)
+{
+	return FlashEmulator::Write(dest_addr, src, size) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t spi_flash_read(size_t src_addr, void *dest, size_t size)
+{
+	return FlashEmulator::Read(src_addr, dest, size) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf)
+{
+	return (conf && FlashEmulator::MountSpiffs(conf->base_path)) ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_vfs_spiffs_unregister(const char *partition_label)
+{
+	FlashEmulator::UnmountSpiffs();
+	return ESP_OK;
+}
+
+// File system calls made by the code under test, which the linker is told to wrap
+
+extern "C" int __wrap_open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	if (flags & O_CREAT)
+	{
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, int);
+		va_end(args);
+	}
+
+	char buff[PATH_MAX];
+	return __real_open(FlashEmulator::MapSpiffsPath(path, buff, sizeof(buff)), flags, mode);
+}
+
+extern "C" int __wrap_stat(const char *path, struct stat *st)
+{
+	char buff[PATH_MAX];
+	return __real_stat(FlashEmulator::MapSpiffsPath(path, buff, sizeof(buff)), st);
+}
+
+// End
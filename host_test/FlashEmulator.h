@@ -0,0 +1,80 @@
+/*
+ * FlashEmulator.h
+ *
+ * File-backed emulation of the SPI flash, the partition table and the SPIFFS file system of an ESP32 module,
+ * so that the storage code can be run on a Linux host.
+ *
+ * Writes behave like NOR flash, only clearing bits. Each access is charged the time that a typical flash chip
+ * would take, which can also be slept for. A power failure can be injected after a given number of flash
+ * operations; the operation in progress is left part done and the process exits, leaving the image file in the
+ * state that the module would find at the next boot.
+ */
+
+#ifndef HOST_TEST_FLASHEMULATOR_H_
+#define HOST_TEST_FLASHEMULATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+
+class FlashEmulator
+{
+public:
+	static constexpr int PowerFailExitCode = 99;
+	static constexpr size_t FlashSize = 0x400000;
+
+	// Flash access times, by default those of the 4MB chips fitted to the ESP32 modules
+	struct Timing
+	{
+		uint32_t readSetupNs;					// per read
+		uint32_t readByteNs;
+		uint32_t programPageUs;					// per 256 byte page written to
+		uint32_t eraseSectorUs;
+	};
+
+	struct Stats
+	{
+		uint64_t reads;
+		uint64_t readBytes;
+		uint64_t writes;
+		uint64_t writeBytes;
+		uint64_t erases;						// sectors
+		uint64_t flashNs;						// time that the flash was busy
+	};
+
+	static const Timing DefaultTiming;
+
+	static bool Open(const char *path, bool blank);
+	static void Close();
+
+	static void SetTiming(const Timing& t, bool sleep);
+	static void SetPowerFail(long operations);	// bytes written or sectors erased before the power fails, or -1 for never
+	static void SetReadFail(bool fail);			// make every read fail, as a flash fault would
+	static void SetSpiffsDir(const char *dir);	// host directory holding the SPIFFS files, or nullptr for none
+
+	static const Stats& GetStats() { return stats; }
+	static void ResetStats();
+
+	// Implementation of the SDK calls
+	static bool Read(size_t address, void *data, size_t length);
+	static bool Write(size_t address, const void *data, size_t length);
+	static bool Erase(size_t address, size_t length);
+	static uint8_t *GetImage() { return image; }
+	static const char *MapSpiffsPath(const char *path, char *buff, size_t length);
+	static bool MountSpiffs(const char *basePath);
+	static void UnmountSpiffs();
+
+private:
+	static void Charge(uint64_t ns);
+	static void PowerFail();
+
+	static uint8_t *image;
+	static Timing timing;
+	static bool sleep;
+	static long powerFailBudget;
+	static bool readFail;
+	static Stats stats;
+	static const char *spiffsDir;
+	static const char *spiffsBase;
+};
+
+#endif /* HOST_TEST_FLASHEMULATOR_H_ */
@@ -0,0 +1,66 @@
+/*
+ * HostStubs.cpp
+ *
+ * Host implementations of the SDK calls, other than the flash ones, that the storage code makes.
+ */
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs_flash.h"
+#include "rom/ets_sys.h"
+
+extern "C" int ets_printf(const char *fmt, ...)
+{
+	static const bool verbose = (getenv("HOST_TEST_VERBOSE") != nullptr);
+	int res = 0;
+	if (verbose)
+	{
+		va_list args;
+		va_start(args, fmt);
+		res = vprintf(fmt, args);
+		va_end(args);
+	}
+	return res;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex()
+{
+	return new (std::nothrow) std::recursive_mutex;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks)
+{
+	static_cast<std::recursive_mutex*>(mutex)->lock();
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex)
+{
+	static_cast<std::recursive_mutex*>(mutex)->unlock();
+	return pdTRUE;
+}
+
+// There is no NVS data on the emulated flash, in particular none left by the 1.x firmware
+
+esp_err_t nvs_flash_init_partition_ptr(const esp_partition_t *partition)
+{
+	return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_open_from_partition(const char *part_name, const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+	return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+	return ESP_ERR_NVS_NOT_FOUND;
+}
+
+// End
@@ -0,0 +1,215 @@
+/*
+ * StorageBench.cpp
+ *
+ * Benchmarks of the WirelessConfigurationMgr storage paths on the emulated flash. For each operation this
+ * reports the host time, and the flash time and accesses that it would take on the module.
+ *
+ * Usage: storage_bench [--check] [--sleep] [directory for the flash image]
+ *   --check	fail if the flash time of an operation exceeds its limit
+ *   --sleep	sleep for the flash time, so that the host time includes it
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "Config.h"
+#include "FlashEmulator.h"
+#include "WirelessConfigurationMgr.h"
+
+static WirelessConfigurationMgr *mgr = nullptr;
+static unsigned counter = 0;
+
+static WirelessConfigurationData MakeSsid(const char *name, const char *password)
+{
+	WirelessConfigurationData data;
+	memset(&data, 0, sizeof(data));
+	strncpy(data.ssid, name, sizeof(data.ssid));
+	strncpy(data.password, password, sizeof(data.password) - 1);
+	return data;
+}
+
+static WirelessConfigurationData MakeEnterpriseSsid(const char *name)
+{
+	WirelessConfigurationData data;
+	memset(&data, 0, sizeof(data));
+	strncpy(data.ssid, name, sizeof(data.ssid));
+	data.eap.credSizes.asMemb.anonymousId = 16;
+	data.eap.credSizes.asMemb.caCert = 4000;
+	data.eap.credSizes.asMemb.tls.userCert = 2000;
+	data.eap.credSizes.asMemb.tls.privateKey = 1700;
+	data.eap.protocol = EAPProtocol::EAP_TLS;
+	return data;
+}
+
+static bool AddEnterpriseSsid(const WirelessConfigurationData& data)
+{
+	static uint8_t chunk[MaxCredentialChunkSize];
+	bool ok = mgr->BeginEnterpriseSsid(data);
+	for (int cred = 0; ok && cred < (int)ARRAY_SIZE(data.eap.credSizes.asArr); ++cred)
+	{
+		for (size_t pos = 0; ok && pos < data.eap.credSizes.asArr[cred]; )
+		{
+			const size_t sz = std::min<size_t>(data.eap.credSizes.asArr[cred] - pos, sizeof(chunk));
+			memset(chunk, (int)(pos + cred), sz);
+			ok = mgr->SetEnterpriseCredential(cred, chunk, sz);
+			pos += sz;
+		}
+	}
+	return mgr->EndEnterpriseSsid(!ok) && ok;
+}
+
+static const char *EnterpriseName(unsigned i)
+{
+	static const char * const names[] = { "ent0", "ent1", "ent2", "ent3", "ent4", "ent5" };
+	return names[i % ARRAY_SIZE(names)];
+}
+
+static const char *NetworkName(unsigned i)
+{
+	static char name[SsidLength];
+	snprintf(name, sizeof(name), "network%u", i % 14);
+	return name;
+}
+
+// A store holding personal and enterprise networks, with more sets of credentials than the scratch partition caches
+static void Populate()
+{
+	mgr = new WirelessConfigurationMgr();
+	mgr->Init();
+	mgr->Check();
+	for (unsigned i = 0; i < 14; ++i)
+	{
+		mgr->SetSsid(MakeSsid(NetworkName(i), "password"), false);
+	}
+	for (unsigned i = 0; i < 6; ++i)
+	{
+		AddEnterpriseSsid(MakeEnterpriseSsid(EnterpriseName(i)));
+	}
+}
+
+static bool Boot()
+{
+	mgr = new WirelessConfigurationMgr();
+	mgr->Init();
+	mgr->Check();
+	return true;
+}
+
+static bool SetSsid()
+{
+	return mgr->SetSsid(MakeSsid(NetworkName(counter), (counter & 1) ? "odd" : "even"), false) > 0;
+}
+
+static bool GetSsidByName()
+{
+	WirelessConfigurationData data;
+	return mgr->GetSsid(NetworkName(counter), data) > 0;
+}
+
+static bool GetUnknownSsid()
+{
+	WirelessConfigurationData data;
+	return mgr->GetSsid("not remembered", data) < 0;
+}
+
+static bool AddEnterprise()
+{
+	return AddEnterpriseSsid(MakeEnterpriseSsid(EnterpriseName(counter)));
+}
+
+static bool GetCachedCredentials()
+{
+	WirelessConfigurationData data;
+	CredentialsInfo offsets;
+	const int ssid = mgr->GetSsid(EnterpriseName(5), data);
+	return ssid > 0 && mgr->GetEnterpriseCredentials(ssid, data.eap.credSizes, offsets) != nullptr;
+}
+
+// Cycling through more SSIDs than are cached makes every call load the credentials from the store
+static bool GetEvictedCredentials()
+{
+	WirelessConfigurationData data;
+	CredentialsInfo offsets;
+	const int ssid = mgr->GetSsid(EnterpriseName(counter), data);
+	return ssid > 0 && mgr->GetEnterpriseCredentials(ssid, data.eap.credSizes, offsets) != nullptr;
+}
+
+struct Benchmark
+{
+	const char *name;
+	bool (*func)();
+	unsigned iterations;
+	double limitUs;				// most flash time per operation allowed by --check
+};
+
+static const Benchmark benchmarks[] =
+{
+	{ "boot",							Boot,					20,		10000 },
+	{ "SetSsid",						SetSsid,				500,	50000 },
+	{ "GetSsid by name",				GetSsidByName,			5000,	20 },
+	{ "GetSsid unknown",				GetUnknownSsid,			5000,	1 },
+	{ "enterprise add+commit",			AddEnterprise,			60,		600000 },
+	{ "GetEnterpriseCredentials hit",	GetCachedCredentials,	5000,	20 },
+	{ "GetEnterpriseCredentials miss",	GetEvictedCredentials,	60,		300000 },
+};
+
+int main(int argc, char *argv[])
+{
+	bool check = false, sleep = false;
+	std::string dir = ".";
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--check") == 0)
+		{
+			check = true;
+		}
+		else if (strcmp(argv[i], "--sleep") == 0)
+		{
+			sleep = true;
+		}
+		else
+		{
+			dir = argv[i];
+		}
+	}
+
+	if (!FlashEmulator::Open((dir + "/bench.bin").c_str(), true))
+	{
+		printf("can't create the flash image in %s\n", dir.c_str());
+		return 1;
+	}
+	FlashEmulator::SetTiming(FlashEmulator::DefaultTiming, sleep);
+	Populate();
+
+	int failed = 0;
+	printf("%-32s %12s %12s %8s %8s %8s\n", "operation", "host us", "flash us", "reads", "writes", "erases");
+	for (const Benchmark& b : benchmarks)
+	{
+		FlashEmulator::ResetStats();
+		bool ok = true;
+		const auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < b.iterations; ++i, ++counter)
+		{
+			ok = b.func() && ok;
+		}
+		const auto end = std::chrono::steady_clock::now();
+
+		const FlashEmulator::Stats& s = FlashEmulator::GetStats();
+		const double hostUs = std::chrono::duration<double, std::micro>(end - start).count() / b.iterations;
+		const double flashUs = s.flashNs / 1000.0 / b.iterations;
+		printf("%-32s %12.1f %12.1f %8.1f %8.1f %8.2f%s\n", b.name, hostUs, flashUs,
+				(double)s.reads / b.iterations, (double)s.writes / b.iterations, (double)s.erases / b.iterations,
+				(!ok) ? "  failed" : (check && flashUs > b.limitUs) ? "  over limit" : "");
+		if (!ok || (check && flashUs > b.limitUs))
+		{
+			++failed;
+		}
+	}
+
+	FlashEmulator::Close();
+	return (failed == 0) ? 0 : 1;
+}
+
+// End
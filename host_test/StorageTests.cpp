@@ -0,0 +1,494 @@
+/*
+ * StorageTests.cpp
+ *
+ * Tests of WirelessConfigurationMgr on the emulated flash, including boots after power failures injected
+ * at each point of a sequence of changes.
+ *
+ * Usage: storage_tests <directory for the flash image>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "Config.h"
+#include "FlashEmulator.h"
+#include "KvStore.h"
+#include "WirelessConfigurationMgr.h"
+
+static int failures = 0;
+
+#define CHECK(_cond)	do { if (!(_cond)) { printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #_cond); ++failures; } } while (false)
+
+static std::string workDir;
+
+// Each boot gets a new manager, as the module does after a reset
+static WirelessConfigurationMgr *Boot()
+{
+	WirelessConfigurationMgr *mgr = new WirelessConfigurationMgr();
+	mgr->Init();
+	mgr->Check();
+	return mgr;
+}
+
+static WirelessConfigurationData MakeSsid(const char *name, const char *password)
+{
+	WirelessConfigurationData data;
+	memset(&data, 0, sizeof(data));
+	strncpy(data.ssid, name, sizeof(data.ssid));
+	strncpy(data.password, password, sizeof(data.password) - 1);
+	return data;
+}
+
+static WirelessConfigurationData MakeEnterpriseSsid(const char *name, const uint32_t (&sizes)[5])
+{
+	WirelessConfigurationData data;
+	memset(&data, 0, sizeof(data));
+	strncpy(data.ssid, name, sizeof(data.ssid));
+	memcpy(data.eap.credSizes.asArr, sizes, sizeof(sizes));
+	data.eap.protocol = EAPProtocol::EAP_TLS;
+	return data;
+}
+
+static uint8_t CredentialByte(const char *name, int cred, size_t pos)
+{
+	return (uint8_t)(name[0] * 31 + cred * 7 + pos + pos / 251);
+}
+
+// Store an enterprise SSID the way the SAM sends it, in chunks
+static bool AddEnterpriseSsid(WirelessConfigurationMgr *mgr, const WirelessConfigurationData& data)
+{
+	if (!mgr->BeginEnterpriseSsid(data))
+	{
+		return false;
+	}
+
+	uint8_t chunk[MaxCredentialChunkSize];
+	for (int cred = 0; cred < (int)ARRAY_SIZE(data.eap.credSizes.asArr); ++cred)
+	{
+		for (size_t pos = 0; pos < data.eap.credSizes.asArr[cred]; )
+		{
+			const size_t sz = std::min<size_t>(data.eap.credSizes.asArr[cred] - pos, sizeof(chunk));
+			for (size_t i = 0; i < sz; ++i)
+			{
+				chunk[i] = CredentialByte(data.ssid, cred, pos + i);
+			}
+			if (!mgr->SetEnterpriseCredential(cred, chunk, sz))
+			{
+				mgr->EndEnterpriseSsid(true);
+				return false;
+			}
+			pos += sz;
+		}
+	}
+	return mgr->EndEnterpriseSsid(false);
+}
+
+static bool HasPassword(WirelessConfigurationMgr *mgr, const char *name, const char *password)
+{
+	WirelessConfigurationData data;
+	return mgr->GetSsid(name, data) > 0 && strcmp(data.password, password) == 0;
+}
+
+static bool HasCredentials(WirelessConfigurationMgr *mgr, const char *name)
+{
+	WirelessConfigurationData data;
+	const int ssid = mgr->GetSsid(name, data);
+	if (ssid <= 0 || data.eap.protocol == EAPProtocol::NONE)
+	{
+		return false;
+	}
+
+	CredentialsInfo offsets;
+	const uint8_t *base = mgr->GetEnterpriseCredentials(ssid, data.eap.credSizes, offsets);
+	if (!base)
+	{
+		return false;
+	}
+
+	for (int cred = 0; cred < (int)ARRAY_SIZE(offsets.asArr); ++cred)
+	{
+		for (size_t pos = 0; pos < data.eap.credSizes.asArr[cred]; ++pos)
+		{
+			if (base[offsets.asArr[cred] + pos] != CredentialByte(name, cred, pos))
+			{
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// The packed table must hold slot 0 and then each of the other slots in use, in order
+static bool IsTableConsistent(WirelessConfigurationMgr *mgr)
+{
+	size_t length;
+	const uint8_t *table = mgr->GetSsidTable(length);
+	std::vector<uint8_t> expected;
+	for (int ssid = 0; ssid <= (int)MaxRememberedNetworks; ++ssid)
+	{
+		WirelessConfigurationData data;
+		const bool used = mgr->GetSsid(ssid, data) && (uint8_t)data.ssid[0] != 0xFF;
+		if (ssid == WirelessConfigurationMgr::AP && !used)
+		{
+			memset(&data, 0, sizeof(data));
+		}
+		if (ssid == WirelessConfigurationMgr::AP || used)
+		{
+			const uint8_t *p = reinterpret_cast<const uint8_t*>(&data);
+			expected.insert(expected.end(), p, p + ReducedWirelessConfigurationDataSize);
+		}
+	}
+	return length == expected.size() && memcmp(table, expected.data(), length) == 0;
+}
+
+static bool OpenImage(const char *name, bool blank)
+{
+	return FlashEmulator::Open((workDir + "/" + name).c_str(), blank);
+}
+
+static void TestFreshStore()
+{
+	CHECK(OpenImage("fresh.bin", true));
+	WirelessConfigurationMgr *mgr = Boot();
+	WirelessConfigurationData data;
+	CHECK(mgr->GetSsid("anything", data) < 0);
+	CHECK(IsTableConsistent(mgr));
+}
+
+static void TestRememberedNetworks()
+{
+	CHECK(OpenImage("ssids.bin", true));
+	WirelessConfigurationMgr *mgr = Boot();
+
+	char name[SsidLength];
+	for (size_t i = 1; i <= MaxRememberedNetworks; ++i)
+	{
+		snprintf(name, sizeof(name), "net%u", (unsigned)i);
+		CHECK(mgr->SetSsid(MakeSsid(name, "password"), false) > 0);
+	}
+	CHECK(mgr->SetSsid(MakeSsid("onetoomany", "password"), false) < 0);
+	CHECK(mgr->SetSsid(MakeSsid("access point", "appassword"), true) == WirelessConfigurationMgr::AP);
+
+	// Changing a network keeps its slot
+	WirelessConfigurationData data;
+	const int slot = mgr->GetSsid("net7", data);
+	CHECK(mgr->SetSsid(MakeSsid("net7", "changed"), false) == slot);
+	CHECK(mgr->EraseSsid("net3"));
+	CHECK(mgr->GetSsid("net3", data) < 0);
+	CHECK(IsTableConsistent(mgr));
+
+	mgr = Boot();
+	CHECK(HasPassword(mgr, "net1", "password"));
+	CHECK(HasPassword(mgr, "net7", "changed"));
+	CHECK(HasPassword(mgr, "net20", "password"));
+	CHECK(mgr->GetSsid("net3", data) < 0);
+	CHECK(mgr->GetSsid(WirelessConfigurationMgr::AP, data) && strcmp(data.password, "appassword") == 0);
+	CHECK(IsTableConsistent(mgr));
+
+	// The freed slot is reused
+	CHECK(mgr->SetSsid(MakeSsid("net21", "password"), false) > 0);
+	CHECK(IsTableConsistent(mgr));
+}
+
+// A store that can't be loaded is left alone rather than formatted, so its networks are back once it can be read again
+static void TestUnreadableStore()
+{
+	CHECK(OpenImage("unreadable.bin", true));
+	WirelessConfigurationMgr *mgr = Boot();
+	CHECK(mgr->SetSsid(MakeSsid("home", "password"), false) > 0);
+
+	FlashEmulator::SetReadFail(true);
+	mgr = Boot();
+	FlashEmulator::SetReadFail(false);
+	WirelessConfigurationData data;
+	CHECK(mgr->GetSsid("home", data) < 0);
+
+	mgr = Boot();
+	CHECK(HasPassword(mgr, "home", "password"));
+	CHECK(IsTableConsistent(mgr));
+}
+
+static void TestEnterpriseNetworks()
+{
+	CHECK(OpenImage("enterprise.bin", true));
+	WirelessConfigurationMgr *mgr = Boot();
+
+	// More sets of credentials than the scratch partition caches, so that some are evicted to the store
+	static const char * const names[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot" };
+	for (size_t i = 0; i < ARRAY_SIZE(names); ++i)
+	{
+		const uint32_t sizes[5] = { 12, (uint32_t)(1200 + 3000 * i), 2100, 1700, 9 };
+		CHECK(AddEnterpriseSsid(mgr, MakeEnterpriseSsid(names[i], sizes)));
+	}
+	for (const char *name : names)
+	{
+		CHECK(HasCredentials(mgr, name));
+	}
+
+	// A cancelled SSID leaves nothing behind
+	const uint32_t sizes[5] = { 10, 5000, 0, 0, 0 };
+	CHECK(mgr->BeginEnterpriseSsid(MakeEnterpriseSsid("golf", sizes)));
+	CHECK(mgr->EndEnterpriseSsid(true));
+	WirelessConfigurationData data;
+	CHECK(mgr->GetSsid("golf", data) < 0);
+
+	// Replacing an enterprise SSID by a personal one drops the credentials
+	CHECK(mgr->SetSsid(MakeSsid("bravo", "personal"), false) > 0);
+
+	mgr = Boot();
+	for (const char *name : names)
+	{
+		CHECK(strcmp(name, "bravo") == 0 || HasCredentials(mgr, name));
+	}
+	CHECK(HasPassword(mgr, "bravo", "personal"));
+	CHECK(IsTableConsistent(mgr));
+}
+
+// Earlier versions kept one set of credentials in the scratch partition, under two scratch keys instead of the cache index
+static void TestCredentialCacheUpgrade()
+{
+	CHECK(OpenImage("upgrade.bin", true));
+	WirelessConfigurationMgr *mgr = Boot();
+	const uint32_t sizes[5] = { 14, 3000, 1800, 1200, 0 };
+	CHECK(AddEnterpriseSsid(mgr, MakeEnterpriseSsid("loaded", sizes)));
+	CHECK(AddEnterpriseSsid(mgr, MakeEnterpriseSsid("cached", sizes)));
+	WirelessConfigurationData data;
+	const int loaded = mgr->GetSsid("loaded", data);
+
+	// Neither set was ever copied to the store, so turn the index entry of one into the old keys and drop the index
+	KvStore kvs;
+	CHECK(kvs.Init(esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, "kvs")) == KvStore::InitResult::ok);
+	uint32_t index[2 + 4 * 4];
+	CHECK(kvs.Get("scratch/2", index, sizeof(index)));
+	for (size_t i = 2; i < ARRAY_SIZE(index); i += 4)
+	{
+		if (index[i] == (uint32_t)loaded)
+		{
+			const uint32_t end = index[i + 1] + index[i + 2];
+			CHECK(kvs.Set("scratch/0", &end, sizeof(end)));
+			CHECK(kvs.Set("scratch/1", &index[i], sizeof(index[i])));
+		}
+	}
+	CHECK(kvs.Delete("scratch/2"));
+
+	// The loaded set is kept, and the SSID whose credentials were only in the index is dropped
+	mgr = Boot();
+	CHECK(HasCredentials(mgr, "loaded"));
+	CHECK(mgr->GetSsid("cached", data) < 0);
+	CHECK(IsTableConsistent(mgr));
+
+	mgr = Boot();
+	CHECK(HasCredentials(mgr, "loaded"));
+	CHECK(AddEnterpriseSsid(mgr, MakeEnterpriseSsid("another", sizes)));
+	CHECK(HasCredentials(mgr, "loaded") && HasCredentials(mgr, "another"));
+}
+
+static void TestAccessPoints()
+{
+	CHECK(OpenImage("aps.bin", true));
+	WirelessConfigurationMgr *mgr = Boot();
+	const int net1 = mgr->SetSsid(MakeSsid("net1", "password"), false);
+	const int net2 = mgr->SetSsid(MakeSsid("net2", "password"), false);
+	CHECK(net1 > 0 && net2 > 0);
+
+	WirelessConfigurationMgr::AccessPointInfo info = { { 0x02, 0x11, 0x22, 0x33, 0x44, 0x55 }, 6, 3 }, temp;
+	CHECK(!mgr->GetAccessPointInfo(net1, temp));
+	CHECK(mgr->GetLastConnectedSsid() < 0);
+	CHECK(mgr->SetAccessPointInfo(net1, info));
+	CHECK(!mgr->SetAccessPointInfo(WirelessConfigurationMgr::AP, info));
+
+	// Connecting through the same access point again doesn't write to the flash
+	FlashEmulator::ResetStats();
+	CHECK(mgr->SetAccessPointInfo(net1, info));
+	CHECK(FlashEmulator::GetStats().writes == 0);
+
+	mgr = Boot();
+	CHECK(mgr->GetAccessPointInfo(net1, temp) && memcmp(&temp, &info, sizeof(info)) == 0);
+	CHECK(mgr->GetLastConnectedSsid() == net1);
+
+	info.channel = 11;
+	CHECK(mgr->SetAccessPointInfo(net2, info));
+	CHECK(mgr->GetLastConnectedSsid() == net2);
+
+	// Erasing the SSID forgets its access point, also for the next SSID stored in the slot
+	CHECK(mgr->EraseSsid("net2"));
+	CHECK(!mgr->GetAccessPointInfo(net2, temp));
+	CHECK(mgr->GetLastConnectedSsid() < 0);
+	CHECK(mgr->SetSsid(MakeSsid("net3", "password"), false) == net2);
+	CHECK(!mgr->GetAccessPointInfo(net2, temp));
+	CHECK(mgr->GetLastConnectedSsid() < 0);
+}
+
+static void WriteFile(const std::string& path, const void *data, size_t length)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	CHECK(f && fwrite(data, length, 1, f) == 1);
+	if (f)
+	{
+		fclose(f);
+	}
+}
+
+// Keys left in the SPIFFS file system by earlier versions are moved into the store at the first boot
+static void TestSpiffsMigration()
+{
+	const std::string dir = workDir + "/spiffs";
+	const std::string ssids = dir + "/ssids";
+	mkdir(dir.c_str(), 0755);
+	mkdir(ssids.c_str(), 0755);
+
+	// Earlier versions stored every slot, with blank ones erased
+	WirelessConfigurationData data;
+	memset(&data, 0xFF, sizeof(data));
+	WriteFile(ssids + "/0", &data, sizeof(data));
+	data = MakeSsid("migrated", "oldpassword");
+	WriteFile(ssids + "/4", &data, sizeof(data));
+
+	// Keys that don't all fit in the scratch partition are left where they are
+	const std::string creds = dir + "/creds";
+	const std::string creds5 = creds + "/5";
+	mkdir(creds.c_str(), 0755);
+	mkdir(creds5.c_str(), 0755);
+	const std::vector<uint8_t> tooBig(0x40000, 0x55);
+	WriteFile(creds5 + "/0", tooBig.data(), tooBig.size());
+
+	CHECK(OpenImage("migrate.bin", true));
+	FlashEmulator::SetSpiffsDir(dir.c_str());
+	WirelessConfigurationMgr *mgr = Boot();
+	WirelessConfigurationData temp;
+	CHECK(mgr->GetSsid("migrated", temp) < 0);
+	CHECK(mgr->SetSsid(MakeSsid("lost", "password"), false) < 0);
+
+	unlink((creds5 + "/0").c_str());
+	rmdir(creds5.c_str());
+	rmdir(creds.c_str());
+	mgr = Boot();
+	FlashEmulator::SetSpiffsDir(nullptr);
+
+	CHECK(mgr->GetSsid("migrated", temp) == 4 && strcmp(temp.password, "oldpassword") == 0);
+	CHECK(IsTableConsistent(mgr));
+
+	mgr = Boot();
+	CHECK(HasPassword(mgr, "migrated", "oldpassword"));
+
+	unlink((ssids + "/0").c_str());
+	unlink((ssids + "/4").c_str());
+	rmdir(ssids.c_str());
+	rmdir(dir.c_str());
+}
+
+// The changes made after each power failure point. Each one either happens completely or not at all.
+static void PowerFailWorkload()
+{
+	WirelessConfigurationMgr *mgr = Boot();
+	mgr->SetSsid(MakeSsid("net1", "new"), false);
+	mgr->SetSsid(MakeSsid("net9", "password9"), false);
+	const uint32_t sizes[5] = { 20, 6000, 1500, 900, 0 };
+	AddEnterpriseSsid(mgr, MakeEnterpriseSsid("ent2", sizes));
+	mgr->EraseSsid("net2");
+}
+
+static void CheckAfterPowerFail(long budget)
+{
+	const int before = failures;
+	WirelessConfigurationMgr *mgr = Boot();
+	WirelessConfigurationData data;
+
+	const bool net1New = HasPassword(mgr, "net1", "new");
+	const bool net9 = mgr->GetSsid("net9", data) > 0;
+	const bool ent2 = mgr->GetSsid("ent2", data) > 0;
+	const bool net2 = mgr->GetSsid("net2", data) > 0;
+
+	CHECK(net1New || HasPassword(mgr, "net1", "old"));
+	CHECK(!net9 || (net1New && HasPassword(mgr, "net9", "password9")));
+	CHECK(!ent2 || (net9 && HasCredentials(mgr, "ent2")));
+	CHECK(net2 ? HasPassword(mgr, "net2", "password2") : ent2);
+	CHECK(HasPassword(mgr, "net3", "password3"));
+	CHECK(HasCredentials(mgr, "ent1"));
+	CHECK(IsTableConsistent(mgr));
+
+	// The store must still take changes
+	CHECK(mgr->SetSsid(MakeSsid("after", "failure"), false) > 0);
+	mgr = Boot();
+	CHECK(HasPassword(mgr, "after", "failure"));
+
+	if (failures != before)
+	{
+		printf("after power failure at operation %ld\n", budget);
+	}
+}
+
+static void TestPowerFailures()
+{
+	// Set up the networks that the workload changes, and keep a copy of the flash
+	CHECK(OpenImage("powerfail.bin", true));
+	WirelessConfigurationMgr *mgr = Boot();
+	CHECK(mgr->SetSsid(MakeSsid("net1", "old"), false) > 0);
+	CHECK(mgr->SetSsid(MakeSsid("net2", "password2"), false) > 0);
+	CHECK(mgr->SetSsid(MakeSsid("net3", "password3"), false) > 0);
+	const uint32_t sizes[5] = { 16, 4000, 2000, 1000, 0 };
+	CHECK(AddEnterpriseSsid(mgr, MakeEnterpriseSsid("ent1", sizes)));
+	const std::vector<uint8_t> baseline(FlashEmulator::GetImage(), FlashEmulator::GetImage() + FlashEmulator::FlashSize);
+
+	// Find how many flash operations the workload takes
+	FlashEmulator::ResetStats();
+	PowerFailWorkload();
+	const long total = FlashEmulator::GetStats().writeBytes + FlashEmulator::GetStats().erases;
+
+	// Fail the power at points spread over the workload. The workload runs in a child process, which
+	// exits when the power fails, and the flash image it leaves is then booted.
+	const long step = std::max<long>(1, total / 400);
+	for (long budget = 0; budget <= total; budget += step)
+	{
+		memcpy(FlashEmulator::GetImage(), baseline.data(), baseline.size());
+		fflush(stdout);
+		const pid_t pid = fork();
+		if (pid == 0)
+		{
+			FlashEmulator::SetPowerFail(budget);
+			PowerFailWorkload();
+			_exit(0);
+		}
+
+		int status = 0;
+		CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+		CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == FlashEmulator::PowerFailExitCode || WEXITSTATUS(status) == 0));
+		CheckAfterPowerFail(budget);
+	}
+	printf("power failures injected over %ld flash operations\n", total);
+}
+
+int main(int argc, char *argv[])
+{
+	workDir = (argc > 1) ? argv[1] : ".";
+
+	static const struct { const char *name; void (*func)(); } tests[] =
+	{
+		{ "fresh store", TestFreshStore },
+		{ "remembered networks", TestRememberedNetworks },
+		{ "unreadable store", TestUnreadableStore },
+		{ "enterprise networks", TestEnterpriseNetworks },
+		{ "spiffs migration", TestSpiffsMigration },
+		{ "credential cache upgrade", TestCredentialCacheUpgrade },
+		{ "access points", TestAccessPoints },
+		{ "power failures", TestPowerFailures },
+	};
+
+	for (const auto& t : tests)
+	{
+		const int before = failures;
+		t.func();
+		printf("%s: %s\n", t.name, (failures == before) ? "ok" : "FAILED");
+	}
+
+	FlashEmulator::Close();
+	return (failures == 0) ? 0 : 1;
+}
+
+// End
@@ -0,0 +1,23 @@
+/*
+ * esp_err.h
+ *
+ * Host stand-in for the ESP-IDF error codes used by the storage code.
+ */
+
+#ifndef HOST_TEST_ESP_ERR_H_
+#define HOST_TEST_ESP_ERR_H_
+
+#include <cstdint>
+
+typedef int esp_err_t;
+
+#define ESP_OK					0
+#define ESP_FAIL				-1
+#define ESP_ERR_NO_MEM			0x101
+#define ESP_ERR_INVALID_ARG		0x102
+#define ESP_ERR_INVALID_STATE	0x103
+#define ESP_ERR_INVALID_SIZE	0x104
+#define ESP_ERR_NOT_FOUND		0x105
+#define ESP_ERR_FLASH_BASE		0x6000
+
+#endif /* HOST_TEST_ESP_ERR_H_ */
@@ -0,0 +1,31 @@
+/*
+ * esp_spi_flash.h
+ *
+ * Host stand-in for the ESP-IDF SPI flash API, implemented by FlashEmulator.
+ */
+
+#ifndef HOST_TEST_ESP_SPI_FLASH_H_
+#define HOST_TEST_ESP_SPI_FLASH_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_err.h"
+
+#define SPI_FLASH_SEC_SIZE		4096
+#define SPI_FLASH_MMU_PAGE_SIZE	0x10000
+
+typedef enum
+{
+	SPI_FLASH_MMAP_DATA,
+	SPI_FLASH_MMAP_INST,
+} spi_flash_mmap_memory_t;
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+esp_err_t spi_flash_erase_range(size_t start_address, size_t size);
+esp_err_t spi_flash_write(size_t dest_addr, const void *src, size_t size);
+esp_err_t spi_flash_read(size_t src_addr, void *dest, size_t size);
+void spi_flash_munmap(spi_flash_mmap_handle_t handle);
+
+#endif /* HOST_TEST_ESP_SPI_FLASH_H_ */
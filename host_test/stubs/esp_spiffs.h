@@ -0,0 +1,25 @@
+/*
+ * esp_spiffs.h
+ *
+ * Host stand-in for the ESP-IDF SPIFFS VFS driver. FlashEmulator serves the files from a host directory.
+ */
+
+#ifndef HOST_TEST_ESP_SPIFFS_H_
+#define HOST_TEST_ESP_SPIFFS_H_
+
+#include <cstddef>
+
+#include "esp_err.h"
+
+typedef struct
+{
+	const char *base_path;
+	const char *partition_label;
+	size_t max_files;
+	bool format_if_mount_failed;
+} esp_vfs_spiffs_conf_t;
+
+esp_err_t esp_vfs_spiffs_register(const esp_vfs_spiffs_conf_t *conf);
+esp_err_t esp_vfs_spiffs_unregister(const char *partition_label);
+
+#endif /* HOST_TEST_ESP_SPIFFS_H_ */
@@ -0,0 +1,19 @@
+/*
+ * FreeRTOS.h
+ *
+ * Host stand-in for the FreeRTOS types used by the storage code.
+ */
+
+#ifndef HOST_TEST_FREERTOS_H_
+#define HOST_TEST_FREERTOS_H_
+
+#include <cstdint>
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE			0
+#define pdTRUE			1
+#define portMAX_DELAY	((TickType_t)0xffffffffUL)
+
+#endif /* HOST_TEST_FREERTOS_H_ */
@@ -0,0 +1,18 @@
+/*
+ * semphr.h
+ *
+ * Host stand-in for the FreeRTOS recursive mutex API, implemented by FlashEmulator with std::recursive_mutex.
+ */
+
+#ifndef HOST_TEST_SEMPHR_H_
+#define HOST_TEST_SEMPHR_H_
+
+#include "FreeRTOS.h"
+
+typedef void *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex();
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t ticks);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex);
+
+#endif /* HOST_TEST_SEMPHR_H_ */
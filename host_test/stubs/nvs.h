@@ -0,0 +1,29 @@
+/*
+ * nvs.h
+ *
+ * Host stand-in for the ESP-IDF NVS API. There is no NVS data on the emulated flash, so nothing is ever found.
+ */
+
+#ifndef HOST_TEST_NVS_H_
+#define HOST_TEST_NVS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_err.h"
+
+#define ESP_ERR_NVS_BASE		0x1100
+#define ESP_ERR_NVS_NOT_FOUND	(ESP_ERR_NVS_BASE + 0x02)
+
+typedef uint32_t nvs_handle_t;
+
+typedef enum
+{
+	NVS_READONLY,
+	NVS_READWRITE
+} nvs_open_mode_t;
+
+esp_err_t nvs_open_from_partition(const char *part_name, const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length);
+
+#endif /* HOST_TEST_NVS_H_ */
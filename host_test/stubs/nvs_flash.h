@@ -0,0 +1,15 @@
+/*
+ * nvs_flash.h
+ *
+ * Host stand-in for the ESP-IDF NVS initialisation API.
+ */
+
+#ifndef HOST_TEST_NVS_FLASH_H_
+#define HOST_TEST_NVS_FLASH_H_
+
+#include "nvs.h"
+#include "esp_partition.h"
+
+esp_err_t nvs_flash_init_partition_ptr(const esp_partition_t *partition);
+
+#endif /* HOST_TEST_NVS_FLASH_H_ */
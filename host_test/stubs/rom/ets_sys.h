@@ -0,0 +1,12 @@
+/*
+ * ets_sys.h
+ *
+ * Host stand-in for the ROM printf. Output is only shown if HOST_TEST_VERBOSE is set in the environment.
+ */
+
+#ifndef HOST_TEST_ETS_SYS_H_
+#define HOST_TEST_ETS_SYS_H_
+
+extern "C" int ets_printf(const char *fmt, ...);
+
+#endif /* HOST_TEST_ETS_SYS_H_ */
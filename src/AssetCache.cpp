@@ -0,0 +1,219 @@
+/*
+ * AssetCache.cpp
+ *
+ * Static web assets stored in their own flash partition.
+ *
+ * The partition starts with a directory of fixed size entries, followed by the content of the assets.
+ * Content is appended after the last asset stored, and the directory entry is written last with its
+ * magic number written separately, so that an asset that was not completely stored is never served.
+ * Replacing an asset marks the old entry deleted; its space is only reclaimed when the cache is cleared.
+ */
+
+#include "AssetCache.h"
+
+#if SUPPORT_ASSET_CACHE
+
+#include <cstring>
+
+#include "esp_spi_flash.h"
+#include "rom/ets_sys.h"
+
+// Static data
+const esp_partition_t *AssetCache::partition = nullptr;
+const uint8_t *AssetCache::base = nullptr;
+size_t AssetCache::nextEntry = 0;
+uint32_t AssetCache::nextContent = 0;
+uint32_t AssetCache::generation = 0;
+bool AssetCache::pending = false;
+AssetCache::Entry AssetCache::pendingEntry;
+uint32_t AssetCache::pendingWritten = 0;
+uint32_t AssetCache::hits = 0;
+uint32_t AssetCache::notModified = 0;
+
+/*static*/ void AssetCache::Init()
+{
+	partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "assets");
+	if (partition == nullptr)
+	{
+		debugPrintAlways("no asset partition\n");
+		return;
+	}
+
+	// Memory map the partition, remembering the base pointer for the lifetime of the app
+	spi_flash_mmap_handle_t mapHandle;
+	if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, reinterpret_cast<const void**>(&base), &mapHandle) != ESP_OK)
+	{
+		debugPrintAlways("can't map asset partition\n");
+		partition = nullptr;
+		return;
+	}
+
+	Scan();
+}
+
+// Find the first unused directory entry and the end of the stored content
+/*static*/ void AssetCache::Scan()
+{
+	nextEntry = MaxEntries;
+	nextContent = DirectorySize;
+	for (size_t i = 0; i < MaxEntries; ++i)
+	{
+		// An entry whose magic number was never written is not reused, because its other fields were
+		const Entry * const entry = GetEntry(i);
+		if (entry->magic == EntryUnused && entry->offset == EntryUnused)
+		{
+			nextEntry = i;
+			break;
+		}
+
+		// Deleted and abandoned entries still use their content space
+		if (entry->offset >= DirectorySize && entry->offset < partition->size && entry->length <= partition->size - entry->offset)
+		{
+			const uint32_t end = (entry->offset + entry->length + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+			if (end > nextContent)
+			{
+				nextContent = end;
+			}
+		}
+	}
+}
+
+/*static*/ const AssetCache::Entry *AssetCache::Find(const char *path)
+{
+	if (partition == nullptr)
+	{
+		return nullptr;
+	}
+
+	for (size_t i = 0; i < nextEntry; ++i)
+	{
+		const Entry * const entry = GetEntry(i);
+		if (entry->magic == EntryValid && strncmp(entry->path, path, sizeof(entry->path)) == 0)
+		{
+			return entry;
+		}
+	}
+	return nullptr;
+}
+
+/*static*/ bool AssetCache::Clear()
+{
+	if (partition == nullptr)
+	{
+		return false;
+	}
+
+	++generation;
+	pending = false;
+
+	// Only the directory needs to be erased, content sectors are erased by Write as they are reached
+	const bool ok = esp_partition_erase_range(partition, 0, DirectorySize) == ESP_OK;
+	Scan();
+	return ok;
+}
+
+/*static*/ bool AssetCache::Begin(const AssetCacheInfo& info)
+{
+	if (partition == nullptr || nextEntry >= MaxEntries || info.length > partition->size - nextContent)
+	{
+		return false;
+	}
+
+	memset(&pendingEntry, 0, sizeof(pendingEntry));
+	pendingEntry.magic = EntryUnused;
+	pendingEntry.offset = nextContent;
+	pendingEntry.length = info.length;
+	pendingEntry.flags = info.flags;
+	memcpy(pendingEntry.path, info.path, sizeof(pendingEntry.path));
+	pendingEntry.path[sizeof(pendingEntry.path) - 1] = 0;
+	memcpy(pendingEntry.etag, info.etag, sizeof(pendingEntry.etag));
+	pendingEntry.etag[sizeof(pendingEntry.etag) - 1] = 0;
+	memcpy(pendingEntry.contentType, info.contentType, sizeof(pendingEntry.contentType));
+	pendingEntry.contentType[sizeof(pendingEntry.contentType) - 1] = 0;
+	pendingWritten = 0;
+	pending = true;
+	return true;
+}
+
+// Store the next chunk of the pending asset. Sectors are erased as they are reached, to spread the erase time over the chunks.
+/*static*/ bool AssetCache::Write(uint32_t offset, const void *data, size_t length)
+{
+	if (!pending || offset != pendingWritten || length > pendingEntry.length - pendingWritten)
+	{
+		return false;
+	}
+
+	const uint32_t start = pendingEntry.offset + offset;
+	const uint32_t firstUnerased = (start + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+	const uint32_t end = start + length;
+	if (end > firstUnerased)
+	{
+		const uint32_t eraseEnd = (end + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1);
+		if (esp_partition_erase_range(partition, firstUnerased, eraseEnd - firstUnerased) != ESP_OK)
+		{
+			pending = false;
+			return false;
+		}
+	}
+
+	if (esp_partition_write(partition, start, data, length) != ESP_OK)
+	{
+		pending = false;
+		return false;
+	}
+	pendingWritten += length;
+	return true;
+}
+
+/*static*/ bool AssetCache::Commit()
+{
+	if (!pending || pendingWritten != pendingEntry.length)
+	{
+		pending = false;
+		return false;
+	}
+	pending = false;
+
+	// Write the entry apart from the magic number, then the magic number to make it valid
+	const size_t entryOffset = nextEntry * sizeof(Entry);
+	const uint32_t valid = EntryValid;
+	if (   esp_partition_write(partition, entryOffset + sizeof(uint32_t), &pendingEntry.offset, sizeof(Entry) - sizeof(uint32_t)) != ESP_OK
+		|| esp_partition_write(partition, entryOffset, &valid, sizeof(valid)) != ESP_OK
+	   )
+	{
+		Scan();
+		return false;
+	}
+
+	// Delete any older entry for the same path. Clearing bits doesn't need an erase.
+	const uint32_t deleted = EntryDeleted;
+	for (size_t i = 0; i < nextEntry; ++i)
+	{
+		const Entry * const entry = GetEntry(i);
+		if (entry->magic == EntryValid && strncmp(entry->path, pendingEntry.path, sizeof(entry->path)) == 0)
+		{
+			esp_partition_write(partition, i * sizeof(Entry), &deleted, sizeof(deleted));
+		}
+	}
+
+	Scan();
+	return true;
+}
+
+/*static*/ void AssetCache::Report()
+{
+	size_t numValid = 0;
+	for (size_t i = 0; i < nextEntry; ++i)
+	{
+		if (GetEntry(i)->magic == EntryValid)
+		{
+			++numValid;
+		}
+	}
+	ets_printf("Assets: %u cached, %u of %u bytes used, %u served, %u not modified\n",
+				numValid, nextContent, (partition != nullptr) ? partition->size : 0, hits, notModified);
+}
+
+#endif
+
+// End
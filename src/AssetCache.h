@@ -0,0 +1,77 @@
+/*
+ * AssetCache.h
+ *
+ * Static web assets stored in their own flash partition, so that requests for them can be
+ * answered by the ESP without involving the Duet main processor.
+ */
+
+#ifndef SRC_ASSETCACHE_H_
+#define SRC_ASSETCACHE_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "esp_partition.h"
+
+#include "include/MessageFormats.h"
+#include "Config.h"
+
+#if SUPPORT_ASSET_CACHE
+
+class AssetCache
+{
+public:
+	// Directory entry as stored in flash
+	struct Entry
+	{
+		uint32_t magic;						// EntryValid, EntryDeleted, or all ones if the entry is unused
+		uint32_t offset;					// where the content starts in the partition
+		uint32_t length;
+		uint8_t flags;						// as in AssetCacheInfo
+		uint8_t dummy[3];
+		char path[MaxAssetPathLength];
+		char etag[MaxAssetEtagLength];
+		char contentType[MaxAssetContentTypeLength];
+	};
+
+	static void Init();
+	static const Entry *Find(const char *path);
+	static const uint8_t *GetContent(const Entry *entry) { return base + entry->offset; }
+	static uint32_t GetGeneration() { return generation; }
+
+	static bool Clear();
+	static bool Begin(const AssetCacheInfo& info);
+	static bool Write(uint32_t offset, const void *data, size_t length);
+	static bool Commit();
+
+	static void CountHit() { ++hits; }
+	static void CountNotModified() { ++notModified; }
+	static void Report();
+
+private:
+	static constexpr uint32_t EntryValid = 0x31545341;		// "AST1"
+	static constexpr uint32_t EntryDeleted = 0;
+	static constexpr uint32_t EntryUnused = 0xFFFFFFFF;
+	static constexpr size_t DirectorySize = 2 * SPI_FLASH_SEC_SIZE;
+	static constexpr size_t MaxEntries = DirectorySize / sizeof(Entry);
+
+	static const Entry *GetEntry(size_t index) { return reinterpret_cast<const Entry*>(base) + index; }
+	static void Scan();
+
+	static const esp_partition_t *partition;
+	static const uint8_t *base;				// the partition mapped into the data address space
+	static size_t nextEntry;				// index of the first unused directory entry
+	static uint32_t nextContent;			// offset of the first free sector after the stored content
+	static uint32_t generation;				// incremented whenever stored content may be overwritten
+
+	static bool pending;					// true while an asset is being stored
+	static Entry pendingEntry;
+	static uint32_t pendingWritten;			// how much of the pending content has been written
+
+	static uint32_t hits;
+	static uint32_t notModified;
+};
+
+#endif
+
+#endif /* SRC_ASSETCACHE_H_ */
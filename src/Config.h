@@ -94,6 +94,24 @@ const uint32_t defaultClockControl = 0x2003;		// 80MHz/4, mark:space 2:1
 
 #endif
 
+#ifdef ESP8266
+#define SUPPORT_TLS		0				// not enough RAM for TLS sessions
+#else
+#define SUPPORT_TLS		1
+#endif
+
+#ifdef ESP8266
+#define SUPPORT_ASSET_CACHE	0				// no flash to spare for a static asset cache
+#else
+#define SUPPORT_ASSET_CACHE	1
+#endif
+
+#ifdef ESP8266
+#define SUPPORT_COMPRESSION	0				// not enough RAM for the compression workspace
+#else
+#define SUPPORT_COMPRESSION	1
+#endif
+
 const uint8_t Backlog = 8;
 
 #define ARRAY_SIZE(_x) (sizeof(_x)/sizeof((_x)[0]))
@@ -116,16 +134,24 @@ const uint8_t Backlog = 8;
 #define CONN_POLL_PRIO							(ESP_TASKD_EVENT_PRIO - 1)
 #define CONNECTION_PRIO							(MAIN_PRIO + 1)
 #define DNS_SERVER_PRIO							(ESP_TASK_MAIN_PRIO)
+#define STORAGE_CHECK_PRIO						(ESP_TASK_MAIN_PRIO)
+#define ROAM_PRIO								(ESP_TASK_MAIN_PRIO)
+#define TLS_HANDSHAKE_PRIO						(ESP_TASK_MAIN_PRIO)	// below the main task, so handshakes don't hold up SPI transfers
 
 
 #ifdef ESP8266
 #define CONN_POLL_STACK							(1492)
 #define CONNECTION_TASK  						(742)
 #define DNS_SERVER_STACK						(592)
+#define STORAGE_CHECK_STACK						(1024)
+#define ROAM_STACK								(1024)
 #else
 #define CONN_POLL_STACK							(2260)
-#define CONNECTION_TASK	 						(1560)
+#define CONNECTION_TASK	 						(4096)			// may have to load the TLS credentials when accepting a connection
 #define DNS_SERVER_STACK						(1360)
+#define STORAGE_CHECK_STACK						(2048)
+#define ROAM_STACK								(2048)
+#define TLS_HANDSHAKE_STACK						(6144)			// the mbedTLS handshake, including the private key operation
 #endif
 
 #endif
@@ -5,13 +5,26 @@
  *      Author: David
  */
 #include <cstring> 			// memcpy
+#include <cstdio>				// for snprintf
+#include <cstdlib>				// for strtoul
+#include <strings.h>			// for strcasecmp
 #include <algorithm>			// for std::min
+#include <new>
 
 #include "lwip/tcp.h"
+#include "lwip/tcpip.h"
+#include "lwip/dns.h"
+#include "lwip/priv/tcp_priv.h"	// for TCP_SLOW_INTERVAL, tcp_active_pcbs, tcp_tw_pcbs
+#include "lwip/stats.h"
+#include "tcpip_adapter.h"
 
 #include "Listener.h"
 #include "Connection.h"
-#include "Misc.h"				// for millis
+#include "TlsSession.h"
+#include "HttpParser.h"
+#include "AssetCache.h"
+#include "WebSocket.h"
+#include "Misc.h"				// for millis, SafeStrncpy
 #include "Config.h"
 
 
@@ -20,6 +33,7 @@ typedef enum
 	Accept,
 	Close,
 	Terminate,
+	Resolved,
 } ConnectionEventType;
 
 typedef struct
@@ -29,18 +43,496 @@ typedef struct
 		int i;
 		void* ptr;
 	} data;
+	ip_addr_t ip;				// resolved address for a Resolved event, all zeros if the name could not be resolved
 } ConnectionEvent;
 
+// Host name resolution request, passed to the TCP/IP task
+struct ResolveRequest
+{
+	uintptr_t token;			// connection number in the low byte, resolve sequence number above it
+	char hostName[HostNameLength + 1];
+};
+
 static const uint32_t MaxAckTime = 4000;		// how long we wait for a connection to acknowledge the remaining data before it is closed
+static const uint32_t PcbCheckInterval = 250;	// how often we check how many TCP PCBs are in use, in milliseconds
+static const uint16_t MinFreePcbs = 2;			// recycle TIME_WAIT PCBs when fewer than this many are free
+static const size_t MaxHttpHeaderLength = MaxDataLength - sizeof(HttpRequestPrefix);	// longest header block we frame
+#if SUPPORT_TLS
+static const size_t MaxTlsPlainText = 2 * MaxDataLength;	// how much decrypted data we hold for the Duet main processor per connection
+#endif
 
 // Public interface
 Connection::Connection(uint8_t num)
-	: number(num), localPort(0), remotePort(0), remoteIp(0), conn(nullptr), state(ConnState::free),
-	readBuf(nullptr), readIndex(0), alreadyRead(0)
+	: number(num), udp(false), resolveSequence(0), resolvePending(false), resolvedSequence(0), localPort(0), remotePort(0), conn(nullptr), tls(nullptr), tlsCloseStartedAt(0), state(ConnState::free),
+	readBuf(nullptr), readIndex(0), alreadyRead(0), datagramHead(0), datagramCount(0),
+	httpPhase(HttpPhase::none), httpMethod(HttpMethod::other), httpFlags(0), httpHeaderLength(0), httpContentLength(0), httpBodyRemaining(0),
+	serveAssets(false), assetData(nullptr), assetRemaining(0), assetGeneration(0),
+	acceptWebSockets(false), wsFramePending(false), wsFinal(false), wsFirst(false), wsInMessage(false), wsClosing(false), wsCloseSent(false),
+	wsOpcode(0), wsMaskIndex(0), wsPayloadRemaining(0)
 {
+	ip_addr_set_zero_ip4(&remoteIp);
+	ip_addr_set_zero_ip4(&resolvedIp);
+	ResetStats();
 }
 
 size_t Connection::Read(uint8_t *data, size_t length)
+{
+	++readCalls;
+	switch (httpPhase)
+	{
+	case HttpPhase::header:
+	case HttpPhase::asset:
+		return 0;
+
+	case HttpPhase::request:
+		return ReadHttpRequest(data, length);
+
+	case HttpPhase::body:
+		{
+			const size_t lengthRead = ReadBuffered(data, std::min<size_t>(length, httpBodyRemaining));
+			httpBodyRemaining -= lengthRead;
+			if (httpBodyRemaining == 0)
+			{
+				httpPhase = HttpPhase::header;
+				ScanHttpRequest();					// the next request may already be here
+			}
+			return lengthRead;
+		}
+
+	case HttpPhase::webSocket:
+		return ReadWebSocket(data, length);
+
+	default:
+		return ReadBuffered(data, length);
+	}
+}
+
+// Return the prefix, the header block and as much of the body as is available and fits.
+// If the buffer is too small for the prefix and the header block then the request is passed through unframed,
+// so that the Duet main processor can take it in pieces.
+size_t Connection::ReadHttpRequest(uint8_t *data, size_t length)
+{
+	if (length < sizeof(HttpRequestPrefix) || readBuf == nullptr)
+	{
+		return 0;
+	}
+
+	if (length < sizeof(HttpRequestPrefix) + httpHeaderLength)
+	{
+		if (httpFlags & HttpRequestPrefix::FlagWebSocket)
+		{
+			// We have already accepted the upgrade, so the Duet main processor can't be left to parse the connection itself
+			Terminate(false);
+			return 0;
+		}
+		httpHeaderLength = 0;
+		httpContentLength = 0;
+		httpMethod = HttpMethod::other;
+		httpFlags = HttpRequestPrefix::FlagUnframed;
+	}
+
+	const size_t headerSize = sizeof(HttpRequestPrefix) + httpHeaderLength;
+
+	const bool unframed = (httpFlags & (HttpRequestPrefix::FlagChunked | HttpRequestPrefix::FlagUnframed)) != 0;
+	const size_t bodyAvailable = readBuf->tot_len - readIndex - httpHeaderLength;
+	const size_t bodyLength = std::min<size_t>((unframed) ? bodyAvailable : std::min<size_t>(bodyAvailable, httpContentLength), length - headerSize);
+
+	HttpRequestPrefix prefix;
+	prefix.headerLength = httpHeaderLength;
+	prefix.bodyLength = bodyLength;
+	prefix.contentLength = httpContentLength;
+	prefix.method = httpMethod;
+	prefix.flags = httpFlags;
+	prefix.dummy = 0;
+	memcpy(data, &prefix, sizeof(prefix));
+	const size_t lengthRead = ReadBuffered(data + sizeof(prefix), httpHeaderLength + bodyLength);
+
+	if (httpFlags & HttpRequestPrefix::FlagWebSocket)
+	{
+		// We have already accepted the upgrade, so anything that follows is WebSocket frames
+		httpPhase = HttpPhase::webSocket;
+		wsFramePending = wsInMessage = wsClosing = wsCloseSent = false;
+		ProcessWebSocket();
+	}
+	else if (unframed)
+	{
+		httpPhase = HttpPhase::passThrough;
+	}
+	else
+	{
+		httpBodyRemaining = httpContentLength - bodyLength;
+		httpPhase = (httpBodyRemaining != 0) ? HttpPhase::body : HttpPhase::header;
+		if (httpPhase == HttpPhase::header)
+		{
+			ScanHttpRequest();
+		}
+	}
+	return sizeof(prefix) + lengthRead;
+}
+
+// See whether a complete header block has been received, and if so record the details that go in the prefix
+void Connection::ScanHttpRequest()
+{
+	if (readBuf == nullptr)
+	{
+		return;
+	}
+
+	const size_t headerLength = HttpFindHeaderEnd(readBuf, readIndex);
+	if (headerLength == 0 || headerLength > MaxHttpHeaderLength)
+	{
+		// If it's too long to frame, or the rest of it will never come, let the Duet main processor deal with this connection itself
+		const bool incomplete = (headerLength == 0 && state == ConnState::otherEndClosed);
+		if (headerLength != 0 || readBuf->tot_len - readIndex > MaxHttpHeaderLength || incomplete)
+		{
+			httpHeaderLength = 0;
+			httpContentLength = 0;
+			httpMethod = HttpMethod::other;
+			httpFlags = HttpRequestPrefix::FlagUnframed | ((incomplete) ? HttpRequestPrefix::FlagIncomplete : 0);
+			httpPhase = HttpPhase::request;
+		}
+		return;
+	}
+
+	httpHeaderLength = headerLength;
+	httpMethod = HttpGetMethod(readBuf, readIndex);
+	httpFlags = 0;
+	httpContentLength = 0;
+
+	char value[16];
+	if (HttpGetField(readBuf, readIndex, headerLength, "Transfer-Encoding", value, sizeof(value)) && strcasecmp(value, "identity") != 0)
+	{
+		httpFlags |= HttpRequestPrefix::FlagChunked;
+	}
+	else if (HttpGetField(readBuf, readIndex, headerLength, "Content-Length", value, sizeof(value)))
+	{
+		httpContentLength = strtoul(value, nullptr, 10);
+	}
+
+	if (   acceptWebSockets && httpMethod == HttpMethod::get
+		&& httpContentLength == 0 && (httpFlags & HttpRequestPrefix::FlagChunked) == 0
+		&& AcceptWebSocket()
+	   )
+	{
+		httpFlags |= HttpRequestPrefix::FlagWebSocket;
+	}
+#if SUPPORT_ASSET_CACHE
+	else if (   serveAssets && (httpMethod == HttpMethod::get || httpMethod == HttpMethod::head)
+		&& httpContentLength == 0 && (httpFlags & HttpRequestPrefix::FlagChunked) == 0
+		&& ServeAsset()
+	   )
+	{
+		return;
+	}
+#endif
+	httpPhase = HttpPhase::request;
+}
+
+#if SUPPORT_ASSET_CACHE
+
+// If the request whose header block is ready is for a cached asset, answer it ourselves and return true.
+// Clients are told to revalidate every time, so that a changed asset is picked up as soon as it has been stored.
+bool Connection::ServeAsset()
+{
+	char uri[MaxAssetPathLength];
+	if (!HttpGetUri(readBuf, readIndex, httpHeaderLength, uri, sizeof(uri)))
+	{
+		return false;
+	}
+
+	const AssetCache::Entry * const entry = AssetCache::Find(uri);
+	if (entry == nullptr)
+	{
+		return false;
+	}
+
+	// The If-None-Match field may list several entity tags, or be '*'
+	char tags[128];
+	char quotedTag[MaxAssetEtagLength + 2];
+	snprintf(quotedTag, sizeof(quotedTag), "\"%s\"", entry->etag);
+	const bool notModified = HttpGetField(readBuf, readIndex, httpHeaderLength, "If-None-Match", tags, sizeof(tags))
+								&& (strcmp(tags, "*") == 0 || strstr(tags, quotedTag) != nullptr);
+
+	char response[256];
+	int length;
+	if (notModified)
+	{
+		length = snprintf(response, sizeof(response), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: no-cache\r\n\r\n", quotedTag);
+		AssetCache::CountNotModified();
+	}
+	else
+	{
+		length = snprintf(response, sizeof(response),
+							"HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %u\r\n%sETag: %s\r\nCache-Control: no-cache\r\n\r\n",
+							entry->contentType, entry->length,
+							(entry->flags & AssetCacheInfo::FlagGzip) ? "Content-Encoding: gzip\r\n" : "",
+							quotedTag);
+		AssetCache::CountHit();
+	}
+
+	ReadBuffered(nullptr, httpHeaderLength);				// the Duet main processor never sees this request
+	if (Write(reinterpret_cast<const uint8_t*>(response), length, false, false) == 0)
+	{
+		return true;										// the connection has failed
+	}
+
+	if (!notModified && httpMethod == HttpMethod::get && entry->length != 0)
+	{
+		assetData = AssetCache::GetContent(entry);
+		assetRemaining = entry->length;
+		assetGeneration = AssetCache::GetGeneration();
+		httpPhase = HttpPhase::asset;
+		PollAsset();
+	}
+	else
+	{
+		httpPhase = HttpPhase::header;
+		ScanHttpRequest();									// the next request may already be here
+	}
+	return true;
+}
+
+// Send as much of the cached asset as the connection will take. The content is copied straight from the memory mapped flash.
+void Connection::PollAsset()
+{
+	if (state != ConnState::connected)
+	{
+		assetRemaining = 0;									// the other end has gone away
+		httpPhase = HttpPhase::header;
+		return;
+	}
+
+	if (AssetCache::GetGeneration() != assetGeneration)
+	{
+		// The asset was overwritten while we were sending it, so the client can't be given a valid response
+		assetRemaining = 0;
+		Terminate(false);
+		return;
+	}
+
+	const size_t space = CanWrite();
+	if (space == 0)
+	{
+		return;
+	}
+
+	const size_t amount = std::min<size_t>(space, assetRemaining);
+	if (Write(assetData, amount, amount == assetRemaining, false) == 0)
+	{
+		return;
+	}
+
+	assetData += amount;
+	assetRemaining -= amount;
+	if (assetRemaining == 0)
+	{
+		httpPhase = HttpPhase::header;
+		ScanHttpRequest();
+	}
+}
+
+#endif
+
+// If the request whose header block is ready asks for a WebSocket upgrade, send the response that accepts it and return true.
+// The request is still passed to the Duet main processor, so that it knows which resource the WebSocket is for.
+bool Connection::AcceptWebSocket()
+{
+	char value[32];
+	if (   !HttpGetField(readBuf, readIndex, httpHeaderLength, "Upgrade", value, sizeof(value)) || strcasecmp(value, "websocket") != 0
+		|| !HttpGetField(readBuf, readIndex, httpHeaderLength, "Sec-WebSocket-Version", value, sizeof(value)) || strcmp(value, "13") != 0
+		|| !HttpGetField(readBuf, readIndex, httpHeaderLength, "Sec-WebSocket-Key", value, sizeof(value))
+	   )
+	{
+		return false;
+	}
+
+	char accept[WsAcceptKeyLength + 1];
+	if (!WebSocketAcceptKey(value, accept))
+	{
+		return false;
+	}
+
+	char response[128];
+	const int length = snprintf(response, sizeof(response),
+								"HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+	Send(reinterpret_cast<const uint8_t*>(response), length, true);		// if this fails then the connection has been terminated
+	return true;
+}
+
+// Take the headers of received frames until we reach a data frame or run out of data. Control frames are answered here.
+void Connection::ProcessWebSocket()
+{
+	while (!wsFramePending && !wsClosing && readBuf != nullptr)
+	{
+		WebSocketFrameHeader frame;
+		const size_t headerLength = WebSocketParseHeader(readBuf, readIndex, frame);
+		if (headerLength == 0)
+		{
+			return;
+		}
+
+		// Frames from a client must be masked, and a fragmented message may only be interleaved with control frames
+		const bool control = (frame.opcode & 0x08) != 0;
+		const bool valid = (control)
+							? frame.final && frame.length <= WsMaxControlPayload
+								&& (frame.opcode == WsOpcodeClose || frame.opcode == WsOpcodePing || frame.opcode == WsOpcodePong)
+							: frame.opcode <= WsOpcodeBinary && (frame.opcode == WsOpcodeContinuation) == wsInMessage;
+		if (!valid || !frame.masked || frame.reserved)
+		{
+			CloseWebSocket(WsCloseProtocolError);
+			return;
+		}
+		if (frame.length > UINT32_MAX)
+		{
+			CloseWebSocket(WsCloseTooBig);
+			return;
+		}
+
+		if (!control)
+		{
+			ReadBuffered(nullptr, headerLength);
+			if (frame.opcode != WsOpcodeContinuation)
+			{
+				wsOpcode = frame.opcode;
+				wsFirst = true;
+			}
+			wsInMessage = !frame.final;
+			wsFinal = frame.final;
+			memcpy(wsMask, frame.mask, sizeof(wsMask));
+			wsMaskIndex = 0;
+			wsPayloadRemaining = frame.length;
+			wsFramePending = true;
+			return;
+		}
+
+		// Wait for the whole payload of a control frame
+		if (readBuf->tot_len - readIndex < headerLength + frame.length)
+		{
+			return;
+		}
+
+		uint8_t payload[WsMaxControlPayload];
+		ReadBuffered(nullptr, headerLength);
+		ReadBuffered(payload, frame.length);
+		WebSocketUnmask(payload, frame.length, frame.mask, 0);
+		switch (frame.opcode)
+		{
+		case WsOpcodePing:
+			SendWebSocketFrame(WsOpcodePong, payload, frame.length);
+			break;
+
+		case WsOpcodeClose:
+			// Echo the status code, then the Duet main processor sees the other end as closed
+			if (!wsCloseSent)
+			{
+				wsCloseSent = true;
+				SendWebSocketFrame(WsOpcodeClose, payload, std::min<size_t>(frame.length, 2));
+			}
+			wsClosing = true;
+			if (state == ConnState::connected)
+			{
+				SetState(ConnState::otherEndClosed);
+			}
+			break;
+
+		default:
+			break;											// unsolicited pong
+		}
+	}
+}
+
+// Return the next chunk of the current message preceded by a WebSocketPrefix, unmasking it as it is copied
+size_t Connection::ReadWebSocket(uint8_t *data, size_t length)
+{
+	if (!wsFramePending || length < sizeof(WebSocketPrefix))
+	{
+		return 0;
+	}
+
+	const size_t buffered = (readBuf != nullptr) ? readBuf->tot_len - readIndex : 0;
+	const size_t amount = std::min<size_t>(std::min<size_t>(wsPayloadRemaining, buffered), length - sizeof(WebSocketPrefix));
+	if (amount == 0 && wsPayloadRemaining != 0)
+	{
+		return 0;
+	}
+
+	const size_t lengthRead = ReadBuffered(data + sizeof(WebSocketPrefix), amount);
+	wsMaskIndex = WebSocketUnmask(data + sizeof(WebSocketPrefix), lengthRead, wsMask, wsMaskIndex);
+	wsPayloadRemaining -= lengthRead;
+
+	WebSocketPrefix prefix;
+	prefix.length = lengthRead;
+	prefix.opcode = wsOpcode;
+	prefix.flags = ((wsFirst) ? WebSocketPrefix::FlagFirst : 0) | ((wsFinal && wsPayloadRemaining == 0) ? WebSocketPrefix::FlagFinal : 0);
+	memcpy(data, &prefix, sizeof(prefix));
+	wsFirst = false;
+
+	if (wsPayloadRemaining == 0)
+	{
+		wsFramePending = false;
+		ProcessWebSocket();									// the next frame may already be here
+	}
+	return sizeof(prefix) + lengthRead;
+}
+
+// Send a chunk of a message from the Duet main processor, which starts with a WebSocketPrefix, as one frame
+size_t Connection::WriteWebSocket(const uint8_t *data, size_t length, bool doPush, bool closeAfterSending)
+{
+	if (length < sizeof(WebSocketPrefix) || wsCloseSent)
+	{
+		return 0;
+	}
+
+	WebSocketPrefix prefix;
+	memcpy(&prefix, data, sizeof(prefix));
+	const size_t payloadLength = prefix.length;
+	if (payloadLength > length - sizeof(prefix))
+	{
+		return 0;									// only send whole frames, a partial one would carry the wrong length and FIN bit
+	}
+	const uint8_t opcode = (prefix.flags & WebSocketPrefix::FlagFirst) ? prefix.opcode : WsOpcodeContinuation;
+
+	uint8_t header[WsMaxFrameHeaderLength];
+	const size_t headerLength = WebSocketBuildHeader(header, opcode, (prefix.flags & WebSocketPrefix::FlagFinal) != 0, payloadLength);
+	if (   !Send(header, headerLength, payloadLength == 0 && (doPush || closeAfterSending))
+		|| (payloadLength != 0 && !Send(data + sizeof(prefix), payloadLength, doPush || closeAfterSending))
+	   )
+	{
+		return 0;
+	}
+
+	if (closeAfterSending)
+	{
+		Close();
+	}
+	return length;
+}
+
+bool Connection::SendWebSocketFrame(uint8_t opcode, const uint8_t *data, size_t length)
+{
+	uint8_t header[WsMaxFrameHeaderLength];
+	const size_t headerLength = WebSocketBuildHeader(header, opcode, true, length);
+	return Send(header, headerLength, length == 0) && (length == 0 || Send(data, length, true));
+}
+
+// Send a close frame if we haven't already, and stop taking frames from the other end
+void Connection::CloseWebSocket(uint16_t status)
+{
+	wsClosing = true;
+	if (!wsCloseSent)
+	{
+		const uint8_t payload[2] = { (uint8_t)(status >> 8), (uint8_t)status };
+		wsCloseSent = true;
+		SendWebSocketFrame(WsOpcodeClose, payload, sizeof(payload));
+	}
+	if (state == ConnState::connected)
+	{
+		SetState(ConnState::otherEndClosed);
+	}
+}
+
+// Read data that has been received, without regard to HTTP framing. If 'data' is null then the data is discarded.
+size_t Connection::ReadBuffered(uint8_t *data, size_t length)
 {
 	size_t lengthRead = 0;
 	if (readBuf != nullptr && length != 0 && (state == ConnState::connected || state == ConnState::otherEndClosed))
@@ -48,7 +540,10 @@ size_t Connection::Read(uint8_t *data, size_t length)
 		do
 		{
 			const size_t toRead = std::min<size_t>(readBuf->len - readIndex, length);
-			memcpy(data + lengthRead, (uint8_t *)readBuf->payload + readIndex, toRead);
+			if (data != nullptr)
+			{
+				memcpy(data + lengthRead, (uint8_t *)readBuf->payload + readIndex, toRead);
+			}
 			lengthRead += toRead;
 			readIndex += toRead;
 			length -= toRead;
@@ -63,8 +558,9 @@ size_t Connection::Read(uint8_t *data, size_t length)
 			readIndex = 0;
 		} while (readBuf != nullptr && length != 0);
 
+		// The TLS session tells LWIP about the encrypted data as it decrypts it
 		alreadyRead += lengthRead;
-		if (readBuf == nullptr || alreadyRead >= TCP_MSS)
+		if (tls == nullptr && (readBuf == nullptr || alreadyRead >= TCP_MSS))
 		{
 			netconn_tcp_recvd(conn, alreadyRead);
 			alreadyRead = 0;
@@ -75,8 +571,116 @@ size_t Connection::Read(uint8_t *data, size_t length)
 
 size_t Connection::CanRead() const
 {
-	return ((state == ConnState::connected || state == ConnState::otherEndClosed) && readBuf != nullptr)
-			? readBuf->tot_len - readIndex : 0;
+	if (udp)
+	{
+		// Report the payload length of the oldest datagram, so the Duet main processor knows there is one waiting
+		return (state == ConnState::connected && datagramCount != 0) ? netbuf_len(datagrams[datagramHead]) : 0;
+	}
+	if (!(state == ConnState::connected || state == ConnState::otherEndClosed))
+	{
+		return 0;
+	}
+
+	// An empty WebSocket frame may be pending when nothing is buffered
+	const size_t buffered = (readBuf != nullptr) ? readBuf->tot_len - readIndex : 0;
+	if (buffered == 0 && httpPhase != HttpPhase::webSocket)
+	{
+		return 0;
+	}
+
+	switch (httpPhase)
+	{
+	case HttpPhase::header:
+	case HttpPhase::asset:
+		return 0;
+
+	case HttpPhase::request:
+		{
+			const bool unframed = (httpFlags & (HttpRequestPrefix::FlagChunked | HttpRequestPrefix::FlagUnframed)) != 0;
+			const size_t bodyAvailable = buffered - httpHeaderLength;
+			return sizeof(HttpRequestPrefix) + httpHeaderLength + ((unframed) ? bodyAvailable : std::min<size_t>(bodyAvailable, httpContentLength));
+		}
+
+	case HttpPhase::body:
+		return std::min<size_t>(buffered, httpBodyRemaining);
+
+	case HttpPhase::webSocket:
+		return (!wsFramePending || (wsPayloadRemaining != 0 && buffered == 0)) ? 0
+				: sizeof(WebSocketPrefix) + std::min<size_t>(buffered, wsPayloadRemaining);
+
+	default:
+		return buffered;
+	}
+}
+
+// Take the oldest queued datagram, returning the total length including the UdpDatagramHeader that precedes the payload.
+// If the payload doesn't fit in the buffer then the remainder is discarded. The header always gives the length that the
+// datagram had, so the SAM can tell that it was truncated when that is more than the payload it received.
+size_t Connection::RecvFrom(uint8_t *data, size_t length)
+{
+	++readCalls;
+	if (!udp || state != ConnState::connected || datagramCount == 0 || length < sizeof(UdpDatagramHeader))
+	{
+		return 0;
+	}
+
+	struct netbuf * const buf = datagrams[datagramHead];
+	datagramHead = (datagramHead + 1) % MaxQueuedDatagrams;
+	--datagramCount;
+
+	UdpDatagramHeader hdr;
+	hdr.remoteIp = netbuf_fromaddr(buf)->u_addr.ip4.addr;
+	hdr.remotePort = netbuf_fromport(buf);
+	hdr.length = netbuf_len(buf);
+	const size_t copied = netbuf_copy(buf, data + sizeof(hdr), length - sizeof(hdr));
+	memcpy(data, &hdr, sizeof(hdr));
+	netbuf_delete(buf);
+
+	return sizeof(hdr) + copied;
+}
+
+// Send a datagram. The data starts with a UdpDatagramHeader giving the destination and the payload length.
+bool Connection::SendTo(const uint8_t *data, size_t length)
+{
+	++writeCalls;
+	if (!udp || state != ConnState::connected || length < sizeof(UdpDatagramHeader))
+	{
+		return false;
+	}
+
+	UdpDatagramHeader hdr;
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.length > length - sizeof(hdr))
+	{
+		return false;
+	}
+
+	err_t rc = ERR_MEM;
+	struct netbuf * const buf = netbuf_new();
+	if (buf != nullptr)
+	{
+		void * const payload = netbuf_alloc(buf, hdr.length);
+		if (payload != nullptr)
+		{
+			memcpy(payload, data + sizeof(hdr), hdr.length);
+
+			ip_addr_t tempIp;
+			memset(&tempIp, 0, sizeof(tempIp));
+			tempIp.u_addr.ip4.addr = hdr.remoteIp;
+			rc = netconn_sendto(conn, buf, &tempIp, hdr.remotePort);
+		}
+		netbuf_delete(buf);
+	}
+
+	if (rc != ERR_OK)
+	{
+		++writeFailures;
+		debugPrintfAlways("UDP send fail len=%u err=%d\n", hdr.length, (int)rc);
+		return false;
+	}
+
+	bytesOut += hdr.length;
+	return true;
 }
 
 // Write data to the connection. The amount of data may be zero.
@@ -101,24 +705,63 @@ size_t Connection::CanRead() const
 // call in version 1.21. So I have increased it from 10 to 16, which seems to have fixed the problem..
 size_t Connection::Write(const uint8_t *data, size_t length, bool doPush, bool closeAfterSending)
 {
+	++writeCalls;
 	if (state != ConnState::connected)
 	{
 		return 0;
 	}
 
-	// Try to send all the data
-	const bool push = doPush || closeAfterSending;
+	if (udp)
+	{
+		return 0;					// UDP sockets must use SendTo
+	}
+
+	if (httpPhase == HttpPhase::webSocket)
+	{
+		return WriteWebSocket(data, length, doPush, closeAfterSending);
+	}
+
+	if (!Send(data, length, doPush || closeAfterSending))
+	{
+		return 0;
+	}
+
+	// Close the connection again when we're done
+	if (closeAfterSending)
+	{
+		Close();
+	}
+
+	return length;
+}
 
+// Send data on a connected TCP connection, encrypting it if necessary.
+// Returns false if the connection failed and was terminated.
+bool Connection::Send(const uint8_t *data, size_t length, bool push)
+{
 	u8_t flag = NETCONN_COPY | (push ? NETCONN_MORE : 0);
 
 	size_t total = 0;
 	size_t written = 0;
 	err_t rc = ERR_OK;
 
+#if SUPPORT_TLS
+	if (tls != nullptr)
+	{
+		rc = tls->Write(data, length);
+		if (rc == ERR_OK)
+		{
+			total = length;
+			bytesOut += length;
+		}
+	}
+	else
+#endif
 	for( ; total < length; total += written) {
 		written = 0;
 		rc = netconn_write_partly(conn, data + total, length - total, flag, &written);
 
+		bytesOut += written;
 		if (rc != ERR_OK && rc != ERR_WOULDBLOCK) {
 			break;
 		}
@@ -126,6 +769,7 @@ size_t Connection::Write(const uint8_t *data, size_t length, bool doPush, bool c
 
 	if (rc != ERR_OK)
 	{
+		++writeFailures;
 		if (rc == ERR_RST || rc == ERR_CLSD)
 		{
 			SetState(ConnState::otherEndClosed);
@@ -135,35 +779,128 @@ size_t Connection::Write(const uint8_t *data, size_t length, bool doPush, bool c
 			// We failed to write the data. See above for possible mitigations. For now we just terminate the connection.
 			debugPrintfAlways("Write fail len=%u err=%d\n", total, (int)rc);
 			Terminate(false);		// chrishamm: Not sure if this helps with LwIP v1.4.3 but it is mandatory for proper error handling with LwIP 2.0.3
+			return false;
+		}
+	}
+
+	return true;
+}
+
+#if SUPPORT_COMPRESSION
+
+// Compress part of a response body and send it as an HTTP chunk. See FlagCompress in MessageFormats.h.
+size_t Connection::WriteCompressed(const uint8_t *data, size_t length, bool doPush, bool closeAfterSending, bool endOfBody)
+{
+	++writeCalls;
+	if (state != ConnState::connected || udp || httpPhase == HttpPhase::webSocket)
+	{
+		return 0;
+	}
+
+	if (!gzip.active)
+	{
+		GzipEncoder::Begin(gzip);
+	}
+
+	const bool finish = endOfBody || closeAfterSending;
+	size_t outLength;
+	const uint8_t * const out = GzipEncoder::Encode(gzip, data, length, finish, outLength);
+	if (out == nullptr)
+	{
+		debugPrintAlways("no compression workspace\n");
+		Terminate(false);						// we can't send the rest of the body in the encoding the client was told about
+		return 0;
+	}
+
+	if (outLength != 0)
+	{
+		char chunkHeader[12];
+		const int headerLength = snprintf(chunkHeader, sizeof(chunkHeader), "%x\r\n", (unsigned int)outLength);
+		if (   !Send(reinterpret_cast<const uint8_t*>(chunkHeader), headerLength, false)
+			|| !Send(out, outLength, false)
+			|| !Send(reinterpret_cast<const uint8_t*>("\r\n"), 2, doPush && !finish)
+		   )
+		{
 			return 0;
 		}
 	}
 
-	// Close the connection again when we're done
+	if (finish && !Send(reinterpret_cast<const uint8_t*>("0\r\n\r\n"), 5, true))
+	{
+		return 0;
+	}
+
 	if (closeAfterSending)
 	{
 		Close();
 	}
-
 	return length;
 }
 
+#endif
+
 size_t Connection::CanWrite() const
 {
 	// Return the amount of free space in the write buffer
 	// Note: we cannot necessarily write this amount, because it depends on memory allocations being successful.
-	return ((state == ConnState::connected) && conn->pcb.tcp) ?
-		std::min((size_t)tcp_sndbuf(conn->pcb.tcp), MaxDataLength) : 0;
+	if ((state != ConnState::connected) || udp || !conn->pcb.tcp)
+	{
+		return 0;
+	}
+
+	size_t space = std::min((size_t)tcp_sndbuf(conn->pcb.tcp), MaxDataLength);
+#if SUPPORT_COMPRESSION
+	if (gzip.active)
+	{
+		// Leave room for the chunk framing and the gzip trailer
+		space = (space > GzipEncoder::MaxOverhead) ? space - GzipEncoder::MaxOverhead : 0;
+	}
+#endif
+	if (httpPhase == HttpPhase::webSocket)
+	{
+		// Leave room for the frame header, which may be longer than the prefix it replaces
+		space = (space > WsMaxFrameHeaderLength) ? space - WsMaxFrameHeaderLength : 0;
+	}
+#if SUPPORT_TLS
+	if (tls != nullptr)
+	{
+		return tls->CanWrite(space);
+	}
+#endif
+	return space;
 }
 
 void Connection::Poll()
 {
-	if (state == ConnState::connected || state == ConnState::otherEndClosed)
+	if (udp)
 	{
+		PollUdp();
+	}
+	else if (state == ConnState::connected || state == ConnState::otherEndClosed)
+	{
+#if SUPPORT_TLS
+		// The handshake task reads from the netconn until the handshake is done
+		if (tls != nullptr && !tls->IsEstablished())
+		{
+			if (tls->HasFailed())
+			{
+				Terminate(false);
+			}
+			return;
+		}
+#endif
+
+		const bool hadData = CanRead() != 0;
 		struct pbuf *data = nullptr;
 		err_t rc = netconn_recv_tcp_pbuf_flags(conn, &data, NETCONN_NOAUTORCVD);
 
 		while(rc == ERR_OK) {
+			bytesIn += data->tot_len;
+#if SUPPORT_TLS
+			if (tls != nullptr) {
+				tls->AddReceived(data);
+			} else
+#endif
 			if (readBuf == nullptr) {
 				readBuf = data;
 				readIndex = alreadyRead = 0;
@@ -174,86 +911,351 @@ void Connection::Poll()
 			rc = netconn_recv_tcp_pbuf_flags(conn, &data, NETCONN_NOAUTORCVD);
 		}
 
-		if (rc != ERR_WOULDBLOCK)
-		{
-			if (rc == ERR_RST || rc == ERR_CLSD || rc == ERR_CONN)
-			{
-				SetState(ConnState::otherEndClosed);
-			}
-			else
-			{
-				Terminate(false);
-			}
-		}
+		if (rc != ERR_WOULDBLOCK)
+		{
+			if (rc == ERR_RST || rc == ERR_CLSD || rc == ERR_CONN)
+			{
+				SetState(ConnState::otherEndClosed);
+			}
+			else
+			{
+				Terminate(false);
+			}
+		}
+
+#if SUPPORT_TLS
+		if (tls != nullptr)
+		{
+			PollTls();
+		}
+#endif
+
+		if (httpPhase == HttpPhase::header)
+		{
+			ScanHttpRequest();
+		}
+#if SUPPORT_ASSET_CACHE
+		else if (httpPhase == HttpPhase::asset)
+		{
+			PollAsset();
+		}
+#endif
+		else if (httpPhase == HttpPhase::webSocket)
+		{
+			ProcessWebSocket();
+		}
+
+		if (!hadData && CanRead() != 0)
+		{
+			readyAt = millis();
+		}
+	}
+	else if (state == ConnState::closePending)
+	{
+		// Retry closing this connection.
+		Close();
+	}
+	else if (state == ConnState::connecting && resolvePending)
+	{
+		PollResolved();
+	}
+	else { }
+}
+
+#if SUPPORT_TLS
+
+// Send what the TLS session has queued and decrypt received data, limiting how much plain text we hold
+void Connection::PollTls()
+{
+	if (tls->Flush() != ERR_OK)
+	{
+		Terminate(false);
+		return;
+	}
+
+	const size_t buffered = (readBuf != nullptr) ? readBuf->tot_len - readIndex : 0;
+	if (buffered >= MaxTlsPlainText)
+	{
+		return;
+	}
+
+	struct pbuf *plain;
+	const err_t rc = tls->Receive(plain, MaxTlsPlainText - buffered);
+	if (plain != nullptr)
+	{
+		if (readBuf == nullptr)
+		{
+			readBuf = plain;
+			readIndex = alreadyRead = 0;
+		}
+		else
+		{
+			pbuf_cat(readBuf, plain);
+		}
+	}
+
+	if (rc == ERR_CLSD)
+	{
+		SetState(ConnState::otherEndClosed);
+	}
+	else if (rc != ERR_OK)
+	{
+		Terminate(false);
+	}
+}
+
+#endif
+
+// Move received datagrams from the netconn into our own queue, leaving any that don't fit for later
+void Connection::PollUdp()
+{
+	while (state == ConnState::connected && datagramCount < MaxQueuedDatagrams)
+	{
+		struct netbuf *buf = nullptr;
+		const err_t rc = netconn_recv(conn, &buf);
+		if (rc != ERR_OK)
+		{
+			if (rc != ERR_WOULDBLOCK)
+			{
+				Terminate(false);
+			}
+			break;
+		}
+
+		bytesIn += netbuf_len(buf);
+		datagrams[(datagramHead + datagramCount) % MaxQueuedDatagrams] = buf;
+		++datagramCount;
+	}
+}
+
+// Close the connection.
+// If 'external' is true then the Duet main processor has requested termination, so we free up the connection.
+// Otherwise it has failed because of an internal error, and we set the state to 'aborted'. The Duet main processor will see this and send a termination request,
+// which will free it up.
+void Connection::Close()
+{
+	if (udp)
+	{
+		// There is no closing handshake for a UDP socket, so free it immediately
+		Terminate(true);
+		return;
+	}
+
+	if (httpPhase == HttpPhase::webSocket && state == ConnState::connected)
+	{
+		CloseWebSocket(WsCloseNormal);
+		if (conn == nullptr)
+		{
+			// Sending the close frame failed and terminated the connection, so there is nothing left to close
+			Terminate(true);
+			return;
+		}
+	}
+
+	if (state == ConnState::otherEndClosed ||  state == ConnState::connected)
+	{
+		SetState(ConnState::closePending);
+		FreePbuf();
+#if SUPPORT_TLS
+		if (tls != nullptr)
+		{
+			tls->CloseNotify();
+			tlsCloseStartedAt = millis();
+		}
+#endif
+	}
+
+#if SUPPORT_TLS
+	// Keep the session until the TCP send buffer has taken the end of the response and the close_notify alert,
+	// because they are lost when it is released. Poll retries the close until then, giving up after MaxAckTime.
+	if (tls != nullptr)
+	{
+		if (tls->IsEstablished() && tls->Flush() == ERR_OK && tls->HasUnsent() && millis() - tlsCloseStartedAt < MaxAckTime)
+		{
+			return;
+		}
+		TlsSession::Release(tls);
+		tls = nullptr;
+	}
+#endif
+
+	ConnectionEvent evt;
+	evt.type = ConnectionEventType::Close;
+	evt.data.ptr = conn;
+	if (xQueueSend(connectionQueue, &evt, 0) == pdTRUE)
+	{
+		SetState(ConnState::free);
+		conn = nullptr;
+	}
+}
+
+bool Connection::Connect(uint8_t protocol, uint32_t remoteIp, uint16_t remotePort)
+{
+	ip_addr_t tempIp;
+	memset(&tempIp, 0, sizeof(tempIp));
+	tempIp.u_addr.ip4.addr = remoteIp;
+	return Connect(protocol, tempIp, remotePort);
+}
+
+// If the connection can't be started it is freed, unless 'freeOnFailure' is false in which case it is left aborted
+bool Connection::Connect(uint8_t protocol, const ip_addr_t& remoteIp, uint16_t remotePort, bool freeOnFailure)
+{
+	udp = false;
+	httpPhase = HttpPhase::none;
+	struct netconn * tempPcb = netconn_new_with_callback(IP_IS_V6(&remoteIp) ? NETCONN_TCP_IPV6 : NETCONN_TCP, ConnectCallback);
+	if (tempPcb == nullptr)
+	{
+		PcbExhausted();
+		debugPrintAlways("can't allocate connection\n");
+		if (!freeOnFailure)
+		{
+			Terminate(false);
+		}
+		return false;
+	}
+	netconn_set_nonblocking(tempPcb, 1);
+
+	conn = tempPcb;
+
+	// Since the member 'socket' is not used, use it to store
+	// reference to the owning Connection of the netconn.
+	static_assert(sizeof(conn->socket) == sizeof(this));
+	conn->socket = reinterpret_cast<int>(this);
+
+	ip_set_option(tempPcb->pcb.tcp, SOF_REUSEADDR);
+
+	err_t rc = netconn_connect(conn, &remoteIp, remotePort);
+
+	if (!(rc == ERR_OK || rc == ERR_INPROGRESS))
+	{
+		Terminate(freeOnFailure);
+		debugPrintfAlways("can't connect: %d\n", (int)rc);
+		return false;
+	}
+
+	this->protocol = protocol;
+	SetState(ConnState::connecting);
+	return true;
+}
+
+// Start connecting to a host given by name. The name is resolved by the LWIP DNS client, which caches
+// the addresses it has looked up for as long as their TTL allows, so the main task is never blocked.
+// The connection stays in the connecting state until the name is resolved and the connection is made.
+bool Connection::ConnectByName(uint8_t protocol, const char *hostName, uint16_t remotePort)
+{
+	ResolveRequest * const req = new (std::nothrow) ResolveRequest;
+	if (req == nullptr)
+	{
+		debugPrintAlways("can't allocate resolve request\n");
+		Terminate(true);
+		return false;
+	}
+
+	++resolveSequence;
+	req->token = number | ((uintptr_t)resolveSequence << 8);
+	SafeStrncpy(req->hostName, hostName, sizeof(req->hostName));
+
+	udp = false;
+	httpPhase = HttpPhase::none;
+	conn = nullptr;
+	resolvePending = false;
+	this->protocol = protocol;
+	this->remotePort = remotePort;
+	ip_addr_set_zero_ip4(&remoteIp);
+	SetState(ConnState::connecting);
+
+	if (tcpip_callback(StartResolve, req) != ERR_OK)
+	{
+		delete req;
+		Terminate(true);
+		debugPrintAlways("can't start resolving host name\n");
+		return false;
 	}
-	else if (state == ConnState::closePending)
+	return true;
+}
+
+// Called by the connection task when a host name resolution started by ConnectByName has completed.
+// The main task owns the connection, so it is left to PollResolved to act on the result.
+void Connection::Resolved(uint8_t sequence, const ip_addr_t& ip)
+{
+	if (sequence == resolveSequence && !resolvePending)
 	{
-		// Retry closing this connection.
-		Close();
+		ip_addr_copy(resolvedIp, ip);
+		resolvedSequence = sequence;
+		resolvePending = true;					// set last, so the main task sees the address
 	}
-	else { }
 }
 
-// Close the connection.
-// If 'external' is true then the Duet main processor has requested termination, so we free up the connection.
-// Otherwise it has failed because of an internal error, and we set the state to 'aborted'. The Duet main processor will see this and send a termination request,
-// which will free it up.
-void Connection::Close()
+// Connect to the host whose name has been resolved. If that fails the connection is left closed or aborted,
+// so that the SAM sees the failure when it polls the connection, rather than the connection disappearing.
+void Connection::PollResolved()
 {
-	if (state == ConnState::otherEndClosed ||  state == ConnState::connected)
+	resolvePending = false;
+
+	// Ignore the result if the connection was terminated or reused in the meantime
+	if (conn != nullptr || resolvedSequence != resolveSequence)
 	{
-		SetState(ConnState::closePending);
-		FreePbuf();
+		return;
 	}
 
-	ConnectionEvent evt;
-	evt.type = ConnectionEventType::Close;
-	evt.data.ptr = conn;
-	if (xQueueSend(connectionQueue, &evt, 0) == pdTRUE)
+	if (ip_addr_isany_val(resolvedIp))
 	{
-		SetState(ConnState::free);
-		conn = nullptr;
+		debugPrintfAlways("can't resolve host name for conn %u\n", number);
+		lastError = "can't resolve host name";
+		SetState(ConnState::otherEndClosed);
+	}
+	else if (!Connect(protocol, resolvedIp, remotePort, false))
+	{
+		lastError = "can't connect to resolved host";
 	}
 }
 
-bool Connection::Connect(uint8_t protocol, uint32_t remoteIp, uint16_t remotePort)
+// Create a UDP socket bound to the specified local address and port, 0 meaning any
+bool Connection::BindUdp(uint8_t protocol, uint32_t localIp, uint16_t localPort)
 {
-	struct netconn * tempPcb = netconn_new_with_callback(NETCONN_TCP, ConnectCallback);
-	if (tempPcb == nullptr)
+	struct netconn * tempConn = netconn_new(NETCONN_UDP);
+	if (tempConn == nullptr)
 	{
 		debugPrintAlways("can't allocate connection\n");
+		Terminate(true);
 		return false;
 	}
-	netconn_set_nonblocking(tempPcb, 1);
-
-	conn = tempPcb;
-
-	// Since the member 'socket' is not used, use it to store
-	// reference to the owning Connection of the netconn.
-	static_assert(sizeof(conn->socket) == sizeof(this));
-	conn->socket = reinterpret_cast<int>(this);
+	netconn_set_nonblocking(tempConn, 1);
 
-	ip_set_option(tempPcb->pcb.tcp, SOF_REUSEADDR);
+	conn = tempConn;
+	udp = true;
+	httpPhase = HttpPhase::none;
+	ip_set_option(tempConn->pcb.udp, SOF_REUSEADDR);
+	ip_set_option(tempConn->pcb.udp, SOF_BROADCAST);
 
 	ip_addr_t tempIp;
 	memset(&tempIp, 0, sizeof(tempIp));
-	tempIp.u_addr.ip4.addr = remoteIp;
-	err_t rc = netconn_connect(conn, &tempIp, remotePort);
+	tempIp.u_addr.ip4.addr = localIp;
+	err_t rc = netconn_bind(conn, &tempIp, localPort);
 
-	if (!(rc == ERR_OK || rc == ERR_INPROGRESS))
+	if (rc != ERR_OK)
 	{
 		Terminate(true);
-		debugPrintfAlways("can't connect: %d\n", (int)rc);
+		debugPrintfAlways("can't bind UDP: %d\n", (int)rc);
 		return false;
 	}
 
 	this->protocol = protocol;
-	SetState(ConnState::connecting);
+	this->localPort = conn->pcb.udp->local_port;
+	remotePort = 0;
+	ip_addr_set_zero_ip4(&remoteIp);
+	datagramHead = datagramCount = 0;
+	ResetStats();
+	SetState(ConnState::connected);
 	return true;
 }
 
 void Connection::Terminate(bool external)
 {
+#if SUPPORT_TLS
+	TlsSession::Release(tls);
+	tls = nullptr;
+#endif
 	if (conn) {
 		// No need to pass to ConnectionTask and do a graceful close on the connection.
 		// Delete it here.
@@ -262,13 +1264,35 @@ void Connection::Terminate(bool external)
 		conn = nullptr;
 	}
 	FreePbuf();
+	FreeDatagrams();
 	SetState((external) ? ConnState::free : ConnState::aborted);
+	if (external)
+	{
+		udp = false;
+	}
 }
 
-void Connection::Accept(struct netconn* conn, uint8_t protocol)
+// Take a connection accepted by a listener. Returns false if it needs a TLS session and none is available.
+bool Connection::Accept(struct netconn* conn, uint8_t protocol, uint8_t flags)
 {
 	this->protocol = protocol;
+	udp = false;
+	serveAssets = (flags & MessageHeaderSamToEsp::FlagListenAssetCache) != 0;
+	acceptWebSockets = (flags & MessageHeaderSamToEsp::FlagListenWebSocket) != 0;
+	httpPhase = (flags & (MessageHeaderSamToEsp::FlagListenHttpFraming | MessageHeaderSamToEsp::FlagListenAssetCache | MessageHeaderSamToEsp::FlagListenWebSocket))
+				? HttpPhase::header : HttpPhase::none;
+#if SUPPORT_TLS
+	if (flags & MessageHeaderSamToEsp::FlagListenSecure)
+	{
+		tls = TlsSession::Allocate(conn);
+		if (tls == nullptr)
+		{
+			return false;
+		}
+	}
+#endif
 	Connected(conn);
+	return true;
 }
 
 void Connection::Connected(struct netconn* conn)
@@ -276,8 +1300,12 @@ void Connection::Connected(struct netconn* conn)
 	this->conn = conn;
 	localPort = conn->pcb.tcp->local_port;
 	remotePort = conn->pcb.tcp->remote_port;
-	remoteIp = conn->pcb.tcp->remote_ip.u_addr.ip4.addr;
+	ip_addr_copy(remoteIp, conn->pcb.tcp->remote_ip);
 	readIndex = alreadyRead = 0;
+#if SUPPORT_COMPRESSION
+	gzip.active = false;
+#endif
+	ResetStats();
 
 	// This function is used in lower priority tasks than the main task.
 	// Mark the connection ready last, so the main task does not use it when it's not ready.
@@ -292,10 +1320,61 @@ void Connection::GetStatus(ConnStatusResponse& resp) const
 	resp.protocol = protocol;
 	resp.state = state;
 	resp.bytesAvailable = CanRead();
-	resp.writeBufferSpace = CanWrite();
+	resp.writeBufferSpace = (udp && state == ConnState::connected) ? MaxDataLength - sizeof(UdpDatagramHeader) : CanWrite();
 	resp.localPort = localPort;
 	resp.remotePort = remotePort;
-	resp.remoteIp = remoteIp;
+	resp.remoteIp = (IP_IS_V4_VAL(remoteIp)) ? remoteIp.u_addr.ip4.addr : 0;
+}
+
+void Connection::GetStatusWide(ConnStatusResponseWide& resp) const
+{
+	GetStatus(resp.status);
+	ToWideIpAddress(remoteIp, resp.remoteIp);
+}
+
+void Connection::GetStats(ConnStatsResponse& resp) const
+{
+	memset(&resp, 0, sizeof(resp));
+	resp.socketNumber = number;
+	resp.protocol = protocol;
+	resp.state = state;
+	resp.bytesIn = bytesIn;
+	resp.bytesOut = bytesOut;
+	resp.readCalls = readCalls;
+	resp.writeCalls = writeCalls;
+	resp.writeFailures = writeFailures;
+
+	if (state == ConnState::connected || state == ConnState::otherEndClosed)
+	{
+		resp.connectedTime = millis() - connectedAt;
+
+		// The RTT estimators are kept by LWIP in units of the slow timer interval, with the average scaled by 8
+		const struct tcp_pcb * const pcb = (conn != nullptr && !udp) ? conn->pcb.tcp : nullptr;
+		if (pcb != nullptr)
+		{
+			resp.srtt = (uint32_t)(pcb->sa >> 3) * TCP_SLOW_INTERVAL;
+			resp.rto = (uint32_t)pcb->rto * TCP_SLOW_INTERVAL;
+			resp.cwnd = pcb->cwnd;
+		}
+	}
+}
+
+void Connection::FreeDatagrams()
+{
+	while (datagramCount != 0)
+	{
+		netbuf_delete(datagrams[datagramHead]);
+		datagramHead = (datagramHead + 1) % MaxQueuedDatagrams;
+		--datagramCount;
+	}
+	datagramHead = 0;
+}
+
+void Connection::ResetStats()
+{
+	bytesIn = bytesOut = 0;
+	readCalls = writeCalls = writeFailures = 0;
+	connectedAt = readyAt = millis();
 }
 
 void Connection::FreePbuf()
@@ -323,10 +1402,17 @@ void Connection::Report()
 	};
 
 	const unsigned int st = (int)state;
-	ets_printf("%s", (st < ARRAY_SIZE(connStateText)) ? connStateText[st]: "unknown");
+	ets_printf("%s%s%s", (st < ARRAY_SIZE(connStateText)) ? connStateText[st]: "unknown", (udp) ? " udp" : "", (tls != nullptr) ? " tls" : "");
 	if (state != ConnState::free)
 	{
-		ets_printf(" %u, %u, %u.%u.%u.%u", localPort, remotePort, remoteIp & 255, (remoteIp >> 8) & 255, (remoteIp >> 16) & 255, (remoteIp >> 24) & 255);
+		char ipText[IPADDR_STRLEN_MAX];
+		ets_printf(" %u, %u, %s", localPort, remotePort, ipaddr_ntoa_r(&remoteIp, ipText, sizeof(ipText)));
+
+		ConnStatsResponse stats;
+		GetStats(stats);
+		ets_printf(" in %u (%u reads) out %u (%u writes, %u failed) up %ums srtt %ums rto %ums cwnd %u",
+					stats.bytesIn, stats.readCalls, stats.bytesOut, stats.writeCalls, stats.writeFailures,
+					stats.connectedTime, stats.srtt, stats.rto, stats.cwnd);
 	}
 }
 
@@ -336,6 +1422,9 @@ void Connection::Report()
 {
 	connectionQueue = xQueueCreate(MaxConnections * 3, sizeof(ConnectionEvent));
 	allocateMutex = xSemaphoreCreateMutex();
+#if SUPPORT_TLS
+	TlsSession::Init();
+#endif
 	xTaskCreate(ConnectionTask, "conn", CONNECTION_TASK, NULL, CONNECTION_PRIO, NULL);
 
 	for (size_t i = 0; i < MaxConnections; ++i)
@@ -344,21 +1433,87 @@ void Connection::Report()
 	}
 }
 
-bool Connection::Listen(uint16_t port, uint32_t ip, uint8_t protocol, uint16_t maxConns)
+bool Connection::Listen(uint16_t port, uint32_t ip, uint8_t protocol, uint16_t maxConns, uint8_t flags, ListenInterface iface)
+{
+	ip_addr_t tempIp;
+	memset(&tempIp, 0, sizeof(tempIp));
+	tempIp.u_addr.ip4.addr = ip;
+	return Listen(port, tempIp, protocol, maxConns, flags, iface);
+}
+
+static tcpip_adapter_if_t InterfaceAdapter(ListenInterface iface)
+{
+	tcpip_adapter_if_t adapter = (iface == ListenInterface::accessPoint) ? TCPIP_ADAPTER_IF_AP : TCPIP_ADAPTER_IF_STA;
+#if SUPPORT_ETHERNET
+	if (adapter == TCPIP_ADAPTER_IF_STA && !tcpip_adapter_is_netif_up(TCPIP_ADAPTER_IF_STA))
+	{
+		adapter = TCPIP_ADAPTER_IF_ETH;
+	}
+#endif
+	return adapter;
+}
+
+// Return true if the local address of a TCP connection belongs to the interface, which tells us which interface it arrived on
+static bool IsOnInterface(const struct netconn *conn, ListenInterface iface)
+{
+	void *netif = nullptr;
+	if (conn->pcb.tcp == nullptr || tcpip_adapter_get_netif(InterfaceAdapter(iface), &netif) != ESP_OK || netif == nullptr)
+	{
+		return false;
+	}
+
+	const ip_addr_t& local = conn->pcb.tcp->local_ip;
+#if LWIP_IPV6
+	if (IP_IS_V6(&local))
+	{
+		return netif_get_ip6_addr_match(static_cast<struct netif*>(netif), ip_2_ip6(&local)) >= 0;
+	}
+#endif
+	return ip4_addr_cmp(ip_2_ip4(&local), netif_ip4_addr(static_cast<struct netif*>(netif)));
+}
+
+// Choose the listener for a connection accepted on a netconn, which listeners on several interfaces may share.
+// A listener restricted to the interface the connection arrived on takes precedence over one for any interface.
+static Listener *FindListener(struct netconn *listenConn, const struct netconn *newConn)
+{
+	Listener *anyInterface = nullptr;
+	for (Listener *p = Listener::FindByPort(reinterpret_cast<Listener*>(listenConn->socket)->GetPort()); p != nullptr; p = p->GetNextOnPort())
+	{
+		if (p->GetConnection() == listenConn)
+		{
+			if (p->GetInterface() == ListenInterface::any)
+			{
+				anyInterface = p;
+			}
+			else if (IsOnInterface(newConn, p->GetInterface()))
+			{
+				return p;
+			}
+		}
+	}
+	return anyInterface;
+}
+
+// Listen on the specified address. If it is all zeros then we listen on all IPv4 and IPv6 addresses.
+// If an interface is specified then only connections that arrive on it are accepted.
+// Listeners on other interfaces are left alone, so the same port can be served differently on each interface.
+bool Connection::Listen(uint16_t port, const ip_addr_t& ip, uint8_t protocol, uint16_t maxConns, uint8_t flags, ListenInterface iface)
 {
+	const bool anyIp = ip_addr_isany(&ip);
+
 	// See if we are already listing for this
-	for (Listener *p = Listener::List(); p != nullptr; )
+	for (Listener *p = Listener::FindByPort(port); p != nullptr; )
 	{
-		Listener *n = p->GetNext();
-		if (p->GetPort() == port)
+		Listener *n = p->GetNextOnPort();
+		if (p->GetInterface() == iface || (maxConns == 0 && iface == ListenInterface::any))
 		{
-			if (maxConns != 0 && (p->GetIp() == IPADDR_ANY || p->GetIp() == ip))
+			if (maxConns != 0 && (ip_addr_isany(&p->GetIp()) || ip_addr_cmp(&p->GetIp(), &ip)))
 			{
 				// already listening, so nothing to do
 				debugPrintf("already listening on port %u\n", port);
 				return true;
 			}
-			if (maxConns == 0 || ip == IPADDR_ANY)
+			if (maxConns == 0 || anyIp)
 			{
 				p->Stop();
 				debugPrintf("stopped listening on port %u\n", port);
@@ -372,8 +1527,36 @@ bool Connection::Listen(uint16_t port, uint32_t ip, uint8_t protocol, uint16_t m
 		return true;
 	}
 
+	if (flags & MessageHeaderSamToEsp::FlagListenSecure)
+	{
+#if SUPPORT_TLS
+		if (!TlsSession::Configure())
+		{
+			return false;
+		}
+#else
+		debugPrintAlways("TLS not supported\n");
+		return false;
+#endif
+	}
+
+	// lwIP allows only one listener on each local address and port, even if they are bound to different interfaces.
+	// So listeners on the 'any' address of a port share one netconn, and the connection task picks the listener for the interface
+	// that each connection arrives on. That keeps working when the interface's addresses change.
+	if (anyIp)
+	{
+		for (Listener *p = Listener::FindByPort(port); p != nullptr; p = p->GetNextOnPort())
+		{
+			if (ip_addr_isany(&p->GetIp()))
+			{
+				return Listener::Start(port, ip, protocol, maxConns, flags, iface, p->GetConnection());
+			}
+		}
+	}
+
 	// Setup LWIP listening connection.
-	struct netconn * tempPcb = netconn_new_with_callback(NETCONN_TCP, ListenCallback);
+	// An IPv6 netconn bound to the 'any' address of any type accepts both IPv4 and IPv6 connections
+	struct netconn * tempPcb = netconn_new_with_callback((anyIp || IP_IS_V6(&ip)) ? NETCONN_TCP_IPV6 : NETCONN_TCP, ListenCallback);
 	if (tempPcb == nullptr)
 	{
 		debugPrintAlways("can't allocate PCB\n");
@@ -381,12 +1564,9 @@ bool Connection::Listen(uint16_t port, uint32_t ip, uint8_t protocol, uint16_t m
 	}
 	netconn_set_nonblocking(tempPcb, 1);
 
-	ip_addr_t tempIp;
-	memset(&tempIp, 0, sizeof(tempIp));
-	tempIp.u_addr.ip4.addr = ip;
 	ip_set_option(tempPcb->pcb.tcp, SOF_REUSEADDR); // seems to be needed for avoiding ERR_USE error when switching from client to AP
 
-	err_t rc = netconn_bind(tempPcb, &tempIp, port);
+	const err_t rc = netconn_bind(tempPcb, (anyIp) ? IP_ANY_TYPE : &ip, port);
 	if (rc != ERR_OK)
 	{
 		netconn_close(tempPcb);
@@ -395,19 +1575,41 @@ bool Connection::Listen(uint16_t port, uint32_t ip, uint8_t protocol, uint16_t m
 		return false;
 	}
 
-	return Listener::Start(port, ip, protocol, maxConns, tempPcb);
+	return Listener::Start(port, ip, protocol, maxConns, flags, iface, tempPcb);
 }
 
 void Connection::StopListen(uint16_t port)
 {
-	for (Listener *p = Listener::List(); p != nullptr; )
+	if (port == 0)
+	{
+		Listener::StopAll();
+		return;
+	}
+
+	for (Listener *p = Listener::FindByPort(port); p != nullptr; )
+	{
+		Listener *n = p->GetNextOnPort();
+		p->Stop();
+		p = n;
+	}
+}
+
+void Connection::StopListen(ListenInterface iface)
+{
+	Listener::StopInterface(iface);
+}
+
+// Abort the TCP connections made through an interface that is going away, so that the SAM doesn't wait on them
+/*static*/ void Connection::TerminateInterface(ListenInterface iface)
+{
+	for (size_t i = 0; i < MaxConnections; ++i)
 	{
-		Listener *n = p->GetNext();
-		if (port == 0 || port == p->GetPort())
+		Connection& c = Connection::Get(i);
+		if (!c.udp && c.conn != nullptr && IsOnInterface(c.conn, iface))
 		{
-			p->Stop();
+			debugPrintf("terminating conn %u on stopped interface\n", i);
+			c.Terminate(false);
 		}
-		p = n;
 	}
 }
 
@@ -417,6 +1619,17 @@ void Connection::StopListen(uint16_t port)
 	{
 		Connection::Get(i).Poll();
 	}
+
+	const uint32_t now = millis();
+	if (!pcbCheckPending && now - lastPcbCheck >= PcbCheckInterval)
+	{
+		lastPcbCheck = now;
+		pcbCheckPending = true;
+		if (tcpip_callback(CheckPcbs, nullptr) != ERR_OK)
+		{
+			pcbCheckPending = false;
+		}
+	}
 }
 
 /*static*/ void Connection::TerminateAll()
@@ -427,16 +1640,18 @@ void Connection::StopListen(uint16_t port)
 	}
 }
 
+// Return the reason that a connection failed in the background since we were last asked, if any
+/*static*/ const char *Connection::TakeLastError()
+{
+	const char * const err = lastError;
+	lastError = nullptr;
+	return err;
+}
+
 /*static*/ uint16_t Connection::GetPortByProtocol(uint8_t protocol)
 {
-	for (Listener *p = Listener::List(); p != nullptr; p = p->GetNext())
-	{
-		if (p->GetProtocol() == protocol)
-		{
-			return p->GetPort();
-		}
-	}
-	return 0;
+	Listener * const p = Listener::FindByProtocol(protocol);
+	return (p != nullptr) ? p->GetPort() : 0;
 }
 
 /*static*/ void Connection::ReportConnections()
@@ -448,6 +1663,64 @@ void Connection::StopListen(uint16_t port)
 		connectionList[i]->Report();
 	}
 	ets_printf("\n");
+	Listener::Report();
+	ReportPcbs();
+}
+
+/*static*/ void Connection::ReportPcbs()
+{
+	ets_printf("PCBs: %u active, %u time-wait of %u, %u recycled, %u exhausted",
+				activePcbCount, timeWaitPcbCount, MEMP_NUM_TCP_PCB, pcbRecycledCount, pcbExhaustedCount);
+#if MEMP_STATS
+	ets_printf(", %u pool alloc failures", lwip_stats.memp[MEMP_TCP_PCB]->err);
+#endif
+	ets_printf("\n");
+}
+
+/*static*/ void Connection::FromWideIpAddress(const WideIpAddress& wide, ip_addr_t& ip)
+{
+	if (wide.type == IpAddressType::ipv6)
+	{
+		IP_ADDR6(&ip, wide.addr[0], wide.addr[1], wide.addr[2], wide.addr[3]);
+	}
+	else
+	{
+		memset(&ip, 0, sizeof(ip));
+		ip.u_addr.ip4.addr = wide.addr[0];
+	}
+}
+
+/*static*/ void Connection::ToWideIpAddress(const ip_addr_t& ip, WideIpAddress& wide)
+{
+	memset(&wide, 0, sizeof(wide));
+	if (IP_IS_V6_VAL(ip))
+	{
+		wide.type = IpAddressType::ipv6;
+		memcpy(wide.addr, ip.u_addr.ip6.addr, sizeof(wide.addr));
+	}
+	else
+	{
+		wide.type = IpAddressType::ipv4;
+		wide.addr[0] = ip.u_addr.ip4.addr;
+	}
+}
+
+// Return the TCP connection that has had data waiting to be read for the longest time, or nullptr if there is none
+/*static*/ Connection *Connection::GetMostUrgent()
+{
+	const uint32_t now = millis();
+	Connection *best = nullptr;
+	uint32_t longestWait = 0;
+	for (size_t i = 0; i < MaxConnections; ++i)
+	{
+		Connection * const c = connectionList[i];
+		if (!c->udp && c->CanRead() != 0 && (best == nullptr || now - c->readyAt > longestWait))
+		{
+			best = c;
+			longestWait = now - c->readyAt;
+		}
+	}
+	return best;
 }
 
 /*static*/ void Connection::GetSummarySocketStatus(uint16_t& connectedSockets, uint16_t& otherEndClosedSockets)
@@ -497,7 +1770,7 @@ void Connection::StopListen(uint16_t port)
 	uint16_t count = 0;
 	for (size_t i = 0; i < MaxConnections; ++i)
 	{
-		if (connectionList[i]->localPort == port)
+		if (connectionList[i]->localPort == port && !connectionList[i]->udp)
 		{
 			const ConnState state = connectionList[i]->state;
 			if (state == ConnState::connected || state == ConnState::otherEndClosed || state == ConnState::closePending)
@@ -543,30 +1816,46 @@ void Connection::StopListen(uint16_t port)
 				err_t rc = netconn_accept(conn, &newConn);
 				if (rc == ERR_OK)
 				{
-					Listener* p = reinterpret_cast<Listener*>(conn->socket);
-					const uint16_t numConns = Connection::CountConnectionsOnPort(p->GetPort());
-					if (numConns < p->GetMaxConnections())
+					Listener* p = FindListener(conn, newConn);
+					const uint16_t numConns = (p != nullptr) ? Connection::CountConnectionsOnPort(p->GetPort()) : 0;
+					if (p == nullptr)
 					{
+						netconn_close(newConn);
+						netconn_delete(newConn);
+						debugPrintf("refused conn on port %u not listening on its interface\n", reinterpret_cast<Listener*>(conn->socket)->GetPort());
+					}
+					else if (numConns < p->GetMaxConnections())
+					{
+						netconn_set_nonblocking(newConn, 1);
 						Connection * const c = Connection::Allocate();
-						if (c != nullptr)
+						if (c == nullptr)
+						{
+							netconn_close(newConn);
+							netconn_delete(newConn);
+							p->CountRefused();
+							debugPrintfAlways("refused conn on port %u no free conn\n", p->GetPort());
+						}
+						else if (!c->Accept(newConn, p->GetProtocol(), p->GetFlags()))
+						{
+							c->SetState(ConnState::free);
+							netconn_close(newConn);
+							netconn_delete(newConn);
+							p->CountRefused();
+							debugPrintfAlways("refused conn on port %u no TLS session\n", p->GetPort());
+						}
+						else
 						{
-							netconn_set_nonblocking(newConn, 1);
-							c->Accept(newConn, p->GetProtocol());
+							p->CountAccepted();
 							if (p->GetProtocol() == protocolFtpData)
 							{
 								debugPrintf("accept conn, stop listen on port %u\n", p->GetPort());
 								p->Stop();	// don't listen for further connections
 							}
 						}
-						else
-						{
-							netconn_close(newConn);
-							netconn_delete(newConn);
-							debugPrintfAlways("refused conn on port %u no free conn\n", p->GetPort());
-						}
 					}
 					else
 					{
+						p->CountBacklogOverflow();
 						netconn_close(newConn);
 						netconn_delete(newConn);
 						debugPrintfAlways("refused conn on port %u already %u conns\n", p->GetPort(), numConns);
@@ -600,6 +1889,11 @@ void Connection::StopListen(uint16_t port)
 					last = now;
 				}
 			}
+			else if (evt.type == ConnectionEventType::Resolved)
+			{
+				const uintptr_t token = evt.data.i;
+				Connection::Get(token & 0xFF).Resolved((uint8_t)(token >> 8), evt.ip);
+			}
 			else if (evt.type == ConnectionEventType::Terminate)
 			{
 				int idx = evt.data.i;
@@ -739,10 +2033,112 @@ void Connection::StopListen(uint16_t port)
 	}
 }
 
+// Runs in the TCP/IP task, which is where the LWIP DNS client must be called from.
+// IPv4 addresses are preferred, but hosts that only have an IPv6 address can be reached too.
+/*static*/ void Connection::StartResolve(void *arg)
+{
+	ResolveRequest * const req = static_cast<ResolveRequest*>(arg);
+	ip_addr_t addr;
+	const err_t rc = dns_gethostbyname_addrtype(req->hostName, &addr, ResolveCallback, reinterpret_cast<void*>(req->token), LWIP_DNS_ADDRTYPE_IPV4_IPV6);
+	if (rc == ERR_OK)
+	{
+		PostResolved(req->token, &addr);			// the address was cached or the name was an IP address
+	}
+	else if (rc != ERR_INPROGRESS)
+	{
+		PostResolved(req->token, nullptr);
+	}
+	delete req;
+}
+
+/*static*/ void Connection::ResolveCallback(const char *name, const ip_addr_t *ipaddr, void *arg)
+{
+	PostResolved(reinterpret_cast<uintptr_t>(arg), ipaddr);
+}
+
+/*static*/ void Connection::PostResolved(uintptr_t token, const ip_addr_t *ipaddr)
+{
+	ConnectionEvent evt;
+	evt.type = ConnectionEventType::Resolved;
+	evt.data.i = token;
+	if (ipaddr != nullptr)
+	{
+		ip_addr_copy(evt.ip, *ipaddr);
+	}
+	else
+	{
+		ip_addr_set_zero_ip4(&evt.ip);
+	}
+	xQueueSend(connectionQueue, &evt, portMAX_DELAY);
+}
+
+// Runs in the TCP/IP task, which owns the PCB lists.
+// Short-lived HTTP connections leave a PCB in TIME_WAIT for 2 * MSL after they are closed, and these share the pool with active PCBs.
+// LWIP only kills a TIME_WAIT PCB once an allocation has already failed, so we recycle the oldest ones early to keep some PCBs free.
+/*static*/ void Connection::CheckPcbs(void *arg)
+{
+	static bool wasExhausted = false;
+
+	// Bound PCBs that are not yet connected come from the same pool as the active ones
+	uint16_t numActive = 0;
+	for (struct tcp_pcb *pcb = tcp_active_pcbs; pcb != nullptr; pcb = pcb->next)
+	{
+		++numActive;
+	}
+	for (struct tcp_pcb *pcb = tcp_bound_pcbs; pcb != nullptr; pcb = pcb->next)
+	{
+		++numActive;
+	}
+
+	uint16_t numTimeWait = 0;
+	for (struct tcp_pcb *pcb = tcp_tw_pcbs; pcb != nullptr; pcb = pcb->next)
+	{
+		++numTimeWait;
+	}
+
+	while (numActive + numTimeWait + MinFreePcbs > MEMP_NUM_TCP_PCB && numTimeWait != 0)
+	{
+		struct tcp_pcb *oldest = nullptr;
+		uint32_t oldestAge = 0;
+		for (struct tcp_pcb *pcb = tcp_tw_pcbs; pcb != nullptr; pcb = pcb->next)
+		{
+			const uint32_t age = tcp_ticks - pcb->tmr;
+			if (oldest == nullptr || age >= oldestAge)
+			{
+				oldest = pcb;
+				oldestAge = age;
+			}
+		}
+		tcp_abort(oldest);					// a PCB in TIME_WAIT is just freed, no RST is sent
+		--numTimeWait;
+		++pcbRecycledCount;
+	}
+
+	// Count each time the pool becomes full, not each check while it stays full
+	const bool exhausted = (numActive + numTimeWait >= MEMP_NUM_TCP_PCB);
+	if (exhausted && !wasExhausted)
+	{
+		PcbExhausted();
+	}
+	wasExhausted = exhausted;
+
+	activePcbCount = numActive;
+	timeWaitPcbCount = numTimeWait;
+	pcbCheckPending = false;
+}
+
 // Static data
 QueueHandle_t Connection::connectionQueue = nullptr;
 SemaphoreHandle_t Connection::allocateMutex = nullptr;
 netconn * Connection::closePending[MaxConnections];
+const char * volatile Connection::lastError = nullptr;
 Connection *Connection::connectionList[MaxConnections];
 
+volatile bool Connection::pcbCheckPending = false;
+uint32_t Connection::lastPcbCheck = 0;
+volatile uint16_t Connection::activePcbCount = 0;
+volatile uint16_t Connection::timeWaitPcbCount = 0;
+volatile uint32_t Connection::pcbRecycledCount = 0;
+volatile uint32_t Connection::pcbExhaustedCount = 0;
+
 // End
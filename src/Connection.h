@@ -19,45 +19,104 @@
 #include "lwip/api.h"
 
 #include "include/MessageFormats.h"			// for ConnState
+#include "GzipEncoder.h"
+
+class TlsSession;
 
 class Connection
 {
 public:
+#ifdef ESP8266
+	static constexpr size_t MaxQueuedDatagrams = 4;
+#else
+	static constexpr size_t MaxQueuedDatagrams = 8;
+#endif
+
 	Connection(uint8_t num);
 
 	// Public interface
 	size_t Read(uint8_t *data, size_t length);
 	size_t CanRead() const;
 	size_t Write(const uint8_t *data, size_t length, bool doPush, bool closeAfterSending);
+#if SUPPORT_COMPRESSION
+	size_t WriteCompressed(const uint8_t *data, size_t length, bool doPush, bool closeAfterSending, bool endOfBody);
+#endif
 	size_t CanWrite() const;
+	bool WritesWholeChunks() const { return httpPhase == HttpPhase::webSocket; }
+
+	size_t RecvFrom(uint8_t *data, size_t length);
+	bool SendTo(const uint8_t *data, size_t length);
 
 	void Close();
 	bool Connect(uint8_t protocol, uint32_t remoteIp, uint16_t remotePort);
+	bool Connect(uint8_t protocol, const ip_addr_t& remoteIp, uint16_t remotePort, bool freeOnFailure = true);
+	bool ConnectByName(uint8_t protocol, const char *hostName, uint16_t remotePort);
+	bool BindUdp(uint8_t protocol, uint32_t localIp, uint16_t localPort);
 	void Terminate(bool external);
 	void GetStatus(ConnStatusResponse& resp) const;
+	void GetStatusWide(ConnStatusResponseWide& resp) const;
+	void GetStats(ConnStatsResponse& resp) const;
 	uint8_t GetNum() { return number; }
 
 	// Static functions
 	static Connection *Allocate();
 	static void Init();
-	static bool Listen(uint16_t port, uint32_t ip, uint8_t protocol, uint16_t maxConns);
+	static bool Listen(uint16_t port, uint32_t ip, uint8_t protocol, uint16_t maxConns, uint8_t flags, ListenInterface iface);
+	static bool Listen(uint16_t port, const ip_addr_t& ip, uint8_t protocol, uint16_t maxConns, uint8_t flags, ListenInterface iface);
 	static void StopListen(uint16_t port);
+	static void StopListen(ListenInterface iface);
+	static void TerminateInterface(ListenInterface iface);
 	static void PollAll();
 	static void TerminateAll();
+	static const char *TakeLastError();
 
 	static Connection& Get(uint8_t num) { return *connectionList[num]; }
 	static uint16_t GetPortByProtocol(uint8_t protocol);
 	static void GetSummarySocketStatus(uint16_t& connectedSockets, uint16_t& otherEndClosedSockets);
+	static Connection *GetMostUrgent();
 	static void ReportConnections();
+	static void ReportPcbs();
+
+	static void FromWideIpAddress(const WideIpAddress& wide, ip_addr_t& ip);
+	static void ToWideIpAddress(const ip_addr_t& ip, WideIpAddress& wide);
 
 private:
+	enum class HttpPhase : uint8_t
+	{
+		none = 0,				// not framing HTTP requests
+		header,					// waiting for a complete header block
+		request,				// a header block is ready to be read
+		body,					// the rest of the body of the last request is being read
+		asset,					// the ESP is sending a cached asset in response to the last request
+		webSocket,				// the connection was upgraded to a WebSocket and carries framed messages
+		passThrough				// framing was abandoned for the rest of the connection
+	};
+
 	void Poll();
-	void Accept(struct netconn *conn, uint8_t protocol);
+	bool Send(const uint8_t *data, size_t length, bool push);
+	size_t ReadBuffered(uint8_t *data, size_t length);
+	size_t ReadHttpRequest(uint8_t *data, size_t length);
+	void ScanHttpRequest();
+	bool ServeAsset();
+	void PollAsset();
+	bool AcceptWebSocket();
+	void ProcessWebSocket();
+	size_t ReadWebSocket(uint8_t *data, size_t length);
+	size_t WriteWebSocket(const uint8_t *data, size_t length, bool doPush, bool closeAfterSending);
+	bool SendWebSocketFrame(uint8_t opcode, const uint8_t *data, size_t length);
+	void CloseWebSocket(uint16_t status);
+	void PollUdp();
+	void PollTls();
+	bool Accept(struct netconn *conn, uint8_t protocol, uint8_t flags);
 	void Connected(struct netconn *conn);
+	void Resolved(uint8_t sequence, const ip_addr_t& ip);
+	void PollResolved();
 	void SetState(ConnState st) { state = st; }
 	ConnState GetState() const { return state; }
 
 	void FreePbuf();
+	void FreeDatagrams();
+	void ResetStats();
 	void Report();
 
 	static uint16_t CountConnectionsOnPort(uint16_t port);
@@ -65,25 +124,86 @@ private:
 	static void ConnectionTask(void* data);
 	static void ListenCallback(struct netconn *conn, enum netconn_evt evt, u16_t len);
 	static void ConnectCallback(struct netconn *conn, enum netconn_evt evt, u16_t len);
+	static void StartResolve(void *arg);
+	static void ResolveCallback(const char *name, const ip_addr_t *ipaddr, void *arg);
+	static void PostResolved(uintptr_t token, const ip_addr_t *ipaddr);
+	static void CheckPcbs(void *arg);
+	static void PcbExhausted() { ++pcbExhaustedCount; }
 
 	uint8_t number;
 	uint8_t protocol;
+	bool udp;					// true if this is a UDP socket rather than a TCP connection
+	uint8_t resolveSequence;	// identifies the latest host name resolution started for this connection
+	volatile bool resolvePending;	// true if the connection task has passed us the result of the latest resolution
+	uint8_t resolvedSequence;	// the resolution that the result is for
+	ip_addr_t resolvedIp;		// the result, all zeros if the name could not be resolved
 	uint16_t localPort;
 	uint16_t remotePort;
-	uint32_t remoteIp;
+	ip_addr_t remoteIp;			// IPv4 or IPv6 address of the other end
 	struct netconn *conn;		// the pcb that corresponds to this connection
+	TlsSession *tls;			// the TLS session if this connection was accepted by a secure listener
+	uint32_t tlsCloseStartedAt;	// millis() when we sent the close_notify alert
 	volatile ConnState state;
 
 	struct pbuf *readBuf;		// the buffers holding data we have received that has not yet been taken
 	size_t readIndex;			// how much data we have already read from the current pbuf
 	size_t alreadyRead;			// how much data we read from previous pbufs and didn't tell LWIP about yet
 
+	struct netbuf *datagrams[MaxQueuedDatagrams];	// received datagrams not yet taken, if this is a UDP socket
+	uint8_t datagramHead;		// index of the oldest queued datagram
+	uint8_t datagramCount;		// number of queued datagrams
+
+	HttpPhase httpPhase;		// HTTP request framing state, if this connection was accepted by a listener that asked for it
+	HttpMethod httpMethod;		// details of the request whose header block is ready to be read
+	uint8_t httpFlags;
+	uint16_t httpHeaderLength;
+	uint32_t httpContentLength;
+	uint32_t httpBodyRemaining;	// how much of the body of the current request has not been read yet
+
+	bool serveAssets;			// true if GET requests for cached assets are answered by the ESP
+	const uint8_t *assetData;	// the rest of the cached asset being sent
+	uint32_t assetRemaining;
+	uint32_t assetGeneration;	// the asset cache generation when we started sending it
+
+	bool acceptWebSockets;		// true if WebSocket upgrade requests are accepted by the ESP
+	bool wsFramePending;		// true if the header of a data frame has been taken and its payload has not all been read
+	bool wsFinal;				// true if the pending frame ends its message
+	bool wsFirst;				// true if no part of the current message has been read yet
+	bool wsInMessage;			// true if a fragmented message has been started and not finished
+	bool wsClosing;				// true if a close frame has been received or a protocol error seen, so no more frames are processed
+	bool wsCloseSent;			// true if we have sent a close frame
+	uint8_t wsOpcode;			// the opcode of the current message
+	uint8_t wsMask[4];			// the masking key of the pending frame
+	uint8_t wsMaskIndex;		// the position in the masking key of the next payload byte
+	uint32_t wsPayloadRemaining;	// how much of the payload of the pending frame has not been read yet
+
+#if SUPPORT_COMPRESSION
+	GzipEncoder::Stream gzip;	// the response body being compressed, if any
+#endif
+
+	uint32_t bytesIn;			// traffic statistics, reset when the connection is established
+	uint32_t bytesOut;
+	uint32_t readCalls;
+	uint32_t writeCalls;
+	uint32_t writeFailures;
+	uint32_t connectedAt;		// millis() when the connection was established
+	uint32_t readyAt;			// millis() when data last became available to read after there was none
+
 	static QueueHandle_t connectionQueue;
 	static SemaphoreHandle_t allocateMutex;
 
 	static struct netconn *closePending[MaxConnections];
+	static const char * volatile lastError;		// why a connection failed when no command was in progress to report it
 
 	static Connection *connectionList[MaxConnections];
+
+	// TCP PCB pool usage, updated by CheckPcbs in the TCP/IP task
+	static volatile bool pcbCheckPending;
+	static uint32_t lastPcbCheck;
+	static volatile uint16_t activePcbCount;
+	static volatile uint16_t timeWaitPcbCount;
+	static volatile uint32_t pcbRecycledCount;
+	static volatile uint32_t pcbExhaustedCount;
 };
 
 #endif /* SRC_CONNECTION_H_ */
@@ -1,5 +1,5 @@
 #include <cstring>
-#include <algorithm>
+#include <cctype>
 
 #include <lwip/def.h>
 
@@ -8,9 +8,20 @@
 
 typedef enum {
   SERVER_STOP = 1,
-  SERVER_START = 2
+  SERVER_START = 2,
+  PACKET_RECEIVED = 4
 } dns_state_t;
 
+// Called by lwIP for events on the UDP netconn. The task sleeps until this tells it that a packet has arrived.
+void DNSServer::netconnCallback(struct netconn *conn, enum netconn_evt evt, u16_t len)
+{
+  if (evt == NETCONN_EVT_RCVPLUS && conn->socket > 0)
+  {
+    DNSServer* server = reinterpret_cast<DNSServer*>(conn->socket);
+    xTaskNotify(server->taskHdl, PACKET_RECEIVED, eSetBits);
+  }
+}
+
 void DNSServer::task(void* p)
 {
   DNSServer* server = reinterpret_cast<DNSServer*>(p);
@@ -18,10 +29,12 @@ void DNSServer::task(void* p)
   while(xTaskNotifyWait(0, UINT_MAX, &flags, portMAX_DELAY) == pdTRUE) {
     if (!(flags & SERVER_STOP)) {
       if((flags & SERVER_START) && server->_udp == nullptr) {
-          struct netconn* temp = netconn_new(NETCONN_UDP);
+          struct netconn* temp = netconn_new_with_callback(NETCONN_UDP, netconnCallback);
           if (temp)
           {
-            netconn_set_recvtimeout(temp, 100);
+            netconn_set_nonblocking(temp, 1);
+            static_assert(sizeof(temp->socket) == sizeof(server));
+            temp->socket = reinterpret_cast<int>(server);
             err_t rc = netconn_bind(temp, IP4_ADDR_ANY, server->_port);
             if (rc == ERR_OK) {
               server->_udp = temp;
@@ -31,50 +44,86 @@ void DNSServer::task(void* p)
               server->_udp = nullptr;
             }
           }
+          if (server->_udp && server->_reply == nullptr) {
+            server->_reply = netbuf_new();
+          }
       }
 
-      server->processNextRequest();
-      xTaskNotify(server->taskHdl, 0, eNoAction);
+      // Handle everything that has been received, since several packets may have arrived for one wakeup
+      if (server->_udp) {
+        while (server->processNextRequest()) { }
+      }
     } else {
       if (server->_udp) {
         netconn_close(server->_udp);
         netconn_delete(server->_udp);
         server->_udp = nullptr;
-        free(server->_buffer);
-        server->_buffer = NULL;
+      }
+      if (server->_reply) {
+        netbuf_delete(server->_reply);
+        server->_reply = nullptr;
       }
     }
   }
 }
 
-void replace(std::string &data, std::string to_replace, std::string replacement)
+DNSServer::DNSServer()
+{
+  _udp = nullptr;
+  _reply = nullptr;
+  _numRecords = 0;
+  _ttl = htonl(60);
+  _errorReplyCode = DNSReplyCode::NonExistentDomain;
+}
+
+bool DNSServer::addRecord(const char *domainName, const ip_addr_t &ip)
 {
-    size_t pos = data.find(to_replace);
-    while(pos != std::string::npos)
+  // Store the name in lower case without any www. prefix, so that requests can be matched against it in place
+  if (strncasecmp(domainName, "www.", 4) == 0)
+  {
+    domainName += 4;
+  }
+  DNSRecord record;
+  size_t i = 0;
+  for (; domainName[i] != 0 && i < DNS_MAX_DOMAIN_LENGTH; ++i)
+  {
+    record.name[i] = tolower(domainName[i]);
+  }
+  record.name[i] = 0;
+  memcpy(record.ip, &ip.u_addr.ip4.addr, sizeof(record.ip));
+
+  for (i = 0; i < _numRecords; ++i)
+  {
+    if (strcmp(_records[i].name, record.name) == 0)
     {
-        data.replace(pos, to_replace.size(), replacement);
-        pos =data.find(to_replace, pos + replacement.size());
+      _records[i] = record;
+      return true;
     }
+  }
+  if (_numRecords == DNS_MAX_RECORDS)
+  {
+    return false;
+  }
+  _records[_numRecords++] = record;
+  return true;
 }
 
-DNSServer::DNSServer()
+void DNSServer::clearRecords()
 {
-  _ttl = htonl(60);
-  _errorReplyCode = DNSReplyCode::NonExistentDomain;
+  _numRecords = 0;
 }
 
-bool DNSServer::start(const uint16_t &port, const std::string &domainName,
+bool DNSServer::start(const uint16_t &port, const char *domainName,
                      const ip_addr_t &resolvedIP)
+{
+  clearRecords();
+  addRecord(domainName, resolvedIP);
+  return start(port);
+}
+
+bool DNSServer::start(const uint16_t &port)
 {
   _port = port;
-  _buffer = NULL;
-  _domainName = domainName;
-  unsigned char* resolvedIPAddr = (unsigned char*) &resolvedIP.u_addr.ip4.addr;
-  _resolvedIP[0] = resolvedIPAddr[0];
-  _resolvedIP[1] = resolvedIPAddr[1];
-  _resolvedIP[2] = resolvedIPAddr[2];
-  _resolvedIP[3] = resolvedIPAddr[3];
-  downcaseAndRemoveWwwPrefix(_domainName);
 
   if (!taskHdl) {
     xTaskCreate(&task, "dnsSrv", DNS_SERVER_STACK, this, DNS_SERVER_PRIO, &taskHdl);
@@ -97,141 +146,332 @@ void DNSServer::setTTL(const uint32_t &ttl)
 
 void DNSServer::stop()
 {
+  if (!taskHdl) return;
   xTaskNotify(taskHdl, SERVER_STOP, eSetValueWithOverwrite);
 }
 
-void DNSServer::downcaseAndRemoveWwwPrefix(std::string &domainName)
-{
-  std::for_each(domainName.begin(), domainName.end(), [](char & c){
-      c = ::tolower(c);
-  });
-  replace(domainName, "www", "");
-}
-
-void DNSServer::processNextRequest()
+// Handle one received request. Returns false if there was none waiting.
+bool DNSServer::processNextRequest()
 {
   struct netbuf *data = nullptr;
-  netconn_recv(_udp, &data);
+  if (netconn_recv(_udp, &data) != ERR_OK || data == nullptr)
+  {
+    return false;
+  }
 
-  _currentPacketSize = data ? netbuf_len(data) : 0;
+  // Anything beyond the buffer can only be additional records, which we don't use
+  _currentPacketSize = netbuf_copy(data, _buffer, sizeof(_buffer));
+  _remotePort = netbuf_fromport(data);
+  memcpy(&_remoteIp, netbuf_fromaddr(data), sizeof(_remoteIp));
+  netbuf_delete(data);
 
-  if (_currentPacketSize > 0)
+  if (_currentPacketSize < sizeof(DNSHeader))
   {
-    _remotePort = netbuf_fromport(data);
-    memcpy(&_remoteIp, netbuf_fromaddr(data), sizeof(_remoteIp));
-    if (_buffer != NULL) free(_buffer);
-    _buffer = (unsigned char*)malloc(_currentPacketSize * sizeof(char));
-    if (_buffer == NULL) return;
-    netbuf_copy(data, _buffer, _currentPacketSize);
-    _dnsHeader = (DNSHeader*) _buffer;
-
-    if (_dnsHeader->QR == DNS_QR_QUERY &&
-        _dnsHeader->OPCode == DNS_OPCODE_QUERY &&
-        requestIncludesOnlyOneQuestion() &&
-        (_domainName == "*" || getDomainNameWithoutWwwPrefix() == _domainName)
-      )
-    {
-      replyWithIP();
-    }
-    else if (_dnsHeader->QR == DNS_QR_QUERY)
-    {
-      replyWithCustomCode();
-    }
+    return true;
+  }
+  _dnsHeader = (DNSHeader*) _buffer;
 
-    free(_buffer);
-    netbuf_delete(data);
-    _buffer = NULL;
+  if (_dnsHeader->QR != DNS_QR_QUERY)
+  {
+    return true;
+  }
+  if (_dnsHeader->OPCode != DNS_OPCODE_QUERY)
+  {
+    replyWithCustomCode(DNSReplyCode::NotImplemented);
+  }
+  else
+  {
+    replyToQuery();
   }
+  return true;
+}
+
+static inline uint16_t getU16(const unsigned char *p)
+{
+  return (p[0] << 8) | p[1];
 }
 
-bool DNSServer::requestIncludesOnlyOneQuestion()
+static inline unsigned char *putU16(unsigned char *p, uint16_t v)
 {
-  return ntohs(_dnsHeader->QDCount) == 1 &&
-         _dnsHeader->ANCount == 0 &&
-         _dnsHeader->NSCount == 0 &&
-         _dnsHeader->ARCount == 0;
+  p[0] = v >> 8;
+  p[1] = v & 0xFF;
+  return p + 2;
 }
 
-std::string DNSServer::getDomainNameWithoutWwwPrefix()
+static inline unsigned char *putU32(unsigned char *p, uint32_t v)
 {
-  std::string parsedDomainName = "";
-  if (_buffer == NULL) return parsedDomainName;
-  unsigned char *start = _buffer + 12;
-  if (*start == 0)
+  return putU16(putU16(p, v >> 16), v & 0xFFFF);
+}
+
+// Return the position after the name that starts at pos, or 0 if it is malformed or incomplete
+size_t DNSServer::skipName(size_t pos)
+{
+  while (pos < _currentPacketSize)
   {
-    return parsedDomainName;
+    const size_t labelLength = _buffer[pos];
+    if (labelLength == 0)
+    {
+      return pos + 1;
+    }
+    if ((labelLength & 0xC0) == 0xC0)
+    {
+      return (pos + 2 <= _currentPacketSize) ? pos + 2 : 0;
+    }
+    if (labelLength > 63)
+    {
+      return 0;
+    }
+    pos += labelLength + 1;
   }
-  int pos = 0;
-  while(true)
+  return 0;
+}
+
+// Compare the name at pos with a domain name label by label, ignoring case and a leading www label
+bool DNSServer::nameMatches(size_t pos, const char *domainName)
+{
+  const char *expected = domainName;
+  bool firstLabel = true;
+  unsigned int pointers = 0;
+  while (pos < _currentPacketSize)
   {
-    unsigned char labelLength = *(start + pos);
-    for(int i = 0; i < labelLength; i++)
+    const size_t labelLength = _buffer[pos++];
+    if (labelLength == 0)
     {
-      pos++;
-      parsedDomainName += (char)*(start + pos);
+      return *expected == 0;
     }
-    pos++;
-    if (*(start + pos) == 0)
+    if ((labelLength & 0xC0) == 0xC0)
     {
-      downcaseAndRemoveWwwPrefix(parsedDomainName);
-      return parsedDomainName;
+      // Compression pointer, which a later question may use to refer to an earlier one
+      if (pos >= _currentPacketSize || ++pointers > DNS_MAX_QUESTIONS)
+      {
+        return false;
+      }
+      pos = ((labelLength & 0x3F) << 8) | _buffer[pos];
+      continue;
     }
-    else
+    if (labelLength > 63 || pos + labelLength > _currentPacketSize)
+    {
+      return false;
+    }
+
+    const char *label = (const char*)_buffer + pos;
+    pos += labelLength;
+    if (firstLabel)
+    {
+      firstLabel = false;
+      if (labelLength == 3 && strncasecmp(label, "www", 3) == 0)
+      {
+        continue;
+      }
+    }
+    if (expected != domainName && *expected++ != '.')
+    {
+      return false;
+    }
+
+    for (size_t i = 0; i < labelLength; ++i)
     {
-      parsedDomainName += ".";
+      if (*expected == 0 || tolower((unsigned char)label[i]) != *expected++)
+      {
+        return false;
+      }
     }
   }
+  return false;
 }
 
-void DNSServer::replyWithIP()
+// Return the record for the name at pos, preferring an exact match to a wildcard, or -1 if there is none
+int DNSServer::findRecord(size_t pos)
 {
-  if (_buffer == NULL) return;
-  _dnsHeader->QR = DNS_QR_RESPONSE;
-  _dnsHeader->ANCount = _dnsHeader->QDCount;
-  _dnsHeader->QDCount = _dnsHeader->QDCount;
-  // _dnsHeader->RA = 1;
-
-  struct netbuf* data = netbuf_new();
-  uint8_t* allocd = (uint8_t*)netbuf_alloc(data, _currentPacketSize + 16);
-  netbuf_take(data, _buffer, _currentPacketSize);
+  int wildcard = -1;
+  for (size_t i = 0; i < _numRecords; ++i)
+  {
+    if (strcmp(_records[i].name, "*") == 0)
+    {
+      wildcard = i;
+    }
+    else if (nameMatches(pos, _records[i].name))
+    {
+      return i;
+    }
+  }
+  return wildcard;
+}
 
-  uint8_t *more = &allocd[_currentPacketSize];
+// Write the start of a resource record whose name is the one at nameOffset and return where its data goes
+unsigned char *DNSServer::putRecordHeader(unsigned char *p, size_t nameOffset, uint16_t type, uint16_t dataLength)
+{
+  p = putU16(p, 0xC000 | nameOffset);
+  p = putU16(p, type);
+  p = putU16(p, DNS_CLASS_IN);
+  memcpy(p, &_ttl, 4);
+  return putU16(p + 4, dataLength);
+}
 
-  more[0] = 192; //  answer name is a pointer
-  more[1] = 12; // pointer to offset at 0x00c
+// Answer the questions in the request, building the reply over the request in _buffer.
+// A names with a record get an A answer for A and ANY queries. Other types such as AAAA and HTTPS, and names without
+// a record, get no answer and an SOA record so that clients cache the result for the TTL instead of retrying.
+void DNSServer::replyToQuery()
+{
+  static const size_t RecordHeaderLength = 12;
+  static const size_t ARecordLength = RecordHeaderLength + 4;
+  static const size_t SoaRecordLength = RecordHeaderLength + 2 + 1 + 5 * 4;
+  static const size_t OptRecordLength = 11;
 
-  more[2] = 0; // 0x0001  answer is type A query (host address)
-  more[3] = 1;
+  const size_t questionCount = ntohs(_dnsHeader->QDCount);
+  if (questionCount == 0 || questionCount > DNS_MAX_QUESTIONS)
+  {
+    replyWithCustomCode(DNSReplyCode::FormError);
+    return;
+  }
 
-  more[4] = 0; //0x0001 answer is class IN (internet address)
-  more[5] = 1;
+  size_t questionOffset[DNS_MAX_QUESTIONS];
+  uint16_t questionType[DNS_MAX_QUESTIONS];
+  int questionRecord[DNS_MAX_QUESTIONS];
+  size_t pos = sizeof(DNSHeader);
+  for (size_t i = 0; i < questionCount; ++i)
+  {
+    const size_t nameEnd = skipName(pos);
+    if (nameEnd == 0 || nameEnd + 4 > _currentPacketSize)
+    {
+      replyWithCustomCode(DNSReplyCode::FormError);
+      return;
+    }
+    const uint16_t questionClass = getU16(&_buffer[nameEnd + 2]);
+    questionOffset[i] = pos;
+    questionType[i] = getU16(&_buffer[nameEnd]);
+    questionRecord[i] = (questionClass == DNS_CLASS_IN || questionClass == DNS_CLASS_ANY) ? findRecord(pos) : -1;
+    pos = nameEnd + 4;
+  }
+  const size_t questionsEnd = pos;
+
+  // Look for an EDNS OPT record among the additional records, so that we can return one
+  bool edns = false;
+  bool ednsSupported = true;
+  const size_t otherRecords = ntohs(_dnsHeader->ANCount) + ntohs(_dnsHeader->NSCount);
+  const size_t allRecords = otherRecords + ntohs(_dnsHeader->ARCount);
+  for (size_t i = 0; i < allRecords; ++i)
+  {
+    const size_t nameEnd = skipName(pos);
+    if (nameEnd == 0 || nameEnd + 10 > _currentPacketSize)
+    {
+      break;
+    }
+    if (i >= otherRecords && getU16(&_buffer[nameEnd]) == DNS_TYPE_OPT)
+    {
+      edns = true;
+      ednsSupported = (_buffer[nameEnd + 5] == 0);    // we only support EDNS version 0
+      break;
+    }
+    pos = nameEnd + 10 + getU16(&_buffer[nameEnd + 8]);
+  }
 
-  memcpy(&more[6], &_ttl, 4);
+  // Add the answers after the questions, leaving room for the OPT record
+  const size_t limit = sizeof(_buffer) - ((edns) ? OptRecordLength : 0);
+  size_t length = questionsEnd;
+  uint16_t answers = 0;
+  uint16_t authorities = 0;
+  bool anyRecord = false;
+  bool truncated = false;
+  int negative = -1;                  // the question to give the SOA record for
+  for (size_t i = 0; i < questionCount && ednsSupported; ++i)
+  {
+    if (questionRecord[i] >= 0)
+    {
+      anyRecord = true;
+      if (questionType[i] == DNS_TYPE_A || questionType[i] == DNS_TYPE_ANY)
+      {
+        if (length + ARecordLength > limit)
+        {
+          truncated = true;
+          break;
+        }
+        unsigned char *p = putRecordHeader(&_buffer[length], questionOffset[i], DNS_TYPE_A, 4);
+        memcpy(p, _records[questionRecord[i]].ip, 4);
+        length += ARecordLength;
+        ++answers;
+        continue;
+      }
+    }
+    if (negative < 0)
+    {
+      negative = i;
+    }
+  }
 
-  // Length of RData is 4 bytes (because, in this case, RData is IPv4)
-  more[10] = 0;
-  more[11] = 4;
+  if (negative >= 0 && !truncated)
+  {
+    if (length + SoaRecordLength > limit)
+    {
+      truncated = true;
+    }
+    else
+    {
+      uint32_t ttl = ntohl(_ttl);
+      unsigned char *p = putRecordHeader(&_buffer[length], questionOffset[negative], DNS_TYPE_SOA, SoaRecordLength - RecordHeaderLength);
+      p = putU16(p, 0xC000 | questionOffset[negative]);   // primary name server
+      *p++ = 0;                                           // responsible mailbox
+      p = putU32(p, 1);                                   // serial
+      p = putU32(p, ttl);                                 // refresh
+      p = putU32(p, ttl);                                 // retry
+      p = putU32(p, ttl);                                 // expire
+      putU32(p, ttl);                                     // minimum, the negative caching TTL
+      length += SoaRecordLength;
+      ++authorities;
+    }
+  }
 
-  memcpy(&more[12], _resolvedIP, 4);
+  if (truncated)
+  {
+    length = questionsEnd;
+    answers = authorities = 0;
+  }
 
-  netconn_sendto(_udp, data, &_remoteIp, _remotePort);
-  netbuf_delete(data);
+  if (edns)
+  {
+    unsigned char *p = &_buffer[length];
+    *p++ = 0;                                             // root name
+    p = putU16(p, DNS_TYPE_OPT);
+    p = putU16(p, DNS_MAX_PACKET_SIZE);                   // largest reply we send
+    *p++ = (ednsSupported) ? 0 : 1;                       // extended response code, 1 being BADVERS
+    *p++ = 0;                                             // version
+    p = putU16(p, 0);                                     // flags
+    putU16(p, 0);                                         // no options
+    length += OptRecordLength;
+  }
 
-  debugPrintf("DNS responds: %u.%u.%u.%u for %s\n",
-            _resolvedIP[0], _resolvedIP[1], _resolvedIP[2], _resolvedIP[3],
-            getDomainNameWithoutWwwPrefix().c_str());
+  _dnsHeader->QR = DNS_QR_RESPONSE;
+  _dnsHeader->AA = 1;
+  _dnsHeader->TC = (truncated) ? 1 : 0;
+  _dnsHeader->RA = 0;
+  _dnsHeader->Z = 0;
+  _dnsHeader->RCode = (unsigned char)((anyRecord || !ednsSupported) ? DNSReplyCode::NoError : _errorReplyCode);
+  _dnsHeader->ANCount = htons(answers);
+  _dnsHeader->NSCount = htons(authorities);
+  _dnsHeader->ARCount = htons((edns) ? 1 : 0);
+
+  sendReply(length);
+
+  debugPrintf("DNS responds: %u answers for %u questions\n", answers, (unsigned int)questionCount);
 }
 
-void DNSServer::replyWithCustomCode()
+void DNSServer::replyWithCustomCode(DNSReplyCode replyCode)
 {
-  if (_buffer == NULL) return;
   _dnsHeader->QR = DNS_QR_RESPONSE;
-  _dnsHeader->RCode = (unsigned char)_errorReplyCode;
+  _dnsHeader->RCode = (unsigned char)replyCode;
   _dnsHeader->QDCount = 0;
+  _dnsHeader->ANCount = 0;
+  _dnsHeader->NSCount = 0;
+  _dnsHeader->ARCount = 0;
 
-  struct netbuf* data = netbuf_new();
-  netbuf_alloc(data, sizeof(DNSHeader));
-  netbuf_take(data, _buffer, sizeof(DNSHeader));
-  netconn_sendto(_udp, data, &_remoteIp, _remotePort);
-  netbuf_delete(data);
+  sendReply(sizeof(DNSHeader));
+}
+
+// Send the reply built in _buffer. The reply netbuf only refers to the buffer, so nothing is allocated from the heap.
+void DNSServer::sendReply(size_t length)
+{
+  if (_reply != nullptr && netbuf_ref(_reply, _buffer, length) == ERR_OK)
+  {
+    netconn_sendto(_udp, _reply, &_remoteIp, _remotePort);
+  }
 }
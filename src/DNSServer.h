@@ -2,7 +2,6 @@
 #define DNSServer_h
 
 #include <stdint.h>
-#include <string>
 
 #include "lwip/api.h"
 
@@ -10,6 +9,21 @@
 #define DNS_QR_RESPONSE 1
 #define DNS_OPCODE_QUERY 0
 
+#define DNS_MAX_PACKET_SIZE 512     // largest request we handle, and largest reply we send
+#define DNS_MAX_DOMAIN_LENGTH 63
+#define DNS_MAX_QUESTIONS 4
+#define DNS_MAX_RECORDS 4
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_OPT 41
+#define DNS_TYPE_SVCB 64
+#define DNS_TYPE_HTTPS 65
+#define DNS_TYPE_ANY 255
+#define DNS_CLASS_IN 1
+#define DNS_CLASS_ANY 255
+
 enum class DNSReplyCode
 {
   NoError = 0,
@@ -40,18 +54,31 @@ struct DNSHeader
   uint16_t ARCount;          // number of resource entries
 };
 
+struct DNSRecord
+{
+  char name[DNS_MAX_DOMAIN_LENGTH + 1];   // lower case without any www. prefix, or "*" to match every name
+  unsigned char ip[4];
+};
+
 class DNSServer
 {
   public:
     DNSServer();
 
-    void processNextRequest();
+    bool processNextRequest();
     void setErrorReplyCode(const DNSReplyCode &replyCode);
     void setTTL(const uint32_t &ttl);
 
+    // Change the A records that we answer with. Names that have no record get an empty answer with the error reply code.
+    // Returns false if the table is full.
+    bool addRecord(const char *domainName, const ip_addr_t &ip);
+    void clearRecords();
+
     // Returns true if successful, false if there are no sockets available
+    bool start(const uint16_t &port);
+    // Start with a single record
     bool start(const uint16_t &port,
-              const std::string &domainName,
+              const char *domainName,
               const ip_addr_t &resolvedIP);
     // stops the DNS server
     void stop();
@@ -59,11 +86,12 @@ class DNSServer
   private:
 
     struct netconn* _udp;
+    struct netbuf* _reply;      // reused for every reply, refers to _buffer
     uint16_t _port;
-    std::string _domainName;
-    unsigned char _resolvedIP[4];
-    int _currentPacketSize;
-    unsigned char* _buffer;
+    DNSRecord _records[DNS_MAX_RECORDS];
+    size_t _numRecords;
+    size_t _currentPacketSize;
+    unsigned char _buffer[DNS_MAX_PACKET_SIZE];   // the request, which the reply is built on in place
     DNSHeader* _dnsHeader;
     uint32_t _ttl;
     DNSReplyCode _errorReplyCode;
@@ -72,11 +100,14 @@ class DNSServer
 
     TaskHandle_t taskHdl;
     static void task(void* p);
+    static void netconnCallback(struct netconn *conn, enum netconn_evt evt, u16_t len);
 
-    void downcaseAndRemoveWwwPrefix(std::string &domainName);
-    std::string getDomainNameWithoutWwwPrefix();
-    bool requestIncludesOnlyOneQuestion();
-    void replyWithIP();
-    void replyWithCustomCode();
+    size_t skipName(size_t pos);
+    bool nameMatches(size_t pos, const char *domainName);
+    int findRecord(size_t pos);
+    unsigned char *putRecordHeader(unsigned char *p, size_t nameOffset, uint16_t type, uint16_t dataLength);
+    void replyToQuery();
+    void replyWithCustomCode(DNSReplyCode replyCode);
+    void sendReply(size_t length);
 };
 #endif
\ No newline at end of file
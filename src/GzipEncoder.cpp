@@ -0,0 +1,324 @@
+/*
+ * GzipEncoder.cpp
+ *
+ * Compact gzip encoder for response bodies.
+ *
+ * Each call to Encode produces one deflate block. Matches are found using hash chains over the data passed
+ * and, if the workspace was last used by the same stream, the data passed in the previous call.
+ * Blocks use the fixed Huffman codes, so no code tables need to be built or sent, and a block that would
+ * come out longer than the input is sent stored instead.
+ */
+
+#include "GzipEncoder.h"
+
+#if SUPPORT_COMPRESSION
+
+#include <cstring>
+#include <algorithm>
+#include <new>
+
+#include "rom/crc.h"
+#include "rom/ets_sys.h"
+
+static constexpr unsigned HashBits = 11;
+static constexpr size_t HashSize = 1u << HashBits;
+static constexpr size_t HistoryLength = MaxDataLength;		// how far back matches may refer into the previous data of the stream
+static constexpr size_t WindowLength = HistoryLength + GzipEncoder::MaxInputLength;
+static constexpr size_t OutputLength = GzipEncoder::MaxInputLength + GzipEncoder::MaxInputLength/2 + GzipEncoder::MaxOverhead;
+static constexpr size_t MinMatch = 3;
+static constexpr size_t MaxMatch = 258;
+static constexpr unsigned MaxChain = 8;						// how many earlier positions with the same hash we try
+
+static_assert(WindowLength < 32768, "Window too large for deflate distances");
+static_assert(MaxDataLength + GzipEncoder::MaxOverhead <= 0xFFFF, "Chunk length may need more than 4 hex digits");
+
+// Fixed Huffman code details from RFC 1951
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static const uint16_t EndOfBlock = 256;
+
+struct GzipEncoder::Workspace
+{
+	uint8_t window[WindowLength];		// history of the stream followed by the data being compressed
+	uint16_t head[HashSize];			// 1 + the most recent position with each hash, or 0 if there is none
+	uint16_t prev[WindowLength];		// 1 + the previous position with the same hash as each position, or 0
+	uint8_t output[OutputLength];
+	uint32_t historyId;					// the stream that the history belongs to
+	size_t historyLength;
+};
+
+// Deflate output, which is packed starting at the least significant bit of each byte
+class BitWriter
+{
+public:
+	BitWriter(uint8_t *p, uint32_t b, unsigned n) : pos(0), bits(b), count(n), out(p) { }
+
+	void Put(uint32_t value, unsigned n)
+	{
+		bits |= value << count;
+		count += n;
+		while (count >= 8)
+		{
+			out[pos++] = (uint8_t)bits;
+			bits >>= 8;
+			count -= 8;
+		}
+	}
+
+	// Huffman codes are packed starting at their most significant bit
+	void PutCode(uint32_t code, unsigned n)
+	{
+		uint32_t reversed = 0;
+		for (unsigned i = 0; i < n; ++i)
+		{
+			reversed = (reversed << 1) | ((code >> i) & 1);
+		}
+		Put(reversed, n);
+	}
+
+	void Align()
+	{
+		if (count != 0)
+		{
+			out[pos++] = (uint8_t)bits;
+			bits = 0;
+			count = 0;
+		}
+	}
+
+	void PutWord(uint32_t value)
+	{
+		for (unsigned i = 0; i < 4; ++i)
+		{
+			out[pos++] = (uint8_t)(value >> (8 * i));
+		}
+	}
+
+	size_t pos;
+	uint32_t bits;
+	unsigned count;
+
+private:
+	uint8_t *out;
+};
+
+static void PutSymbol(BitWriter& w, unsigned symbol)
+{
+	if (symbol < 144)
+	{
+		w.PutCode(0x30 + symbol, 8);
+	}
+	else if (symbol < 256)
+	{
+		w.PutCode(0x190 + symbol - 144, 9);
+	}
+	else if (symbol < 280)
+	{
+		w.PutCode(symbol - 256, 7);
+	}
+	else
+	{
+		w.PutCode(0xC0 + symbol - 280, 8);
+	}
+}
+
+static void PutMatch(BitWriter& w, size_t length, size_t distance)
+{
+	unsigned code = ARRAY_SIZE(lengthBase) - 1;
+	while (lengthBase[code] > length)
+	{
+		--code;
+	}
+	PutSymbol(w, 257 + code);
+	w.Put(length - lengthBase[code], lengthExtra[code]);
+
+	code = ARRAY_SIZE(distanceBase) - 1;
+	while (distanceBase[code] > distance)
+	{
+		--code;
+	}
+	w.PutCode(code, 5);
+	w.Put(distance - distanceBase[code], distanceExtra[code]);
+}
+
+static inline unsigned Hash(const uint8_t *p)
+{
+	return (((uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2]) * 2654435761u) >> (32 - HashBits);
+}
+
+static inline void Insert(uint16_t *head, uint16_t *prev, const uint8_t *window, size_t pos)
+{
+	const unsigned h = Hash(window + pos);
+	prev[pos] = head[h];
+	head[h] = pos + 1;
+}
+
+// Static data
+GzipEncoder::Workspace *GzipEncoder::workspace = nullptr;
+uint32_t GzipEncoder::nextId = 0;
+uint32_t GzipEncoder::streams = 0;
+uint32_t GzipEncoder::totalIn = 0;
+uint32_t GzipEncoder::totalOut = 0;
+
+/*static*/ void GzipEncoder::Begin(Stream& stream)
+{
+	stream.id = ++nextId;
+	stream.crc = 0;
+	stream.size = 0;
+	stream.bits = 0;
+	stream.bitCount = 0;
+	stream.active = false;
+}
+
+// Compress the data and return the output to send, which starts with the gzip header on the first call for the stream.
+// If 'finish' is true then the stream is ended with the gzip trailer. The output stays valid until the next call.
+/*static*/ const uint8_t *GzipEncoder::Encode(Stream& stream, const uint8_t *data, size_t length, bool finish, size_t& outLength)
+{
+	if (length > MaxInputLength)
+	{
+		return nullptr;
+	}
+
+	if (workspace == nullptr)
+	{
+		workspace = new (std::nothrow) Workspace;
+		if (workspace == nullptr)
+		{
+			return nullptr;
+		}
+		workspace->historyId = 0;
+		workspace->historyLength = 0;
+	}
+
+	Workspace& ws = *workspace;
+	BitWriter w(ws.output, stream.bits, stream.bitCount);
+	if (!stream.active)
+	{
+		// No file name, modification time or flags, unknown OS
+		static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 0xFF };
+		memcpy(ws.output, header, sizeof(header));
+		w.pos = sizeof(header);
+		stream.active = true;
+		++streams;
+	}
+
+	if (length != 0)
+	{
+		const size_t history = (ws.historyId == stream.id) ? ws.historyLength : 0;
+		memcpy(ws.window + history, data, length);
+		const size_t end = history + length;
+
+		memset(ws.head, 0, sizeof(ws.head));
+		for (size_t i = 0; i < history && i + MinMatch <= end; ++i)
+		{
+			Insert(ws.head, ws.prev, ws.window, i);
+		}
+
+		const BitWriter blockStart = w;
+		w.Put(0, 1);										// not the final block
+		w.Put(1, 2);										// fixed Huffman codes
+
+		size_t p = history;
+		while (p < end)
+		{
+			size_t bestLength = 0;
+			size_t bestDistance = 0;
+			if (p + MinMatch <= end)
+			{
+				const unsigned h = Hash(ws.window + p);
+				const size_t maxLength = std::min<size_t>(end - p, MaxMatch);
+				unsigned candidate = ws.head[h];
+				for (unsigned chain = 0; candidate != 0 && chain < MaxChain; ++chain)
+				{
+					const size_t c = candidate - 1;
+					size_t matchLength = 0;
+					while (matchLength < maxLength && ws.window[c + matchLength] == ws.window[p + matchLength])
+					{
+						++matchLength;
+					}
+					if (matchLength > bestLength)
+					{
+						bestLength = matchLength;
+						bestDistance = p - c;
+						if (matchLength == maxLength)
+						{
+							break;
+						}
+					}
+					candidate = ws.prev[c];
+				}
+				ws.prev[p] = ws.head[h];
+				ws.head[h] = p + 1;
+			}
+
+			if (bestLength >= MinMatch)
+			{
+				PutMatch(w, bestLength, bestDistance);
+				for (size_t i = p + 1; i < p + bestLength && i + MinMatch <= end; ++i)
+				{
+					Insert(ws.head, ws.prev, ws.window, i);
+				}
+				p += bestLength;
+			}
+			else
+			{
+				PutSymbol(w, ws.window[p]);
+				++p;
+			}
+		}
+		PutSymbol(w, EndOfBlock);
+
+		// If the data didn't compress, e.g. because it already was, send it stored instead
+		const size_t storedLength = blockStart.pos + (blockStart.count + 3 + 7)/8 + 4 + length;
+		if (w.pos > storedLength)
+		{
+			w = blockStart;
+			w.Put(0, 1);
+			w.Put(0, 2);									// stored
+			w.Align();
+			w.Put(length, 16);
+			w.Put(~length & 0xFFFF, 16);
+			memcpy(ws.output + w.pos, data, length);
+			w.pos += length;
+		}
+
+		stream.crc = crc32_le(stream.crc, data, length);
+		stream.size += length;
+
+		// Keep the end of the window as history for the next call for this stream
+		const size_t keep = std::min<size_t>(end, HistoryLength);
+		memmove(ws.window, ws.window + end - keep, keep);
+		ws.historyLength = keep;
+		ws.historyId = stream.id;
+	}
+
+	if (finish)
+	{
+		w.Put(1, 1);										// final block
+		w.Put(1, 2);
+		PutSymbol(w, EndOfBlock);
+		w.Align();
+		w.PutWord(stream.crc);
+		w.PutWord(stream.size);
+		stream.active = false;
+	}
+
+	stream.bits = w.bits;
+	stream.bitCount = w.count;
+	totalIn += length;
+	totalOut += w.pos;
+	outLength = w.pos;
+	return ws.output;
+}
+
+/*static*/ void GzipEncoder::Report()
+{
+	ets_printf("Compression: %u responses, %u bytes in, %u bytes out\n", streams, totalIn, totalOut);
+}
+
+#endif
+
+// End
@@ -0,0 +1,59 @@
+/*
+ * GzipEncoder.h
+ *
+ * Compact gzip encoder for response bodies, using LZ77 matching within a small window and the fixed Huffman codes.
+ * The matching workspace is shared by all connections, so each connection only keeps a few words of stream state.
+ */
+
+#ifndef SRC_GZIPENCODER_H_
+#define SRC_GZIPENCODER_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "include/MessageFormats.h"
+#include "Config.h"
+
+#if SUPPORT_COMPRESSION
+
+class GzipEncoder
+{
+public:
+	static constexpr size_t MaxInputLength = MaxDataLength;		// most data that can be passed to Encode at a time
+
+	// Worst case growth of one write, which happens when the data is sent as a stored block in the first and last write of the stream
+	static constexpr size_t HeaderLength = 10;						// gzip header
+	static constexpr size_t MaxBlockFraming = 2 + 4;				// bits left from the previous block and the block type padded to a byte, then LEN and NLEN
+	static constexpr size_t MaxEndLength = 3 + 8;					// bits left from the last block and the empty final block padded to a byte, then the gzip trailer
+	static constexpr size_t MaxChunkFraming = 6 + 2 + 5;			// chunk length line of up to 4 hex digits, CRLF after the data, then the last chunk
+	static constexpr size_t MaxOverhead = HeaderLength + MaxBlockFraming + MaxEndLength + MaxChunkFraming + 8;	// most that a chunked write can exceed the input by, with a margin
+
+	// State of one compressed stream, kept by the connection between writes
+	struct Stream
+	{
+		uint32_t id;				// identifies the stream whose history is held in the workspace
+		uint32_t crc;
+		uint32_t size;				// uncompressed length so far
+		uint32_t bits;				// output bits that don't make a whole byte yet
+		uint8_t bitCount;
+		bool active;				// true if the gzip header has been sent and the trailer hasn't
+	};
+
+	static void Begin(Stream& stream);
+	static const uint8_t *Encode(Stream& stream, const uint8_t *data, size_t length, bool finish, size_t& outLength);
+	static void Report();
+
+private:
+	struct Workspace;
+
+	static Workspace *workspace;
+	static uint32_t nextId;
+
+	static uint32_t streams;
+	static uint32_t totalIn;
+	static uint32_t totalOut;
+};
+
+#endif
+
+#endif /* SRC_GZIPENCODER_H_ */
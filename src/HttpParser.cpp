@@ -0,0 +1,137 @@
+/*
+ * HttpParser.cpp
+ *
+ * Minimal parsing of HTTP request header blocks held in a chain of LWIP pbufs.
+ */
+
+#include <cstring>
+#include <strings.h>		// for strncasecmp
+
+#include "HttpParser.h"
+
+static const u16_t NotFound = 0xFFFF;			// returned by pbuf_memfind
+static const size_t MaxFieldNameLength = 32;
+static const size_t MaxMethodLength = 8;
+
+// The names must be in the same order as HttpMethod
+static const char * const methodNames[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH" };
+
+// Return the offset of the next CRLF at or after 'offset', or NotFound
+static u16_t FindLineEnd(const struct pbuf *p, size_t offset)
+{
+	return pbuf_memfind(p, "\r\n", 2, offset);
+}
+
+// Skip spaces and tabs, not going past 'end'
+static size_t SkipWhiteSpace(const struct pbuf *p, size_t offset, size_t end)
+{
+	while (offset < end)
+	{
+		const u8_t c = pbuf_get_at(p, offset);
+		if (c != ' ' && c != '\t')
+		{
+			break;
+		}
+		++offset;
+	}
+	return offset;
+}
+
+size_t HttpFindHeaderEnd(const struct pbuf *p, size_t offset)
+{
+	const u16_t end = pbuf_memfind(p, "\r\n\r\n", 4, offset);
+	return (end == NotFound) ? 0 : end + 4 - offset;
+}
+
+HttpMethod HttpGetMethod(const struct pbuf *p, size_t offset)
+{
+	const u16_t space = pbuf_memfind(p, " ", 1, offset);
+	if (space != NotFound && space > offset && space - offset <= MaxMethodLength)
+	{
+		char method[MaxMethodLength + 1];
+		const size_t length = pbuf_copy_partial(p, method, space - offset, offset);
+		method[length] = 0;
+		for (size_t i = 0; i < sizeof(methodNames)/sizeof(methodNames[0]); ++i)
+		{
+			if (strcmp(method, methodNames[i]) == 0)
+			{
+				return (HttpMethod)(i + 1);
+			}
+		}
+	}
+	return HttpMethod::other;
+}
+
+bool HttpGetUri(const struct pbuf *p, size_t offset, size_t headerLength, char *uri, size_t size)
+{
+	const u16_t lineEnd = FindLineEnd(p, offset);
+	const u16_t firstSpace = pbuf_memfind(p, " ", 1, offset);
+	if (lineEnd == NotFound || firstSpace == NotFound || firstSpace >= lineEnd)
+	{
+		return false;
+	}
+
+	const size_t start = firstSpace + 1;
+	u16_t end = pbuf_memfind(p, " ", 1, start);
+	if (end == NotFound || end > lineEnd)
+	{
+		end = lineEnd;										// HTTP/0.9 style request line with no version
+	}
+
+	const size_t length = end - start;
+	if (length == 0 || length >= size)
+	{
+		return false;
+	}
+	pbuf_copy_partial(p, uri, length, start);
+	uri[length] = 0;
+	return true;
+}
+
+bool HttpGetField(const struct pbuf *p, size_t offset, size_t headerLength, const char *name, char *value, size_t size)
+{
+	const size_t nameLength = strlen(name);
+	if (nameLength > MaxFieldNameLength)
+	{
+		return false;
+	}
+
+	const size_t headerEnd = offset + headerLength;
+	u16_t lineEnd = FindLineEnd(p, offset);					// skip the request line
+	while (lineEnd != NotFound && lineEnd + 2 < headerEnd)
+	{
+		const size_t lineStart = lineEnd + 2;
+		lineEnd = FindLineEnd(p, lineStart);
+		if (lineEnd == NotFound || lineEnd == lineStart)
+		{
+			break;											// end of the header block
+		}
+
+		if (lineEnd - lineStart > nameLength && pbuf_get_at(p, lineStart + nameLength) == ':')
+		{
+			char fieldName[MaxFieldNameLength];
+			pbuf_copy_partial(p, fieldName, nameLength, lineStart);
+			if (strncasecmp(fieldName, name, nameLength) == 0)
+			{
+				const size_t valueStart = SkipWhiteSpace(p, lineStart + nameLength + 1, lineEnd);
+				size_t valueEnd = lineEnd;
+				while (valueEnd > valueStart && (pbuf_get_at(p, valueEnd - 1) == ' ' || pbuf_get_at(p, valueEnd - 1) == '\t'))
+				{
+					--valueEnd;
+				}
+
+				const size_t length = valueEnd - valueStart;
+				if (length >= size)
+				{
+					return false;
+				}
+				pbuf_copy_partial(p, value, length, valueStart);
+				value[length] = 0;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// End
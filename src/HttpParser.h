@@ -0,0 +1,31 @@
+/*
+ * HttpParser.h
+ *
+ * Minimal parsing of HTTP request header blocks held in a chain of LWIP pbufs,
+ * so that requests can be framed and inspected without copying them first.
+ */
+
+#ifndef SRC_HTTPPARSER_H_
+#define SRC_HTTPPARSER_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "lwip/pbuf.h"
+
+#include "include/MessageFormats.h"		// for HttpMethod
+
+// Return the length of the header block that starts at 'offset', including the blank line that ends it, or 0 if it is not complete yet
+size_t HttpFindHeaderEnd(const struct pbuf *p, size_t offset);
+
+// Return the method of the request whose header block starts at 'offset'
+HttpMethod HttpGetMethod(const struct pbuf *p, size_t offset);
+
+// Copy the request URI into 'uri' with a null terminator. Returns false if there is none or it doesn't fit.
+bool HttpGetUri(const struct pbuf *p, size_t offset, size_t headerLength, char *uri, size_t size);
+
+// Find a header field by name, ignoring case, and copy its value without surrounding white space.
+// Returns false if the field is not present or its value doesn't fit.
+bool HttpGetField(const struct pbuf *p, size_t offset, size_t headerLength, const char *name, char *value, size_t size);
+
+#endif /* SRC_HTTPPARSER_H_ */
@@ -0,0 +1,953 @@
+/*
+ * KvStore.cpp
+ *
+ * Key-value store kept as a log of records in a raw flash partition.
+ *
+ * Each sector starts with a header giving the order in which it was started, followed by records that never
+ * cross into the next sector. A value is written as one or more records that share a value id, and only
+ * replaces the previous value once the record that completes it has been written, so a write interrupted by
+ * a power failure leaves the previous value in place. Writing a value or deleting a key makes the older records
+ * for that key garbage. When no more than the reserved number of free sectors is left, the records of the oldest
+ * sector that the index still refers to are copied to the head of the log and that sector is erased.
+ */
+
+#include "KvStore.h"
+
+#include <cstring>
+#include <algorithm>
+#include <new>
+
+#ifdef ESP8266
+#include "spi_flash.h"
+#else
+#include "esp_spi_flash.h"
+#endif
+
+static constexpr size_t SectorSize = SPI_FLASH_SEC_SIZE;
+
+KvStore::KvStore() : partition(nullptr), sectors(nullptr), numSectors(0), entries(nullptr), numEntries(0), maxEntries(0)
+{
+	memset(&pending, 0, sizeof(pending));
+	Clear();
+}
+
+KvStore::~KvStore()
+{
+	Clear();
+	delete[] entries;
+	delete[] sectors;
+}
+
+// Load the index from the partition. Only a partition that doesn't hold a store may be formatted, the others may hold values that we failed to load.
+KvStore::InitResult KvStore::Init(const esp_partition_t *part)
+{
+	Clear();
+	delete[] sectors;
+	partition = part;
+	numSectors = (part != nullptr) ? part->size / SectorSize : 0;
+	sectors = (numSectors >= ReserveSectors + 2) ? new (std::nothrow) Sector[numSectors] : nullptr;
+	if (sectors == nullptr)
+	{
+		partition = nullptr;
+		return InitResult::error;
+	}
+
+	bool found = false;
+	for (size_t s = 0; s < numSectors; ++s)
+	{
+		SectorHeader hdr;
+		sectors[s].validEnd = sizeof(SectorHeader);
+		if (esp_partition_read(partition, s * SectorSize, &hdr, sizeof(hdr)) != ESP_OK)
+		{
+			return InitResult::error;
+		}
+		if (hdr.magic == SectorMagic && hdr.sequence != 0xFFFFFFFF)
+		{
+			sectors[s].state = SectorState::inUse;
+			sectors[s].sequence = hdr.sequence;
+			if (hdr.sequence >= nextSequence)
+			{
+				nextSequence = hdr.sequence + 1;
+				head = s;
+			}
+			found = true;
+		}
+		else
+		{
+			// An erase of this sector may have been interrupted, so it is erased again before it is used
+			sectors[s].state = SectorState::unknown;
+			++freeSectors;
+		}
+	}
+
+	if (!found)
+	{
+		return InitResult::notAStore;
+	}
+
+	// The first pass checks the records and finds the latest complete value of each key, the second collects the records that hold it
+	for (size_t s = 0; s < numSectors; ++s)
+	{
+		if (sectors[s].state == SectorState::inUse && !ScanSector(s, true))
+		{
+			return InitResult::error;
+		}
+	}
+
+	for (size_t i = numEntries; i-- != 0; )
+	{
+		if (entries[i].valueId == 0)
+		{
+			RemoveEntry(i);
+		}
+	}
+
+	// Scan the newest sectors first, so that if garbage collection was interrupted the copies it made are used in preference
+	for (uint32_t below = 0xFFFFFFFF;;)
+	{
+		int newest = -1;
+		for (size_t s = 0; s < numSectors; ++s)
+		{
+			if (sectors[s].state == SectorState::inUse && sectors[s].sequence < below && (newest < 0 || sectors[s].sequence > sectors[newest].sequence))
+			{
+				newest = s;
+			}
+		}
+
+		if (newest < 0)
+		{
+			break;
+		}
+		if (!ScanSector(newest, false))
+		{
+			return InitResult::error;
+		}
+		below = sectors[newest].sequence;
+	}
+
+	// Check that the records of each value fit together, dropping any that don't
+	for (size_t i = numEntries; i-- != 0; )
+	{
+		Entry& e = entries[i];
+		bool ok = (e.numChunks != 0 && e.chunks[0].start == 0);
+		size_t keyLength = 0;
+		for (size_t c = 0; ok && c < e.numChunks; ++c)
+		{
+			RecordHeader hdr;
+			ok = esp_partition_read(partition, e.chunks[c].location, &hdr, sizeof(hdr)) == ESP_OK && hdr.length == ChunkLength(e, c);
+			keyLength = hdr.keyLength;
+		}
+
+		if (ok)
+		{
+			e.keyLocation = e.chunks[0].location;
+			liveBytes += ValueBytes(e, keyLength);
+		}
+		else
+		{
+			RemoveEntry(i);
+		}
+	}
+
+	// Carry on writing the newest sector, unless something was written after its last good record
+	headPos = sectors[head].validEnd;
+	for (uint32_t pos = headPos; pos < SectorSize; pos += BufferSize)
+	{
+		const size_t n = std::min<size_t>(SectorSize - pos, BufferSize);
+		if (esp_partition_read(partition, head * SectorSize + pos, buffer, n) != ESP_OK)
+		{
+			headPos = SectorSize;
+			break;
+		}
+
+		for (size_t j = 0; j < n; ++j)
+		{
+			if (buffer[j] != 0xFF)
+			{
+				headPos = SectorSize;
+				break;
+			}
+		}
+	}
+
+	return InitResult::ok;
+}
+
+// Erase the partition and start the first sector, so that the partition is recognised as a store from now on
+bool KvStore::Format()
+{
+	if (partition == nullptr)
+	{
+		return false;
+	}
+
+	Clear();
+	const bool ok = esp_partition_erase_range(partition, 0, numSectors * SectorSize) == ESP_OK;
+	for (size_t s = 0; s < numSectors; ++s)
+	{
+		sectors[s].state = (ok) ? SectorState::erased : SectorState::unknown;
+		sectors[s].validEnd = sizeof(SectorHeader);
+	}
+	freeSectors = numSectors;
+
+	return ok && OpenSector(true);
+}
+
+bool KvStore::Set(const char *key, const void *data, size_t length)
+{
+	const size_t keyLength = (key != nullptr) ? strlen(key) : 0;
+	if (partition == nullptr || keyLength == 0 || keyLength > MaxKeyLength || (data == nullptr && length != 0))
+	{
+		return false;
+	}
+
+	const uint32_t hash = HashKey(key, keyLength);
+	int i = FindEntry(key, keyLength, hash);
+	const size_t oldBytes = (i >= 0) ? ValueBytes(entries[i], keyLength) : 0;
+	const size_t needed = RecordSize(keyLength, length) + (length / (SectorSize - sizeof(SectorHeader))) * RecordSize(keyLength, 0);
+	if (needed > GetFree() + oldBytes)
+	{
+		return false;
+	}
+
+	// The new value only goes in the index once it is complete, but garbage collection must keep its records meanwhile
+	FreeChunks(pending);
+	pending.hash = hash;
+	pending.valueId = nextValueId++;
+	pending.size = 0;
+	pending.deleted = false;
+	bool ok = WriteValue(pending, key, keyLength, static_cast<const uint8_t*>(data), length);
+
+	if (ok)
+	{
+		if (i < 0)
+		{
+			i = AddEntry(hash, pending.chunks[0].location);
+			ok = (i >= 0);
+		}
+		else
+		{
+			liveBytes -= oldBytes;
+			FreeChunks(entries[i]);
+		}
+	}
+
+	if (ok)
+	{
+		Entry& e = entries[i];
+		e = pending;
+		e.keyLocation = e.chunks[0].location;
+		liveBytes += ValueBytes(e, keyLength);
+		pending.chunks = nullptr;
+		pending.numChunks = pending.maxChunks = 0;
+	}
+	else
+	{
+		FreeChunks(pending);
+	}
+	return ok;
+}
+
+bool KvStore::Append(const char *key, const void *data, size_t length)
+{
+	const size_t keyLength = (key != nullptr) ? strlen(key) : 0;
+	if (partition == nullptr || keyLength == 0 || keyLength > MaxKeyLength || data == nullptr)
+	{
+		return false;
+	}
+
+	const int i = FindEntry(key, keyLength, HashKey(key, keyLength));
+	if (i < 0 || entries[i].deleted)
+	{
+		return false;
+	}
+
+	Entry& e = entries[i];
+	if (e.size == 0)
+	{
+		// Replace the empty value, so that no two records of a value start at the same place
+		return Set(key, data, length);
+	}
+	if (length == 0)
+	{
+		return true;
+	}
+
+	const size_t needed = RecordSize(keyLength, length) + (length / (SectorSize - sizeof(SectorHeader))) * RecordSize(keyLength, 0);
+	if (needed > GetFree())
+	{
+		return false;
+	}
+
+	// The records written are only part of the value once the last of them is
+	const size_t oldBytes = ValueBytes(e, keyLength);
+	const uint16_t oldChunks = e.numChunks;
+	const uint32_t oldSize = e.size;
+	if (!WriteValue(e, key, keyLength, static_cast<const uint8_t*>(data), length))
+	{
+		e.numChunks = oldChunks;
+		e.size = oldSize;
+		return false;
+	}
+
+	liveBytes += ValueBytes(e, keyLength) - oldBytes;
+	return true;
+}
+
+bool KvStore::Get(const char *key, void *data, size_t length, size_t pos) const
+{
+	const size_t keyLength = (key != nullptr) ? strlen(key) : 0;
+	if (partition == nullptr || keyLength == 0 || keyLength > MaxKeyLength)
+	{
+		return false;
+	}
+
+	const int i = FindEntry(key, keyLength, HashKey(key, keyLength));
+	if (i < 0 || entries[i].deleted)
+	{
+		return false;
+	}
+
+	// With no buffer this only checks that the key exists
+	if (data == nullptr || length == 0)
+	{
+		return true;
+	}
+
+	const Entry& e = entries[i];
+	if (pos > e.size || length > e.size - pos)
+	{
+		return false;
+	}
+
+	uint8_t *out = static_cast<uint8_t*>(data);
+	for (size_t c = 0; c < e.numChunks && length != 0; ++c)
+	{
+		const size_t start = e.chunks[c].start;
+		const size_t end = start + ChunkLength(e, c);
+		if (pos < end)
+		{
+			const size_t n = std::min(length, end - pos);
+			if (esp_partition_read(partition, e.chunks[c].location + sizeof(RecordHeader) + keyLength + (pos - start), out, n) != ESP_OK)
+			{
+				return false;
+			}
+			out += n;
+			pos += n;
+			length -= n;
+		}
+	}
+	return length == 0;
+}
+
+size_t KvStore::GetSize(const char *key) const
+{
+	const size_t keyLength = (key != nullptr) ? strlen(key) : 0;
+	if (partition == nullptr || keyLength == 0 || keyLength > MaxKeyLength)
+	{
+		return 0;
+	}
+
+	const int i = FindEntry(key, keyLength, HashKey(key, keyLength));
+	return (i >= 0 && !entries[i].deleted) ? entries[i].size : 0;
+}
+
+// Delete a key by writing a deletion record. This stays in the index, so that it is kept until any older records of the key have been erased.
+bool KvStore::Delete(const char *key)
+{
+	const size_t keyLength = (key != nullptr) ? strlen(key) : 0;
+	if (partition == nullptr || keyLength == 0 || keyLength > MaxKeyLength)
+	{
+		return false;
+	}
+
+	const int i = FindEntry(key, keyLength, HashKey(key, keyLength));
+	size_t room;
+	if (i < 0 || entries[i].deleted || !MakeRoom(keyLength, 0, room))
+	{
+		return false;
+	}
+
+	const uint32_t valueId = nextValueId++;
+	const uint32_t location = WriteRecord(key, keyLength, RecordDeleted, FlagComplete, valueId, 0, nullptr, 0);
+	if (location == NoLocation)
+	{
+		return false;
+	}
+
+	Entry& e = entries[i];
+	liveBytes -= ValueBytes(e, keyLength);
+	FreeChunks(e);
+	e.valueId = valueId;
+	e.size = 0;
+	e.deleted = true;
+	e.keyLocation = location;
+	if (AddChunk(e, location, 0))
+	{
+		liveBytes += ValueBytes(e, keyLength);
+	}
+	else
+	{
+		RemoveEntry(i);
+	}
+	return true;
+}
+
+// Return how much more value data can be stored. The reserved sectors are kept back, and one more to allow for records
+// not filling sectors exactly.
+size_t KvStore::GetFree() const
+{
+	if (partition == nullptr)
+	{
+		return 0;
+	}
+
+	const size_t capacity = (numSectors - ReserveSectors - 1) * (SectorSize - sizeof(SectorHeader));
+	return (capacity > liveBytes) ? capacity - liveBytes : 0;
+}
+
+// CRC-32 as used by zlib, computed a nibble at a time to keep the table small
+/*static*/ uint32_t KvStore::Crc32(uint32_t crc, const void *data, size_t length)
+{
+	static const uint32_t table[16] =
+	{
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+
+	const uint8_t *p = static_cast<const uint8_t*>(data);
+	crc = ~crc;
+	while (length-- != 0)
+	{
+		crc ^= *p++;
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+		crc = (crc >> 4) ^ table[crc & 0x0F];
+	}
+	return ~crc;
+}
+
+// FNV-1a hash of a key
+/*static*/ uint32_t KvStore::HashKey(const char *key, size_t keyLength)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < keyLength; ++i)
+	{
+		hash = (hash ^ static_cast<uint8_t>(key[i])) * 16777619u;
+	}
+	return hash;
+}
+
+/*static*/ size_t KvStore::ValueBytes(const Entry& e, size_t keyLength)
+{
+	size_t total = 0;
+	for (size_t c = 0; c < e.numChunks; ++c)
+	{
+		total += RecordSize(keyLength, ChunkLength(e, c));
+	}
+	return total;
+}
+
+// Add a record to the chunks of a value, keeping them in order. A record that duplicates one already there,
+// as happens if garbage collection was interrupted, is ignored.
+/*static*/ bool KvStore::AddChunk(Entry& e, uint32_t location, uint32_t start)
+{
+	size_t c = e.numChunks;
+	while (c != 0 && e.chunks[c - 1].start >= start)
+	{
+		if (e.chunks[c - 1].start == start)
+		{
+			return true;
+		}
+		--c;
+	}
+
+	if (e.numChunks == e.maxChunks)
+	{
+		const size_t newMax = (e.maxChunks == 0) ? 1 : 2 * e.maxChunks;
+		Chunk * const newChunks = new (std::nothrow) Chunk[newMax];
+		if (newChunks == nullptr)
+		{
+			return false;
+		}
+		if (e.numChunks != 0)
+		{
+			memcpy(newChunks, e.chunks, e.numChunks * sizeof(Chunk));
+		}
+		delete[] e.chunks;
+		e.chunks = newChunks;
+		e.maxChunks = newMax;
+	}
+
+	memmove(e.chunks + c + 1, e.chunks + c, (e.numChunks - c) * sizeof(Chunk));
+	e.chunks[c].location = location;
+	e.chunks[c].start = start;
+	++e.numChunks;
+	return true;
+}
+
+/*static*/ void KvStore::FreeChunks(Entry& e)
+{
+	delete[] e.chunks;
+	e.chunks = nullptr;
+	e.numChunks = e.maxChunks = 0;
+}
+
+void KvStore::Clear()
+{
+	for (size_t i = 0; i < numEntries; ++i)
+	{
+		FreeChunks(entries[i]);
+	}
+	numEntries = 0;
+	FreeChunks(pending);
+
+	freeSectors = 0;
+	head = -1;
+	headPos = 0;
+	nextSequence = 1;
+	nextValueId = 1;
+	liveBytes = 0;
+}
+
+int KvStore::FindEntry(const char *key, size_t keyLength, uint32_t hash) const
+{
+	for (size_t i = 0; i < numEntries; ++i)
+	{
+		if (entries[i].hash == hash)
+		{
+			// Hashes can collide, so check the key held in flash
+			uint8_t record[sizeof(RecordHeader) + MaxKeyLength];
+			const RecordHeader *hdr = reinterpret_cast<const RecordHeader*>(record);
+			const uint32_t location = entries[i].keyLocation;
+			if (   location + sizeof(RecordHeader) + keyLength <= partition->size
+				&& esp_partition_read(partition, location, record, sizeof(RecordHeader) + keyLength) == ESP_OK
+				&& hdr->keyLength == keyLength && memcmp(record + sizeof(RecordHeader), key, keyLength) == 0
+			   )
+			{
+				return i;
+			}
+		}
+	}
+	return -1;
+}
+
+int KvStore::AddEntry(uint32_t hash, uint32_t keyLocation)
+{
+	if (numEntries == maxEntries)
+	{
+		Entry * const newEntries = new (std::nothrow) Entry[maxEntries + 16];
+		if (newEntries == nullptr)
+		{
+			return -1;
+		}
+		if (numEntries != 0)
+		{
+			memcpy(newEntries, entries, numEntries * sizeof(Entry));
+		}
+		delete[] entries;
+		entries = newEntries;
+		maxEntries += 16;
+	}
+
+	Entry& e = entries[numEntries];
+	memset(&e, 0, sizeof(e));
+	e.hash = hash;
+	e.keyLocation = keyLocation;
+	return numEntries++;
+}
+
+void KvStore::RemoveEntry(size_t index)
+{
+	FreeChunks(entries[index]);
+	entries[index] = entries[--numEntries];
+}
+
+// Scan the records of a sector. The first pass checks them and finds the latest complete value of each key,
+// the second adds the records of those values to the index. Returns false if we ran out of memory.
+bool KvStore::ScanSector(size_t sector, bool firstPass)
+{
+	const uint32_t base = sector * SectorSize;
+	const uint32_t end = (firstPass) ? SectorSize : sectors[sector].validEnd;
+	uint32_t pos = sizeof(SectorHeader);
+	bool ok = true;
+	while (ok && pos + sizeof(RecordHeader) <= end)
+	{
+		RecordHeader hdr;
+		char key[MaxKeyLength];
+		if (esp_partition_read(partition, base + pos, &hdr, sizeof(hdr)) != ESP_OK || (hdr.crc == 0xFFFFFFFF && hdr.type == 0xFF))
+		{
+			break;
+		}
+
+		const size_t size = RecordSize(hdr.keyLength, hdr.length);
+		if (   hdr.keyLength == 0 || hdr.keyLength > MaxKeyLength || hdr.length > SectorSize || pos + size > SectorSize
+			|| esp_partition_read(partition, base + pos + sizeof(hdr), key, hdr.keyLength) != ESP_OK
+		   )
+		{
+			break;
+		}
+
+		const uint32_t hash = HashKey(key, hdr.keyLength);
+		int i = FindEntry(key, hdr.keyLength, hash);
+		if (firstPass)
+		{
+			if (!CheckRecord(base + pos, hdr, key))
+			{
+				break;
+			}
+
+			if (hdr.valueId >= nextValueId)
+			{
+				nextValueId = hdr.valueId + 1;
+			}
+
+			if (i < 0)
+			{
+				i = AddEntry(hash, base + pos);
+				ok = (i >= 0);
+			}
+
+			if (ok && (hdr.flags & FlagComplete))
+			{
+				Entry& e = entries[i];
+				const uint32_t valueEnd = hdr.offset + hdr.length;
+				if (hdr.valueId > e.valueId)
+				{
+					e.valueId = hdr.valueId;
+					e.size = valueEnd;
+					e.deleted = (hdr.type == RecordDeleted);
+					e.keyLocation = base + pos;
+				}
+				else if (hdr.valueId == e.valueId && valueEnd > e.size)
+				{
+					e.size = valueEnd;
+				}
+			}
+		}
+		else if (i >= 0 && entries[i].valueId == hdr.valueId)
+		{
+			// Records past the end of the value belong to an append that was never completed
+			Entry& e = entries[i];
+			if (e.deleted || hdr.offset < e.size || (hdr.offset == 0 && e.size == 0))
+			{
+				ok = AddChunk(e, base + pos, hdr.offset);
+			}
+		}
+		pos += size;
+	}
+
+	if (firstPass)
+	{
+		sectors[sector].validEnd = pos;
+	}
+	return ok;
+}
+
+bool KvStore::CheckRecord(uint32_t location, const RecordHeader& hdr, const char *key)
+{
+	uint32_t crc = Crc32(0, &hdr.type, sizeof(hdr) - sizeof(hdr.crc));
+	crc = Crc32(crc, key, hdr.keyLength);
+	const uint32_t dataStart = location + sizeof(hdr) + hdr.keyLength;
+	for (size_t done = 0; done < hdr.length; )
+	{
+		const size_t n = std::min<size_t>(hdr.length - done, BufferSize);
+		if (esp_partition_read(partition, dataStart + done, buffer, n) != ESP_OK)
+		{
+			return false;
+		}
+		crc = Crc32(crc, buffer, n);
+		done += n;
+	}
+	return crc == hdr.crc;
+}
+
+// Start writing a new sector. Unless this is for garbage collection, the reserved sectors are left free.
+bool KvStore::OpenSector(bool forGc)
+{
+	if (!forGc && freeSectors <= ReserveSectors && !CollectGarbage())
+	{
+		return false;
+	}
+	if (freeSectors == 0)
+	{
+		return false;
+	}
+
+	// Use the next free sector after the head, so that writes move around the partition
+	size_t s = (head < 0) ? 0 : head + 1;
+	for (;; ++s)
+	{
+		if (s == numSectors)
+		{
+			s = 0;
+		}
+		if (sectors[s].state != SectorState::inUse)
+		{
+			break;
+		}
+	}
+
+	if (sectors[s].state == SectorState::unknown && !EraseSector(s))
+	{
+		return false;
+	}
+
+	// The magic is written last, so that a sector whose header was only partly written isn't taken as being in use
+	const SectorHeader hdr = { SectorMagic, nextSequence };
+	if (   esp_partition_write(partition, s * SectorSize + offsetof(SectorHeader, sequence), &hdr.sequence, sizeof(hdr.sequence)) != ESP_OK
+		|| esp_partition_write(partition, s * SectorSize + offsetof(SectorHeader, magic), &hdr.magic, sizeof(hdr.magic)) != ESP_OK
+	   )
+	{
+		sectors[s].state = SectorState::unknown;
+		return false;
+	}
+
+	sectors[s].sequence = nextSequence++;
+	sectors[s].validEnd = sizeof(SectorHeader);
+	sectors[s].state = SectorState::inUse;
+	--freeSectors;
+	head = s;
+	headPos = sizeof(SectorHeader);
+	return true;
+}
+
+// Make sure there is room for a record at the head and return how much data it can hold. A record only goes
+// at the end of the current sector if all the data will fit, or at least MinRecordData of it.
+bool KvStore::MakeRoom(size_t keyLength, size_t wanted, size_t& room)
+{
+	const size_t overhead = sizeof(RecordHeader) + keyLength;
+	if (head >= 0 && SectorSize - headPos >= overhead)
+	{
+		room = SectorSize - headPos - overhead;
+		if (room >= wanted || room >= MinRecordData)
+		{
+			return true;
+		}
+	}
+
+	if (!OpenSector(false))
+	{
+		return false;
+	}
+	room = SectorSize - headPos - overhead;
+	return true;
+}
+
+// Reclaim sectors until there are free sectors to spare as well as the one about to be used. Sectors that the index
+// doesn't refer to are reclaimed first because nothing needs to be copied, then the oldest sectors.
+// Copying the live records of a sector never takes more than one free sector.
+bool KvStore::CollectGarbage()
+{
+	for (size_t attempts = 0; freeSectors <= ReserveSectors && attempts < numSectors; ++attempts)
+	{
+		int victim = -1;
+		for (size_t s = 0; s < numSectors; ++s)
+		{
+			if (sectors[s].state == SectorState::inUse && (int)s != head && !IsReferenced(s))
+			{
+				victim = s;
+				break;
+			}
+		}
+
+		if (victim < 0)
+		{
+			for (size_t s = 0; s < numSectors; ++s)
+			{
+				if (sectors[s].state == SectorState::inUse && (victim < 0 || sectors[s].sequence < sectors[victim].sequence))
+				{
+					victim = s;
+				}
+			}
+
+			if (victim < 0 || victim == head || !Relocate(victim))
+			{
+				return false;
+			}
+		}
+
+		sectors[victim].state = SectorState::unknown;
+		++freeSectors;
+		if (!EraseSector(victim))
+		{
+			return false;
+		}
+	}
+	return freeSectors > ReserveSectors;
+}
+
+// Copy the records of a sector that are still in use to the head of the log
+bool KvStore::Relocate(size_t sector)
+{
+	const uint32_t base = sector * SectorSize;
+	for (uint32_t pos = sizeof(SectorHeader); pos + sizeof(RecordHeader) <= sectors[sector].validEnd; )
+	{
+		RecordHeader hdr;
+		if (esp_partition_read(partition, base + pos, &hdr, sizeof(hdr)) != ESP_OK)
+		{
+			return false;
+		}
+
+		const size_t size = RecordSize(hdr.keyLength, hdr.length);
+		Entry *owner;
+		Chunk * const chunk = FindChunk(base + pos, owner);
+		if (chunk != nullptr)
+		{
+			if (SectorSize - headPos < size && !OpenSector(true))
+			{
+				return false;
+			}
+
+			const uint32_t to = head * SectorSize + headPos;
+			for (size_t done = 0; done < size; )
+			{
+				const size_t n = std::min<size_t>(size - done, BufferSize);
+				if (   esp_partition_read(partition, base + pos + done, buffer, n) != ESP_OK
+					|| esp_partition_write(partition, to + done, buffer, n) != ESP_OK
+				   )
+				{
+					headPos = SectorSize;
+					return false;
+				}
+				done += n;
+			}
+
+			headPos += size;
+			sectors[head].validEnd = headPos;
+			chunk->location = to;
+			owner->keyLocation = owner->chunks[0].location;
+		}
+		pos += size;
+	}
+	return true;
+}
+
+// Return true if the index refers to any record in the sector
+bool KvStore::IsReferenced(size_t sector) const
+{
+	for (size_t i = 0; i <= numEntries; ++i)
+	{
+		const Entry& e = (i < numEntries) ? entries[i] : pending;
+		for (size_t c = 0; c < e.numChunks; ++c)
+		{
+			if (e.chunks[c].location / SectorSize == sector)
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+KvStore::Chunk *KvStore::FindChunk(uint32_t location, Entry *&owner)
+{
+	for (size_t i = 0; i <= numEntries; ++i)
+	{
+		Entry& e = (i < numEntries) ? entries[i] : pending;
+		for (size_t c = 0; c < e.numChunks; ++c)
+		{
+			if (e.chunks[c].location == location)
+			{
+				owner = &e;
+				return &e.chunks[c];
+			}
+		}
+	}
+	return nullptr;
+}
+
+// Write a record at the head, which must have room for it. Returns its location, or NoLocation if writing failed.
+uint32_t KvStore::WriteRecord(const char *key, size_t keyLength, uint8_t type, uint8_t flags, uint32_t valueId, uint32_t offset, const uint8_t *data, size_t length)
+{
+	RecordHeader hdr;
+	hdr.type = type;
+	hdr.flags = flags;
+	hdr.keyLength = keyLength;
+	hdr.dummy = 0;
+	hdr.valueId = valueId;
+	hdr.offset = offset;
+	hdr.length = length;
+	hdr.crc = Crc32(Crc32(Crc32(0, &hdr.type, sizeof(hdr) - sizeof(hdr.crc)), key, keyLength), data, length);
+
+	// Pass the header, key and data through the buffer, so that flash is written in whole words
+	const uint32_t location = head * SectorSize + headPos;
+	const uint8_t * const parts[3] = { reinterpret_cast<const uint8_t*>(&hdr), reinterpret_cast<const uint8_t*>(key), data };
+	const size_t lengths[3] = { sizeof(hdr), keyLength, length };
+	uint32_t writePos = location;
+	size_t buffered = 0;
+	bool ok = true;
+	for (size_t part = 0; ok && part < 3; ++part)
+	{
+		for (size_t done = 0; ok && done < lengths[part]; )
+		{
+			const size_t n = std::min(lengths[part] - done, BufferSize - buffered);
+			memcpy(buffer + buffered, parts[part] + done, n);
+			buffered += n;
+			done += n;
+			if (buffered == BufferSize)
+			{
+				ok = esp_partition_write(partition, writePos, buffer, BufferSize) == ESP_OK;
+				writePos += BufferSize;
+				buffered = 0;
+			}
+		}
+	}
+
+	if (ok && buffered != 0)
+	{
+		while ((buffered & 3) != 0)
+		{
+			buffer[buffered++] = 0xFF;
+		}
+		ok = esp_partition_write(partition, writePos, buffer, buffered) == ESP_OK;
+	}
+
+	if (!ok)
+	{
+		// We don't know what got written, so don't write anything more in this sector
+		headPos = SectorSize;
+		return NoLocation;
+	}
+
+	headPos += RecordSize(keyLength, length);
+	sectors[head].validEnd = headPos;
+	return location;
+}
+
+// Write data at the end of a value, in as many records as it takes. Only the last record completes the value.
+bool KvStore::WriteValue(Entry& e, const char *key, size_t keyLength, const uint8_t *data, size_t length)
+{
+	size_t done = 0;
+	do
+	{
+		size_t room;
+		if (!MakeRoom(keyLength, length - done, room))
+		{
+			return false;
+		}
+
+		const size_t n = std::min(room, length - done);
+		const bool last = (done + n == length);
+		const uint32_t location = WriteRecord(key, keyLength, RecordData, (last) ? FlagComplete : 0, e.valueId, e.size, data + done, n);
+		if (location == NoLocation || !AddChunk(e, location, e.size))
+		{
+			return false;
+		}
+		e.size += n;
+		done += n;
+	} while (done < length);
+	return true;
+}
+
+bool KvStore::EraseSector(size_t sector)
+{
+	if (esp_partition_erase_range(partition, sector * SectorSize, SectorSize) != ESP_OK)
+	{
+		return false;
+	}
+	sectors[sector].state = SectorState::erased;
+	sectors[sector].validEnd = sizeof(SectorHeader);
+	return true;
+}
+
+// End
@@ -0,0 +1,146 @@
+/*
+ * KvStore.h
+ *
+ * Key-value store kept as a log of CRC-protected records in a raw flash partition,
+ * with an index in RAM of where the records of each value are.
+ */
+
+#ifndef SRC_KVSTORE_H_
+#define SRC_KVSTORE_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "esp_partition.h"
+
+class KvStore
+{
+public:
+	static constexpr size_t MaxKeyLength = 31;
+
+	enum class InitResult : uint8_t
+	{
+		ok = 0,
+		notAStore,				// the partition doesn't hold a store, so it must be formatted before use
+		error					// the partition couldn't be read or there wasn't enough memory for the index
+	};
+
+	KvStore();
+	~KvStore();
+
+	InitResult Init(const esp_partition_t *part);
+	bool Format();
+
+	bool Set(const char *key, const void *data, size_t length);
+	bool Append(const char *key, const void *data, size_t length);
+	bool Get(const char *key, void *data, size_t length, size_t pos = 0) const;
+	size_t GetSize(const char *key) const;
+	bool Delete(const char *key);
+	size_t GetFree() const;
+
+	static uint32_t Crc32(uint32_t crc, const void *data, size_t length);
+
+private:
+	static constexpr uint32_t SectorMagic = 0x3153564B;		// "KVS1"
+	static constexpr uint8_t RecordData = 0x44;
+	static constexpr uint8_t RecordDeleted = 0x58;
+	static constexpr uint8_t FlagComplete = 0x01;			// the value ends with this record
+	static constexpr uint32_t NoLocation = 0xFFFFFFFF;
+	static constexpr size_t MinRecordData = 64;				// don't start a record at the end of a sector with less room than this
+	static constexpr size_t BufferSize = 256;
+	static constexpr size_t ReserveSectors = 2;				// free sectors kept for garbage collection, so that it can be completed after a power failure
+
+	enum class SectorState : uint8_t
+	{
+		unknown = 0,			// must be erased before use
+		erased,
+		inUse
+	};
+
+	struct SectorHeader
+	{
+		uint32_t magic;
+		uint32_t sequence;		// order in which the sectors were started
+	};
+
+	struct RecordHeader
+	{
+		uint32_t crc;			// of the rest of the header, the key and the data
+		uint8_t type;
+		uint8_t flags;
+		uint8_t keyLength;
+		uint8_t dummy;
+		uint32_t valueId;		// identifies the value, which may be spread over several records
+		uint32_t offset;		// where the data goes in the value
+		uint32_t length;		// of the data
+	};
+
+	struct Sector
+	{
+		uint32_t sequence;
+		uint16_t validEnd;		// end of the records that passed their CRC check
+		SectorState state;
+	};
+
+	struct Chunk
+	{
+		uint32_t location;		// of the record in the partition
+		uint32_t start;			// offset in the value of its data
+	};
+
+	struct Entry
+	{
+		uint32_t hash;
+		uint32_t keyLocation;	// a record that holds the key
+		uint32_t valueId;
+		uint32_t size;
+		bool deleted;			// if true the only chunk is the deletion record
+		uint16_t numChunks;
+		uint16_t maxChunks;
+		Chunk *chunks;			// in order of their start
+	};
+
+	static uint32_t HashKey(const char *key, size_t keyLength);
+	static size_t RecordSize(size_t keyLength, size_t dataLength) { return (sizeof(RecordHeader) + keyLength + dataLength + 3) & ~3; }
+	static size_t ChunkLength(const Entry& e, size_t i) { return ((i + 1 < e.numChunks) ? e.chunks[i + 1].start : e.size) - e.chunks[i].start; }
+	static size_t ValueBytes(const Entry& e, size_t keyLength);
+	static bool AddChunk(Entry& e, uint32_t location, uint32_t start);
+	static void FreeChunks(Entry& e);
+
+	void Clear();
+	int FindEntry(const char *key, size_t keyLength, uint32_t hash) const;
+	int AddEntry(uint32_t hash, uint32_t keyLocation);
+	void RemoveEntry(size_t index);
+
+	bool ScanSector(size_t sector, bool firstPass);
+	bool CheckRecord(uint32_t location, const RecordHeader& hdr, const char *key);
+
+	bool OpenSector(bool forGc);
+	bool MakeRoom(size_t keyLength, size_t wanted, size_t& room);
+	bool CollectGarbage();
+	bool Relocate(size_t sector);
+	bool IsReferenced(size_t sector) const;
+	Chunk *FindChunk(uint32_t location, Entry *&owner);
+	uint32_t WriteRecord(const char *key, size_t keyLength, uint8_t type, uint8_t flags, uint32_t valueId, uint32_t offset, const uint8_t *data, size_t length);
+	bool WriteValue(Entry& e, const char *key, size_t keyLength, const uint8_t *data, size_t length);
+	bool EraseSector(size_t sector);
+
+	const esp_partition_t *partition;
+	Sector *sectors;
+	size_t numSectors;
+	size_t freeSectors;						// erased or unknown sectors
+	int head;								// the sector being written, or -1
+	uint32_t headPos;						// where the next record goes in it
+	uint32_t nextSequence;
+	uint32_t nextValueId;
+	size_t liveBytes;						// space taken by the records that the index refers to
+
+	Entry *entries;
+	size_t numEntries;
+	size_t maxEntries;
+	Entry pending;							// value being written by Set, which isn't in the index until it is complete
+
+	uint8_t buffer[BufferSize];
+};
+
+#endif /* SRC_KVSTORE_H_ */
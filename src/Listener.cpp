@@ -5,7 +5,6 @@
  *      Author: David
  */
 #include <cstring>
-#include <new>
 
 #include "lwip/tcp.h"
 
@@ -13,25 +12,35 @@
 #include "Config.h"
 
 // Static member data
-Listener *Listener::activeList = nullptr;
-Listener *Listener::freeList = nullptr;
+Listener Listener::pool[MaxListeners];
+uint8_t Listener::portTable[PortTableSize];
 
-/*static*/ bool Listener::Start(uint16_t port, uint32_t ip, int protocol, int maxConns, struct netconn * conn)
+// Start a listener. If 'conn' is already used by another listener then the new one shares it, otherwise we start listening on it.
+/*static*/ bool Listener::Start(uint16_t port, const ip_addr_t& ip, int protocol, int maxConns, uint8_t flags, ListenInterface iface, struct netconn * conn)
 {
-	Listener *res = freeList;
+	Listener *res = nullptr;
+	for (Listener& l : pool)
+	{
+		if (l.conn == nullptr)
+		{
+			res = &l;
+			break;
+		}
+	}
+	const bool shared = (FindSharing(conn, nullptr) != nullptr);
 
 	if (res == nullptr)
 	{
-		res = new (std::nothrow) Listener;
-
-		if (res)
+		if (!shared)
 		{
-			res->next = freeList;
-			freeList = res;
+			netconn_close(conn);
+			netconn_delete(conn);
 		}
+		debugPrintAlways("can't allocate listener\n");
+		return false;
 	}
 
-	if (res)
+	if (!shared)
 	{
 		// Since the member 'socket' is not used, use it to store
 		// reference to the owning Listener of the netconn. Do this before
@@ -48,41 +57,132 @@ Listener *Listener::freeList = nullptr;
 			debugPrintfAlways("Listen failed: %d\n", rc);
 			return false;
 		}
+	}
 
-		res->ip = ip;
-		res->port = port;
-		res->protocol = protocol;
-		res->maxConnections = maxConns;
-		res->conn = conn;
+	ip_addr_copy(res->ip, ip);
+	res->port = port;
+	res->protocol = protocol;
+	res->maxConnections = maxConns;
+	res->flags = flags;
+	res->iface = iface;
+	res->accepted = res->refused = res->backlogOverflows = 0;
+	res->conn = conn;
+
+	const size_t bucket = Hash(port);
+	res->nextInBucket = portTable[bucket];
+	portTable[bucket] = (res - pool) + 1;
+	return true;
+}
+
+// Return the first listener on the specified port, or nullptr if there is none. Use GetNextOnPort to find any others.
+/*static*/ Listener *Listener::FindByPort(uint16_t port)
+{
+	return FindInChain(portTable[Hash(port)], port);
+}
 
-		freeList = res->next;
-		res->next = activeList;
-		activeList = res;
+/*static*/ Listener *Listener::FindInChain(uint8_t index, uint16_t port)
+{
+	while (index != 0)
+	{
+		Listener * const l = &pool[index - 1];
+		if (l->port == port)
+		{
+			return l;
+		}
+		index = l->nextInBucket;
 	}
-	else
+	return nullptr;
+}
+
+// Return a listener other than 'except' that uses the netconn, or nullptr if there is none
+/*static*/ Listener *Listener::FindSharing(const struct netconn *conn, const Listener *except)
+{
+	for (Listener& l : pool)
 	{
-		debugPrintAlways("can't allocate listener\n");
-		return false;
+		if (l.conn == conn && &l != except)
+		{
+			return &l;
+		}
 	}
+	return nullptr;
+}
 
-	return true;
+/*static*/ Listener *Listener::FindByProtocol(uint8_t protocol)
+{
+	for (Listener& l : pool)
+	{
+		if (l.conn != nullptr && l.protocol == protocol)
+		{
+			return &l;
+		}
+	}
+	return nullptr;
+}
+
+/*static*/ void Listener::StopAll()
+{
+	for (Listener& l : pool)
+	{
+		if (l.conn != nullptr)
+		{
+			l.Stop();
+		}
+	}
+}
+
+// Stop the listeners bound to an interface that is going away
+/*static*/ void Listener::StopInterface(ListenInterface iface)
+{
+	for (Listener& l : pool)
+	{
+		if (l.conn != nullptr && l.iface == iface)
+		{
+			l.Stop();
+		}
+	}
 }
 
-/*static*/ void Listener::Stop()
+// Stop this listener, closing the netconn unless another listener shares it
+void Listener::Stop()
 {
-	netconn_close(conn);
-	netconn_delete(conn);
+	Listener * const other = FindSharing(conn, this);
+	if (other == nullptr)
+	{
+		netconn_close(conn);
+		netconn_delete(conn);
+	}
+	else if (conn->socket == reinterpret_cast<int>(this))
+	{
+		conn->socket = reinterpret_cast<int>(other);
+	}
 
-	Listener **pp = &activeList;
-	while (*pp != nullptr)
+	const uint8_t self = (this - pool) + 1;
+	uint8_t *pp = &portTable[Hash(port)];
+	while (*pp != 0)
 	{
-		if (*pp == this)
+		if (*pp == self)
 		{
-			*pp = next;
-			next = freeList;
-			freeList = this;
-			return;
+			*pp = nextInBucket;
+			break;
 		}
+		pp = &pool[*pp - 1].nextInBucket;
 	}
+	conn = nullptr;
 }
+
+/*static*/ void Listener::Report()
+{
+	ets_printf("Listeners");
+	bool any = false;
+	for (Listener& l : pool)
+	{
+		if (l.conn != nullptr)
+		{
+			ets_printf("%c port %u: %u accepted, %u refused, %u over limit", (any) ? ',' : ':', l.port, l.accepted, l.refused, l.backlogOverflows);
+			any = true;
+		}
+	}
+	ets_printf((any) ? "\n" : ": none\n");
+}
+
 // End
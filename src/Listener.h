@@ -13,32 +13,58 @@
 
 #include "lwip/api.h"
 
+#include "include/MessageFormats.h"			// for ListenInterface
+
 class Listener
 {
 public:
-	static bool Start(uint16_t port, uint32_t ip, int protocol, int maxConns, struct netconn* conn);
-	static Listener* List() { return activeList; }
+	static constexpr size_t MaxListeners = 8;
+
+	static bool Start(uint16_t port, const ip_addr_t& ip, int protocol, int maxConns, uint8_t flags, ListenInterface iface, struct netconn* conn);
+	static Listener* FindByPort(uint16_t port);
+	static Listener* FindSharing(const struct netconn *conn, const Listener *except);
+	static Listener* FindByProtocol(uint8_t protocol);
+	static void StopAll();
+	static void StopInterface(ListenInterface iface);
+	static void Report();
 
-	uint32_t GetIp() { return ip; }
+	const ip_addr_t& GetIp() { return ip; }
 	uint16_t GetPort() { return port; }
 	uint8_t GetProtocol() { return protocol; }
 	uint16_t GetMaxConnections() { return maxConnections; }
-	Listener* GetNext() { return next; }
+	uint8_t GetFlags() { return flags; }
+	ListenInterface GetInterface() { return iface; }
+	Listener* GetNextOnPort() { return FindInChain(nextInBucket, port); }
 	struct netconn* GetConnection() { return conn; }
 
+	void CountAccepted() { ++accepted; }
+	void CountRefused() { ++refused; }
+	void CountBacklogOverflow() { ++backlogOverflows; }
+
 	void Stop();
 
 private:
-	Listener *next;
-	struct netconn *conn;
+	static constexpr size_t PortTableSize = 16;		// must be a power of 2
 
-	uint32_t ip;
+	static size_t Hash(uint16_t port) { return (port ^ (port >> 4)) & (PortTableSize - 1); }
+	static Listener* FindInChain(uint8_t index, uint16_t port);
+
+	struct netconn *conn;		// null if this entry in the pool is free. Listeners on the 'any' address of a port share one.
+
+	ip_addr_t ip;
 	uint16_t port;
 	uint16_t maxConnections;
 	uint8_t protocol;
+	uint8_t flags;				// flags from the networkListen command
+	ListenInterface iface;		// the interface that connections must arrive on to be accepted by this listener
+	uint8_t nextInBucket;		// 1 + index of the next listener in the same port table bucket, or 0 if this is the last
+
+	uint32_t accepted;			// connections accepted since we started listening
+	uint32_t refused;			// connections refused because no connection or TLS session was free
+	uint32_t backlogOverflows;	// connections refused because the listener already had its maximum number of connections
 
-	static Listener *activeList;
-	static Listener *freeList;
+	static Listener pool[MaxListeners];
+	static uint8_t portTable[PortTableSize];		// 1 + index of the first listener in each bucket, or 0 if there is none
 };
 
 #endif /* SRC_LISTENER_H_ */
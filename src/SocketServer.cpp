@@ -22,6 +22,7 @@ extern "C"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
 #include "esp_netif.h"
 #include "esp_wifi.h"
 #if SUPPORT_ETHERNET
@@ -33,6 +34,7 @@ extern "C"
 #include "esp_log.h"
 #include "esp_intr_alloc.h"
 #include "esp_partition.h"
+#include "esp_timer.h"
 #include "mdns.h"
 #include "nvs_flash.h"
 #include "nvs.h"
@@ -51,6 +53,9 @@ extern "C"
 
 #include "include/MessageFormats.h"
 #include "Connection.h"
+#include "TlsSession.h"
+#include "AssetCache.h"
+#include "GzipEncoder.h"
 #include "Misc.h"
 #include "Config.h"
 
@@ -68,6 +73,9 @@ extern esp_rom_spiflash_chip_t g_rom_flashchip;
 #endif
 
 #include "esp_wpa2.h"
+#if !defined(ESP8266) && CONFIG_WPA_11KV_SUPPORT
+#include "esp_rrm.h"
+#endif
 
 
 static_assert(CONN_POLL_PRIO == MAIN_PRIO);
@@ -85,10 +93,14 @@ static const int MaxAPConnections = 4;
 
 static uint32_t numWifiReconnects = 0;
 static bool usingDhcpc = false;
+static bool readAhead = false;					// true if otherwise empty responses may carry received socket data
+static bool serviceAccessPoint = false;			// true if our access point is running alongside the station connection
 
 // Global data
 static tcpip_adapter_ip_info_t staIpInfo;
 static volatile int currentSsid = -1;
+static volatile bool pinnedAccessPoint = false;		// true if the station is set to connect only to the access point it last used
+static volatile bool roaming = false;				// true while the station leaves its access point to move to a stronger one
 
 #if ESP8266
 static_assert(HostNameLength <= CONFIG_TCPIP_ADAPTER_HOSTNAME_MAX_LENGTH);
@@ -173,12 +185,56 @@ static volatile wifi_scan_state_t scanState = WIFI_SCAN_IDLE;
 static wifi_ap_record_t *wifiScanAPs = nullptr;
 static uint16_t wifiScanNum = 0;
 
+// The scan done event of a background scan can arrive after the scan has returned, so the event handler counts them off
+// instead of taking them for the end of a scan that the SAM asked for. Each count is only written by one task.
+static volatile uint32_t backgroundScansStarted = 0;
+static volatile uint32_t backgroundScansDone = 0;
+
+// Points during startup whose times are reported with the diagnostics
+enum class BootPhase : uint8_t
+{
+	wifiInit = 0,
+	storageInit,
+	spiInit,
+	ready,							// EspReqTransferPin set high
+	storageCheck,					// deferred storage checks done
+	count
+};
+
+static const char * const bootPhaseNames[] = { "wifi", "storage", "spi", "ready", "check" };
+static_assert(ARRAY_SIZE(bootPhaseNames) == (size_t)BootPhase::count);
+static uint32_t bootTimes[(size_t)BootPhase::count] = { 0 };		// microseconds since startup, or 0 if not reached yet
+
+static void RecordBootPhase(BootPhase phase)
+{
+	bootTimes[(size_t)phase] = (uint32_t)esp_timer_get_time();
+}
+
+static void ReportBootTimes()
+{
+	ets_printf("Boot:");
+	for (size_t i = 0; i < (size_t)BootPhase::count; ++i)
+	{
+		if (bootTimes[i] != 0)
+		{
+			ets_printf(" %s %u.%03ums", bootPhaseNames[i], bootTimes[i] / 1000, bootTimes[i] % 1000);
+		}
+	}
+	ets_printf("\n");
+}
+
 // Reset to default settings
 void FactoryReset()
 {
 	wirelessConfigMgr->Reset(true);
 }
 
+// Convert the interface field of a listen request. Unknown values mean any interface.
+static ListenInterface ToListenInterface(uint8_t iface)
+{
+	return (iface == (uint8_t)ListenInterface::station || iface == (uint8_t)ListenInterface::accessPoint) ? (ListenInterface)iface : ListenInterface::any;
+}
+
 // Check socket number in range, returning true if yes. Otherwise, set lastError and return false;
 bool ValidSocketNumber(uint8_t num)
 {
@@ -199,6 +255,7 @@ static void HandleWiFiEvent(void* arg, esp_event_base_t event_base,
 								int32_t event_id, void* event_data)
 {
 	wifi_evt_t wifiEvt = WIFI_IDLE;
+	wifi_mode_t mode;
 
 	debugPrintf("wifi evt: %s id: %d\n", event_base, event_id);
 
@@ -211,6 +268,9 @@ static void HandleWiFiEvent(void* arg, esp_event_base_t event_base,
 			tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_STA);
 			tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_STA, &staIpInfo);
 		}
+#if CONFIG_LWIP_IPV6_AUTOCONFIG
+		tcpip_adapter_create_ip6_linklocal(TCPIP_ADAPTER_IF_STA);	// global addresses are then configured from router advertisements
+#endif
 		// Disable the first connect workaround.
 		if (firstConnectWorkaroundStage != 3) // Not previously disabled.
 		{
@@ -221,6 +281,13 @@ static void HandleWiFiEvent(void* arg, esp_event_base_t event_base,
 	} else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
 		wifi_event_sta_disconnected_t* disconnected = (wifi_event_sta_disconnected_t*) event_data;
 		debugPrintf("disconnect reason: %d\n", disconnected->reason);
+		if (roaming && disconnected->reason == WIFI_REASON_ASSOC_LEAVE)
+		{
+			// RoamMonitor left the access point to move to a stronger one, and has already set the station up to connect to it
+			roaming = false;
+			esp_wifi_connect();
+			return;
+		}
 		switch (disconnected->reason) {
 			// include authentication failures in general
 			case WIFI_REASON_AUTH_EXPIRE:
@@ -317,6 +384,9 @@ static void HandleWiFiEvent(void* arg, esp_event_base_t event_base,
 			break;
 		}
 
+	} else if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_AP_START || event_id == WIFI_EVENT_AP_STOP)
+				&& esp_wifi_get_mode(&mode) == ESP_OK && mode != WIFI_MODE_AP) {
+		return;		// a service access point started or stopped, which doesn't change the station state
 	} else if (event_base == WIFI_EVENT && (event_id == WIFI_EVENT_STA_STOP || event_id == WIFI_EVENT_AP_STOP)) {
 		wifiEvt = WIFI_IDLE;
 	} else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
@@ -324,8 +394,10 @@ static void HandleWiFiEvent(void* arg, esp_event_base_t event_base,
 	} else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_AP_START) {
 		wifiEvt = AP_STARTED;
 	} else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
-		// only respond to scans initiated from networkStartScan, and not from client connect
-		if (scanState == WIFI_SCANNING) {
+		// only respond to scans initiated from networkStartScan, and not from client connect or RoamMonitor
+		if (backgroundScansDone != backgroundScansStarted) {
+			backgroundScansDone = backgroundScansDone + 1;
+		} else if (scanState == WIFI_SCANNING) {
 			esp_wifi_scan_get_ap_num(&wifiScanNum);
 			wifiScanAPs = (wifi_ap_record_t*) calloc(wifiScanNum, sizeof(wifi_ap_record_t));
 			esp_wifi_scan_get_ap_records(&wifiScanNum, wifiScanAPs);
@@ -375,6 +447,270 @@ void RemoveMdnsServices()
 	mdns_free();
 }
 
+// Remember the access point that we connected through, so that next time we can connect straight to it
+static void RememberAccessPoint()
+{
+	wifi_ap_record_t ap;
+	if (currentSsid > WirelessConfigurationMgr::AP && esp_wifi_sta_get_ap_info(&ap) == ESP_OK)
+	{
+		WirelessConfigurationMgr::AccessPointInfo info;
+		memcpy(info.bssid, ap.bssid, sizeof(info.bssid));
+		info.channel = ap.primary;
+		info.authMode = ap.authmode;
+		wirelessConfigMgr->SetAccessPointInfo(currentSsid, info);
+	}
+}
+
+// Let the station connect through any access point with the SSID again. Returns true if it was pinned to one.
+static bool UnpinAccessPoint()
+{
+	if (!pinnedAccessPoint)
+	{
+		return false;
+	}
+
+	pinnedAccessPoint = false;
+	wifi_config_t wifi_config;
+	if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) == ESP_OK)
+	{
+		wifi_config.sta.bssid_set = false;
+		wifi_config.sta.channel = 0;
+		wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+		esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+	}
+	debugPrint("unpinned access point\n");
+	return true;
+}
+
+// Look for the access point that an SSID last connected through, on its channel only, which takes a fraction of
+// the time of scanning all channels. It must still have the same security, else it might not be the same network.
+static bool FindLastAccessPoint(int idx, const WirelessConfigurationData& wp, WirelessConfigurationMgr::AccessPointInfo& info)
+{
+	if (!wirelessConfigMgr->GetAccessPointInfo(idx, info))
+	{
+		return false;
+	}
+
+	char ssid[SsidLength + 1] = { 0 };
+	SafeStrncpy(ssid, wp.ssid, std::min(sizeof(ssid), sizeof(wp.ssid) + 1));
+
+	wifi_scan_config_t cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.ssid = reinterpret_cast<uint8_t*>(ssid);
+	cfg.bssid = info.bssid;
+	cfg.channel = info.channel;
+	cfg.show_hidden = true;
+
+	if (esp_wifi_scan_start(&cfg, true) != ESP_OK)
+	{
+		return false;
+	}
+
+	wifi_ap_record_t ap;
+	uint16_t num = 1;
+	const bool found = esp_wifi_scan_get_ap_records(&num, &ap) == ESP_OK && num == 1
+						&& memcmp(ap.bssid, info.bssid, sizeof(info.bssid)) == 0 && ap.authmode == info.authMode;
+	debugPrintf("last access point of '%s' on channel=%d %s\n", ssid, info.channel, found ? "found" : "not found");
+	return found;
+}
+
+// Roaming between the access points of a network with several of them. While connected, RoamMonitor samples the
+// signal strength, and while it is weak, scans one channel at a time for a stronger access point with the SSID.
+// Leaving the access point takes the station's address away for a moment, so roaming is only done if lwIP is built
+// to keep the TCP connections over that. The SAM then sees the connection and its sockets carry on.
+static const uint32_t RoamCheckInterval = 5 * 1000;			// how often we sample the signal strength in milliseconds
+static const uint32_t RoamScanInterval = 20 * 1000;			// least time between background scans in milliseconds
+static const int RoamRssiThreshold = -70;					// look for another access point when the signal is weaker than this (dBm)
+static const int RoamHysteresis = 8;						// how much stronger the other access point must be to move to it (dB)
+static const uint32_t RoamScanMinTime = 20;					// time that a background scan listens on the channel in milliseconds
+static const uint32_t RoamScanMaxTime = 40;
+static const uint16_t AllChannels = 0x3FFE;					// channels 1 to 13
+
+static SemaphoreHandle_t scanMutex;						// held while starting a scan, and for the whole of a background scan
+static volatile int roamRssi = 0;
+static uint32_t numRoams = 0;
+
+#if CONFIG_LWIP_TCP_KEEP_CONNECTION_WHEN_IP_CHANGES
+
+static volatile uint16_t neighborChannels = 0;			// channels of the access points that the current one reported as neighbors
+
+#if !defined(ESP8266) && CONFIG_WPA_11KV_SUPPORT
+// Collect the channels of the access points in an 802.11k neighbor report, which is a list of neighbor report
+// elements that may be preceded by the dialog token
+static void NeighborReportReceived(void *ctx, const uint8_t *report, size_t length)
+{
+	static constexpr uint8_t NeighborReportElement = 52;
+	static constexpr size_t ChannelOffset = 13;				// after the element header, BSSID, BSSID information and operating class
+
+	if (report == nullptr || length == 0)
+	{
+		return;
+	}
+
+	uint16_t channels = 0;
+	for (size_t pos = (report[0] == NeighborReportElement) ? 0 : 1; pos + 2 <= length && pos + 2 + report[pos + 1] <= length; pos += 2 + report[pos + 1])
+	{
+		if (report[pos] == NeighborReportElement && report[pos + 1] >= ChannelOffset)
+		{
+			const uint8_t channel = report[pos + ChannelOffset];
+			if (channel >= 1 && channel <= 13)
+			{
+				channels |= 1u << channel;
+			}
+		}
+	}
+	neighborChannels = channels;
+	debugPrintf("neighbor report channels %04x\n", channels);
+}
+#endif
+
+// Scan a channel for a stronger access point with the SSID that we are connected through 'ap' to, returning true
+// and setting 'target' if there is one
+static bool FindStrongerAccessPoint(const wifi_ap_record_t& ap, int rssi, uint8_t channel, WirelessConfigurationMgr::AccessPointInfo& target)
+{
+	static wifi_ap_record_t records[4];
+
+	// Don't hold up a scan that the SAM asked for, nor get in the way of one
+	if (xSemaphoreTake(scanMutex, 0) != pdTRUE)
+	{
+		return false;
+	}
+
+	bool found = false;
+	if (scanState == WIFI_SCAN_IDLE)
+	{
+		wifi_scan_config_t cfg;
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.ssid = const_cast<uint8_t*>(ap.ssid);
+		cfg.channel = channel;
+		cfg.show_hidden = true;
+		cfg.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+		cfg.scan_time.active.min = RoamScanMinTime;
+		cfg.scan_time.active.max = RoamScanMaxTime;
+
+		uint16_t num = ARRAY_SIZE(records);
+		backgroundScansStarted = backgroundScansStarted + 1;
+		const bool started = (esp_wifi_scan_start(&cfg, true) == ESP_OK);
+		if (!started)
+		{
+			backgroundScansStarted = backgroundScansStarted - 1;		// there won't be a scan done event for it
+		}
+		if (started && esp_wifi_scan_get_ap_records(&num, records) == ESP_OK)
+		{
+			int bestRssi = rssi + RoamHysteresis - 1;
+			for (size_t i = 0; i < num; ++i)
+			{
+				if (records[i].rssi > bestRssi && records[i].authmode == ap.authmode
+					&& memcmp(records[i].bssid, ap.bssid, sizeof(ap.bssid)) != 0)
+				{
+					bestRssi = records[i].rssi;
+					memcpy(target.bssid, records[i].bssid, sizeof(target.bssid));
+					target.channel = records[i].primary;
+					target.authMode = records[i].authmode;
+					found = true;
+				}
+			}
+		}
+	}
+
+	xSemaphoreGive(scanMutex);
+	return found;
+}
+
+// Move from the access point that we are connected to to 'target'. The Wi-Fi event handler connects to it once the
+// disconnection is done, and if that fails ConnectPoll unpins it and auto reconnects to any access point with the SSID.
+static void Roam(const WirelessConfigurationMgr::AccessPointInfo& target)
+{
+	wifi_config_t wifi_config;
+	if (currentState != WiFiState::connected || esp_wifi_get_config(WIFI_IF_STA, &wifi_config) != ESP_OK)
+	{
+		return;
+	}
+
+	memcpy(wifi_config.sta.bssid, target.bssid, sizeof(target.bssid));
+	wifi_config.sta.bssid_set = true;
+	wifi_config.sta.channel = target.channel;
+	wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+	if (esp_wifi_set_config(WIFI_IF_STA, &wifi_config) != ESP_OK)
+	{
+		return;
+	}
+
+	pinnedAccessPoint = true;
+	roaming = true;
+	if (esp_wifi_disconnect() == ESP_OK)
+	{
+		++numRoams;
+	}
+	else
+	{
+		roaming = false;
+	}
+}
+
+// Task that looks for a stronger access point while the one that we are connected to is weak
+static void RoamMonitor(void *)
+{
+	uint8_t bssid[6] = { 0 };
+	int rssi = 0;									// smoothed signal strength of the access point
+	TickType_t lastScan = 0;
+	uint8_t channel = 0;
+
+	while (true)
+	{
+		vTaskDelay(pdMS_TO_TICKS(RoamCheckInterval));
+
+		wifi_ap_record_t ap;
+		if (currentState != WiFiState::connected || roaming || esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+		{
+			memset(bssid, 0, sizeof(bssid));
+			continue;
+		}
+
+		if (memcmp(bssid, ap.bssid, sizeof(bssid)) != 0)
+		{
+			// Connected to a different access point, so start sampling again and give it a while before scanning
+			memcpy(bssid, ap.bssid, sizeof(bssid));
+			rssi = ap.rssi;
+			lastScan = xTaskGetTickCount();
+			neighborChannels = 0;
+#if !defined(ESP8266) && CONFIG_WPA_11KV_SUPPORT
+			esp_rrm_send_neighbor_rep_request(NeighborReportReceived, nullptr);
+#endif
+		}
+
+		rssi = (3 * rssi + ap.rssi) / 4;			// smooth out the variation between samples
+		roamRssi = rssi;
+		if (rssi >= RoamRssiThreshold || xTaskGetTickCount() - lastScan < pdMS_TO_TICKS(RoamScanInterval))
+		{
+			continue;
+		}
+		lastScan = xTaskGetTickCount();
+
+		// Scan the channels that the access point reported neighbors on if it did, else all of them in turn
+		const uint16_t channels = (neighborChannels != 0) ? (neighborChannels | (1u << ap.primary)) : AllChannels;
+		do
+		{
+			channel = (channel % 13) + 1;
+		} while (!(channels & (1u << channel)));
+
+		WirelessConfigurationMgr::AccessPointInfo target;
+		if (FindStrongerAccessPoint(ap, rssi, channel, target))
+		{
+			debugPrintf("roaming from rssi=%d to mac=%02x:%02x:%02x:%02x:%02x:%02x on channel=%d\n", rssi,
+							target.bssid[0], target.bssid[1], target.bssid[2], target.bssid[3], target.bssid[4], target.bssid[5], target.channel);
+			Roam(target);
+		}
+	}
+}
+
+#endif
+
+static void ReportRoaming()
+{
+	ets_printf("Roaming: %u roams, rssi %d\n", numRoams, roamRssi);
+}
+
 // Try to connect using the specified SSID and password
 void ConnectToAccessPoint()
 {
@@ -442,6 +778,7 @@ void ConnectPoll(void* data)
 					}
 					debugPrint("Connected to AP\n");
 					currentState = WiFiState::connected;
+					RememberAccessPoint();
 					break;
 
 				case STATION_CONNECTING:
@@ -453,6 +790,13 @@ void ConnectPoll(void* data)
 					break;
 				}
 
+				// If connecting straight to the access point that the SSID last used failed, try any access point with it
+				if (error != nullptr && event != STATION_CONNECT_TIMEOUT && pinnedAccessPoint)
+				{
+					error = nullptr;
+					retry = true;
+				}
+
 				if (error != nullptr)
 				{
 					strcpy(lastConnectError, error);
@@ -473,12 +817,15 @@ void ConnectPoll(void* data)
 		case WiFiState::connected:
 			if (event == WIFI_IDLE) {
 				currentState = WiFiState::idle;							// disconnected/stopped Wi-Fi
+			} else if (event == STATION_GOT_IP) {
+				RememberAccessPoint();									// roamed to another access point
 			} else if (event == STATION_WRONG_PASSWORD ||
 						event == STATION_NO_AP_FOUND ||
 						event == STATION_CONNECT_FAIL)
 			{
 				currentState = WiFiState::autoReconnecting;
 				xTimerReset(connExpTmr, portMAX_DELAY);		// start the auto reconnect timer
+				UnpinAccessPoint();								// the access point may have gone, so reconnect through any
 				esp_wifi_connect();
 				lastError = "Lost connection, auto reconnecting";
 				debugPrint("Lost connection to AP\n");
@@ -493,6 +840,7 @@ void ConnectPoll(void* data)
 				xTimerStop(connExpTmr, portMAX_DELAY);
 				lastError = "Auto reconnect succeeded";
 				currentState = WiFiState::connected;
+				RememberAccessPoint();
 			} else if (event != STATION_CONNECTING) {
 				if (event == STATION_CONNECT_TIMEOUT) {
 					lastError = "Timed out trying to auto-reconnect";
@@ -527,7 +875,8 @@ void ConnectPoll(void* data)
 		{
 			WirelessConfigurationData wp;
 			wirelessConfigMgr->GetSsid(currentSsid, wp);
-			currentState = isFirstConnectWorkaround() ? WiFiState::connecting : WiFiState::reconnecting;
+			const bool unpinned = UnpinAccessPoint();
+			currentState = (isFirstConnectWorkaround() || (unpinned && currentState == WiFiState::connecting)) ? WiFiState::connecting : WiFiState::reconnecting;
 			debugPrintf("Trying to reconnect to ssid \"%s\" with password \"%s\"\n", wp.ssid, wp.password);
 			ConnectToAccessPoint();
 		}
@@ -567,16 +916,39 @@ pre(currentState == WiFiState::idle)
 
 	WirelessConfigurationData wp;
 	esp_wifi_stop();
+	serviceAccessPoint = false;
+	pinnedAccessPoint = false;
+	roaming = false;
 
 #ifndef ESP8266
 	int8_t channel = -1;
 #endif
 
+	// Try the access point that the SSID connected through last time first, and only fall back to
+	// scanning all channels if it isn't there any more
+	WirelessConfigurationMgr::AccessPointInfo lastAp;
+	bool directed = false;
+
 	if (ssid == nullptr || ssid[0] == 0)
 	{
 		ConfigureSTAMode();
 		esp_wifi_start();
 
+		const int last = wirelessConfigMgr->GetLastConnectedSsid();
+		if (last > 0 && wirelessConfigMgr->GetSsid(last, wp) && FindLastAccessPoint(last, wp, lastAp))
+		{
+			currentSsid = last;
+			directed = true;
+			esp_wifi_stop();
+		}
+	}
+
+	if (directed)
+	{
+		// Already found the access point that we last connected to
+	}
+	else if (ssid == nullptr || ssid[0] == 0)
+	{
 		wifi_scan_config_t cfg;
 		memset(&cfg, 0, sizeof(cfg));
 		cfg.show_hidden = true;
@@ -649,6 +1021,15 @@ pre(currentState == WiFiState::idle)
 		}
 
 		currentSsid = idx;
+
+		WirelessConfigurationMgr::AccessPointInfo info;
+		if (wirelessConfigMgr->GetAccessPointInfo(idx, info))
+		{
+			ConfigureSTAMode();
+			esp_wifi_start();
+			directed = FindLastAccessPoint(idx, wp, lastAp);
+			esp_wifi_stop();
+		}
 	}
 
 	ConfigureSTAMode();
@@ -658,6 +1039,17 @@ pre(currentState == WiFiState::idle)
 	SafeStrncpy((char*)wifi_config.sta.ssid, (char*)wp.ssid,
 		std::min(sizeof(wifi_config.sta.ssid), sizeof(wp.ssid)));
 
+	if (directed)
+	{
+		// Connect to the access point on its channel only. If that fails, ConnectPoll unpins it and tries again.
+		memcpy(wifi_config.sta.bssid, lastAp.bssid, sizeof(lastAp.bssid));
+		wifi_config.sta.bssid_set = true;
+		wifi_config.sta.channel = lastAp.channel;
+		wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+		pinnedAccessPoint = true;
+	}
+	else
+	{
 #ifndef ESP8266
 	if (channel >= 0 && channel <= 13)
 	{
@@ -672,6 +1064,11 @@ pre(currentState == WiFiState::idle)
 	// instead preferring to connect to the previously connected to channel.
 	wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
 #endif
+	}
+
+#if !defined(ESP8266) && CONFIG_WPA_11KV_SUPPORT
+	wifi_config.sta.rm_enabled = true;				// so that we can ask the access point for its neighbors
+#endif
 
 	if (wp.eap.protocol == EAPProtocol::NONE)
 	{
@@ -835,6 +1232,83 @@ bool ValidApData(const WirelessConfigurationData &apData)
 	return CheckValidSSID(apData.ssid) && CheckValidPassword(apData.password);
 }
 
+// Set up the access point interface, its address and its DHCP server
+static esp_err_t ConfigureAccessPoint(const WirelessConfigurationData& apData, uint8_t channel)
+{
+	wifi_config_t wifi_config;
+	memset(&wifi_config, 0, sizeof(wifi_config));
+	SafeStrncpy((char*)wifi_config.ap.ssid, apData.ssid,
+		std::min(sizeof(wifi_config.ap.ssid), sizeof(apData.ssid)));
+	SafeStrncpy((char*)wifi_config.ap.password, (char*)apData.password,
+		std::min(sizeof(wifi_config.ap.password), sizeof(apData.password)));
+	wifi_config.ap.authmode = WIFI_AUTH_WPA_WPA2_PSK;
+	wifi_config.ap.channel = channel;
+	wifi_config.ap.max_connection = MaxAPConnections;
+
+	esp_err_t res = esp_wifi_set_config(WIFI_IF_AP, &wifi_config);
+	if (res != ESP_OK)
+	{
+		debugPrintAlways("Failed to set AP config\n");
+		return res;
+	}
+
+	tcpip_adapter_dhcps_stop(TCPIP_ADAPTER_IF_AP);
+
+	tcpip_adapter_ip_info_t ip_info;
+	ip_info.ip.addr = apData.ip;
+	ip_info.gw.addr = apData.ip;
+	IP4_ADDR(&ip_info.netmask, 255, 255, 255, 0);
+	res = tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_AP, &ip_info);
+
+	tcpip_adapter_dhcps_start(TCPIP_ADAPTER_IF_AP);
+	return res;
+}
+
+// Run our access point alongside the station connection, so that local devices can reach us without us leaving the network.
+// The access point has to use the channel of the network we are connected to.
+void StartServiceAccessPoint()
+{
+	WirelessConfigurationData apData;
+	if (!wirelessConfigMgr->GetSsid(WirelessConfigurationMgr::AP, apData) || !ValidApData(apData))
+	{
+		lastError = "invalid access point configuration";
+		return;
+	}
+
+	wifi_ap_record_t staAp;
+	const uint8_t channel = (esp_wifi_sta_get_ap_info(&staAp) == ESP_OK) ? staAp.primary
+							: (apData.channel == 0) ? DefaultWiFiChannel : apData.channel;
+
+	esp_err_t res = esp_wifi_set_mode(WIFI_MODE_APSTA);
+	if (res == ESP_OK)
+	{
+		res = ConfigureAccessPoint(apData, channel);
+	}
+
+	if (res == ESP_OK)
+	{
+		serviceAccessPoint = true;
+		debugPrintf("Started service AP %s on channel %u\n", apData.ssid, channel);
+	}
+	else
+	{
+		esp_wifi_set_mode(WIFI_MODE_STA);
+		lastError = "Failed to start service access point";
+		debugPrintf("%s\n", lastError);
+	}
+}
+
+void StopServiceAccessPoint()
+{
+	if (serviceAccessPoint)
+	{
+		Connection::StopListen(ListenInterface::accessPoint);
+		Connection::TerminateInterface(ListenInterface::accessPoint);
+		esp_wifi_set_mode(WIFI_MODE_STA);
+		serviceAccessPoint = false;
+	}
+}
+
 void StartAccessPoint()
 {
 	esp_wifi_stop();
@@ -846,44 +1320,17 @@ void StartAccessPoint()
 
 		if (res == ESP_OK)
 		{
-			wifi_config_t wifi_config;
-			memset(&wifi_config, 0, sizeof(wifi_config));
-			SafeStrncpy((char*)wifi_config.ap.ssid, apData.ssid,
-				std::min(sizeof(wifi_config.ap.ssid), sizeof(apData.ssid)));
-			SafeStrncpy((char*)wifi_config.ap.password, (char*)apData.password,
-				std::min(sizeof(wifi_config.ap.password), sizeof(apData.password)));
-			wifi_config.ap.authmode = WIFI_AUTH_WPA_WPA2_PSK;
-			wifi_config.ap.channel = (apData.channel == 0) ? DefaultWiFiChannel : apData.channel;
-			wifi_config.ap.max_connection = MaxAPConnections;
-
-			res = esp_wifi_set_config(WIFI_IF_AP, &wifi_config);
-
-			if (res == ESP_OK)
-			{
-				tcpip_adapter_dhcps_stop(TCPIP_ADAPTER_IF_AP);
-
-				tcpip_adapter_ip_info_t ip_info;
-				ip_info.ip.addr = apData.ip;
-				ip_info.gw.addr = apData.ip;
-				IP4_ADDR(&ip_info.netmask, 255, 255, 255, 0);
-				res = tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_AP, &ip_info);
-
-				tcpip_adapter_dhcps_start(TCPIP_ADAPTER_IF_AP);
-
-				if (res == ESP_OK) {
-					debugPrintf("Starting AP %s with password \"%s\"\n", apData.ssid, apData.password);
-					currentSsid = WirelessConfigurationMgr::AP;
-					res = esp_wifi_start();
-				}
+			res = ConfigureAccessPoint(apData, (apData.channel == 0) ? DefaultWiFiChannel : apData.channel);
 
-				if (res != ESP_OK)
-				{
-					debugPrintAlways("Failed to start AP\n");
-				}
+			if (res == ESP_OK) {
+				debugPrintf("Starting AP %s with password \"%s\"\n", apData.ssid, apData.password);
+				currentSsid = WirelessConfigurationMgr::AP;
+				res = esp_wifi_start();
 			}
-			else
+
+			if (res != ESP_OK)
 			{
-				debugPrintAlways("Failed to set AP config\n");
+				debugPrintAlways("Failed to start AP\n");
 			}
 		}
 		else
@@ -934,6 +1381,9 @@ static void HandleEthEvent(void *arg, esp_event_base_t event_base,
 			tcpip_adapter_dhcpc_stop(TCPIP_ADAPTER_IF_ETH);
 			tcpip_adapter_set_ip_info(TCPIP_ADAPTER_IF_ETH, &staIpInfo);
 		}
+#if CONFIG_LWIP_IPV6_AUTOCONFIG
+		tcpip_adapter_create_ip6_linklocal(TCPIP_ADAPTER_IF_ETH);
+#endif
 		esp_eth_ioctl(ethHandle, ETH_CMD_G_MAC_ADDR, mac_addr);
 		debugPrint("Ethernet Link Up\n");
 		debugPrintf("Ethernet HW Addr %02x:%02x:%02x:%02x:%02x:%02x\n",
@@ -1060,8 +1510,30 @@ static union
 // Send a response.
 // 'response' is the number of byes of response if positive, or the error code if negative.
 // Use only to respond to commands which don't include a data block, or when we don't want to read the data block.
-void SendResponse(int32_t response)
+// If read-ahead is enabled and the command allows it, an empty response carries data from the socket that has waited longest for it to be read.
+// Only commands whose empty response the SAM can't mistake for an empty result may allow it.
+void SendResponse(int32_t response, bool allowReadAhead = false)
 {
+	if (response == ResponseEmpty && allowReadAhead && readAhead && messageHeaderIn.hdr.dataBufferAvailable > sizeof(ReadAheadHeader))
+	{
+		Connection * const conn = Connection::GetMostUrgent();
+		if (conn != nullptr)
+		{
+			uint8_t * const buffer = reinterpret_cast<uint8_t *>(transferBuffer);
+			const size_t amount = conn->Read(buffer + sizeof(ReadAheadHeader),
+												std::min<size_t>(messageHeaderIn.hdr.dataBufferAvailable, MaxDataLength) - sizeof(ReadAheadHeader));
+			if (amount != 0)
+			{
+				ReadAheadHeader * const hdr = reinterpret_cast<ReadAheadHeader *>(buffer);
+				hdr->socketNumber = conn->GetNum();
+				hdr->dummy = 0;
+				hdr->length = amount;
+				response = sizeof(ReadAheadHeader) + amount;
+				led_indicator_start(led, ONBOARD_LED_IO);
+			}
+		}
+	}
+
 	(void)hspi.transfer32(response);
 	if (response > 0)
 	{
@@ -1162,7 +1634,7 @@ void ProcessRequest()
 		switch (messageHeaderIn.hdr.command)
 		{
 		case NetworkCommand::nullCommand:					// no command being sent, SAM just wants the network status
-			SendResponse(ResponseEmpty);
+			SendResponse(ResponseEmpty, true);
 			break;
 
 		case NetworkCommand::networkStartClient:			// connect to an access point
@@ -1548,24 +2020,11 @@ void ProcessRequest()
 			}
 			else
 			{
-				char *p = reinterpret_cast<char*>(transferBuffer);
-				for (size_t i = 0; i <= MaxRememberedNetworks && (i + 1) * ReducedWirelessConfigurationDataSize <= dataBufferAvailable; ++i)
-				{
-
-					WirelessConfigurationData tempData;
-					wirelessConfigMgr->GetSsid(i, tempData);
-					if (tempData.ssid[0] != 0xFF)
-					{
-						memcpy(p, &tempData, ReducedWirelessConfigurationDataSize);
-						p += ReducedWirelessConfigurationDataSize;
-					}
-					else if (i == 0)
-					{
-						memset(p, 0, ReducedWirelessConfigurationDataSize);
-						p += ReducedWirelessConfigurationDataSize;
-					}
-				}
-				const size_t numBytes = p - reinterpret_cast<char*>(transferBuffer);
+				// The table is kept in the form that we send it
+				size_t numBytes;
+				const uint8_t *table = wirelessConfigMgr->GetSsidTable(numBytes);
+				numBytes = std::min<size_t>(numBytes, dataBufferAvailable - dataBufferAvailable % ReducedWirelessConfigurationDataSize);
+				memcpy(transferBuffer, table, numBytes);
 				SendResponse(numBytes);
 			}
 			break;
@@ -1711,7 +2170,32 @@ void ProcessRequest()
 				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
 				ListenOrConnectData lcData;
 				hspi.transferDwords(nullptr, reinterpret_cast<uint32_t*>(&lcData), NumDwords(sizeof(lcData)));
-				const bool ok = Connection::Listen(lcData.port, lcData.remoteIp, lcData.protocol, lcData.maxConnections);
+				const bool ok = Connection::Listen(lcData.port, lcData.remoteIp, lcData.protocol, lcData.maxConnections, messageHeaderIn.hdr.flags, ToListenInterface(lcData.iface));
+				if (ok)
+				{
+					if (lcData.protocol < 3)			// if it's FTP, HTTP or Telnet protocol
+					{
+						RebuildServices();				// update the MDNS services
+					}
+					debugPrintf("%sListening on port %u\n", (lcData.maxConnections == 0) ? "Stopped " : "", lcData.port);
+				}
+				else
+				{
+					lastError = "Listen failed";
+					debugPrint("Listen failed\n");
+				}
+			}
+			break;
+
+		case NetworkCommand::networkListenWide:			// listen for incoming connections on an IPv4 or IPv6 address
+			if (messageHeaderIn.hdr.dataLength == sizeof(ListenOrConnectDataWide))
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+				ListenOrConnectDataWide lcData;
+				hspi.transferDwords(nullptr, reinterpret_cast<uint32_t*>(&lcData), NumDwords(sizeof(lcData)));
+				ip_addr_t ip;
+				Connection::FromWideIpAddress(lcData.remoteIp, ip);
+				const bool ok = Connection::Listen(lcData.port, ip, lcData.protocol, lcData.maxConnections, messageHeaderIn.hdr.flags, ToListenInterface(lcData.iface));
 				if (ok)
 				{
 					if (lcData.protocol < 3)			// if it's FTP, HTTP or Telnet protocol
@@ -1786,12 +2270,31 @@ void ProcessRequest()
 			{
 				Connection& conn = Connection::Get(messageHeaderIn.hdr.socketNumber);
 				const size_t requestedlength = messageHeaderIn.hdr.dataLength;
-				const size_t acceptedLength = std::min<size_t>(conn.CanWrite(), std::min<size_t>(requestedlength, MaxDataLength));
+				size_t space = conn.CanWrite();
+#if SUPPORT_COMPRESSION
+				if (messageHeaderIn.hdr.flags & MessageHeaderSamToEsp::FlagCompress)
+				{
+					// CanWrite only allows for the gzip framing once a response is being compressed, but the first write also carries the gzip header
+					space = (space > GzipEncoder::MaxOverhead) ? space - GzipEncoder::MaxOverhead : 0;
+				}
+#endif
+				size_t acceptedLength = std::min<size_t>(space, std::min<size_t>(requestedlength, MaxDataLength));
+				if (acceptedLength != requestedlength && conn.WritesWholeChunks())
+				{
+					acceptedLength = 0;						// a WebSocket chunk becomes one frame, so take all of it or none
+				}
 				const bool closeAfterSending = (acceptedLength == requestedlength) && (messageHeaderIn.hdr.flags & MessageHeaderSamToEsp::FlagCloseAfterWrite) != 0;
 				const bool push = (acceptedLength == requestedlength) && (messageHeaderIn.hdr.flags & MessageHeaderSamToEsp::FlagPush) != 0;
 				messageHeaderIn.hdr.param32 = hspi.transfer32(acceptedLength);
 				hspi.transferDwords(nullptr, transferBuffer, NumDwords(acceptedLength));
+#if SUPPORT_COMPRESSION
+				const size_t written = (messageHeaderIn.hdr.flags & MessageHeaderSamToEsp::FlagCompress)
+										? conn.WriteCompressed(reinterpret_cast<uint8_t *>(transferBuffer), acceptedLength, push, closeAfterSending,
+																(acceptedLength == requestedlength) && (messageHeaderIn.hdr.flags & MessageHeaderSamToEsp::FlagCompressEnd) != 0)
+										: conn.Write(reinterpret_cast<uint8_t *>(transferBuffer), acceptedLength, push, closeAfterSending);
+#else
 				const size_t written = conn.Write(reinterpret_cast<uint8_t *>(transferBuffer), acceptedLength, push, closeAfterSending);
+#endif
 				if (written != acceptedLength)
 				{
 					lastError = "incomplete write";
@@ -1807,11 +2310,45 @@ void ProcessRequest()
 		case NetworkCommand::connGetStatus:				// get the status of a socket, and summary status for all sockets
 			if (ValidSocketNumber(messageHeaderIn.hdr.socketNumber))
 			{
-				messageHeaderIn.hdr.param32 = hspi.transfer32(sizeof(ConnStatusResponse));
 				Connection& conn = Connection::Get(messageHeaderIn.hdr.socketNumber);
-				ConnStatusResponse resp;
-				conn.GetStatus(resp);
-				Connection::GetSummarySocketStatus(resp.connectedSockets, resp.otherEndClosedSockets);
+
+				// In read-ahead mode the status is followed by as much received data as fits, and reports what is left after that
+				const size_t amount = (readAhead && dataBufferAvailable > sizeof(ConnStatusResponse))
+										? conn.Read(reinterpret_cast<uint8_t *>(transferBuffer) + sizeof(ConnStatusResponse), dataBufferAvailable - sizeof(ConnStatusResponse))
+										: 0;
+				ConnStatusResponse * const resp = reinterpret_cast<ConnStatusResponse *>(transferBuffer);
+				conn.GetStatus(*resp);
+				Connection::GetSummarySocketStatus(resp->connectedSockets, resp->otherEndClosedSockets);
+				messageHeaderIn.hdr.param32 = hspi.transfer32(sizeof(ConnStatusResponse) + amount);
+				hspi.transferDwords(transferBuffer, nullptr, NumDwords(sizeof(ConnStatusResponse) + amount));
+			}
+			else
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseBadParameter);
+			}
+			break;
+
+		case NetworkCommand::connGetStatusWide:			// get the status of a socket including the full remote address
+			if (ValidSocketNumber(messageHeaderIn.hdr.socketNumber))
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(sizeof(ConnStatusResponseWide));
+				ConnStatusResponseWide resp;
+				Connection::Get(messageHeaderIn.hdr.socketNumber).GetStatusWide(resp);
+				Connection::GetSummarySocketStatus(resp.status.connectedSockets, resp.status.otherEndClosedSockets);
+				hspi.transferDwords(reinterpret_cast<const uint32_t *>(&resp), nullptr, NumDwords(sizeof(resp)));
+			}
+			else
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseBadParameter);
+			}
+			break;
+
+		case NetworkCommand::connGetStats:				// get the traffic statistics of a socket
+			if (ValidSocketNumber(messageHeaderIn.hdr.socketNumber))
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(sizeof(ConnStatsResponse));
+				ConnStatsResponse resp;
+				Connection::Get(messageHeaderIn.hdr.socketNumber).GetStats(resp);
 				hspi.transferDwords(reinterpret_cast<const uint32_t *>(&resp), nullptr, NumDwords(sizeof(resp)));
 			}
 			else
@@ -1868,6 +2405,234 @@ void ProcessRequest()
 			}
 			break;
 
+		case NetworkCommand::connCreateWide:				// create a connection to an IPv4 or IPv6 address
+			if (messageHeaderIn.hdr.dataLength == sizeof(ListenOrConnectDataWide))
+			{
+				Connection * const conn = Connection::Allocate();
+				if (conn)
+				{
+					uint32_t connNum = conn->GetNum();
+					messageHeaderIn.hdr.param32 = hspi.transfer32(connNum);
+					ListenOrConnectDataWide lcData;
+					hspi.transferDwords(nullptr, reinterpret_cast<uint32_t*>(&lcData), NumDwords(sizeof(lcData)));
+
+					ip_addr_t remoteIp;
+					Connection::FromWideIpAddress(lcData.remoteIp, remoteIp);
+					if (!conn->Connect(lcData.protocol, remoteIp, lcData.port))
+					{
+						lastError = "Connection creation failed";
+					}
+				}
+				else
+				{
+					// No available connection
+					SendResponse(ResponseBusy);
+				}
+			}
+			else
+			{
+				SendResponse(ResponseBadDataLength);
+			}
+			break;
+
+		case NetworkCommand::connCreateByName:				// create a connection to a named host
+			if (messageHeaderIn.hdr.dataLength == sizeof(ConnectByNameData))
+			{
+				Connection * const conn = Connection::Allocate();
+				if (conn)
+				{
+					uint32_t connNum = conn->GetNum();
+					messageHeaderIn.hdr.param32 = hspi.transfer32(connNum);
+					hspi.transferDwords(nullptr, transferBuffer, NumDwords(sizeof(ConnectByNameData)));
+					ConnectByNameData * const cnData = reinterpret_cast<ConnectByNameData*>(transferBuffer);
+
+					char hostName[HostNameLength + 1];
+					memcpy(hostName, cnData->hostName, HostNameLength);
+					hostName[HostNameLength] = 0;				// ensure null terminator
+					if (!conn->ConnectByName(cnData->protocol, hostName, cnData->port))
+					{
+						lastError = "Connection creation failed";
+					}
+				}
+				else
+				{
+					// No available connection
+					SendResponse(ResponseBusy);
+				}
+			}
+			else
+			{
+				SendResponse(ResponseBadDataLength);
+			}
+			break;
+
+		case NetworkCommand::connBindUdp:					// create a UDP socket
+			if (messageHeaderIn.hdr.dataLength == sizeof(ListenOrConnectData))
+			{
+				Connection * const conn = Connection::Allocate();
+				if (conn)
+				{
+					uint32_t connNum = conn->GetNum();
+					messageHeaderIn.hdr.param32 = hspi.transfer32(connNum);
+					ListenOrConnectData lcData;
+					hspi.transferDwords(nullptr, reinterpret_cast<uint32_t*>(&lcData), NumDwords(sizeof(lcData)));
+
+					if (!conn->BindUdp(lcData.protocol, lcData.remoteIp, lcData.port))
+					{
+						lastError = "UDP socket creation failed";
+					}
+				}
+				else
+				{
+					// No available connection
+					SendResponse(ResponseBusy);
+				}
+			}
+			else
+			{
+				SendResponse(ResponseBadDataLength);
+			}
+			break;
+
+		case NetworkCommand::connSendTo:					// send a datagram from a UDP socket
+			if (!ValidSocketNumber(messageHeaderIn.hdr.socketNumber))
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseBadParameter);
+			}
+			else if (messageHeaderIn.hdr.dataLength < sizeof(UdpDatagramHeader))
+			{
+				SendResponse(ResponseBadDataLength);
+			}
+			else
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+				hspi.transferDwords(nullptr, transferBuffer, NumDwords(messageHeaderIn.hdr.dataLength));
+				Connection& conn = Connection::Get(messageHeaderIn.hdr.socketNumber);
+				if (!conn.SendTo(reinterpret_cast<uint8_t *>(transferBuffer), messageHeaderIn.hdr.dataLength))
+				{
+					lastError = "UDP send failed";
+				}
+				led_indicator_start(led, ONBOARD_LED_IO);
+			}
+			break;
+
+		case NetworkCommand::connRecvFrom:					// receive a datagram from a UDP socket
+			if (ValidSocketNumber(messageHeaderIn.hdr.socketNumber))
+			{
+				Connection& conn = Connection::Get(messageHeaderIn.hdr.socketNumber);
+				const size_t amount = conn.RecvFrom(reinterpret_cast<uint8_t *>(transferBuffer), dataBufferAvailable);
+				messageHeaderIn.hdr.param32 = hspi.transfer32(amount);
+				hspi.transferDwords(transferBuffer, nullptr, NumDwords(amount));
+				led_indicator_start(led, ONBOARD_LED_IO);
+			}
+			else
+			{
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseBadParameter);
+			}
+			break;
+
+#if SUPPORT_ASSET_CACHE
+		case NetworkCommand::networkCacheAsset:				// store or remove cached static assets
+			switch (static_cast<AssetCacheOp>(messageHeaderIn.hdr.flags))
+			{
+			case AssetCacheOp::clear:
+				SendResponse(ResponseEmpty);
+				deferCommand = true;						// erasing takes a while, so do it after responding
+				break;
+
+			case AssetCacheOp::begin:
+				if (messageHeaderIn.hdr.dataLength == sizeof(AssetCacheInfo))
+				{
+					messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+					hspi.transferDwords(nullptr, transferBuffer, NumDwords(sizeof(AssetCacheInfo)));
+					if (!AssetCache::Begin(*reinterpret_cast<const AssetCacheInfo*>(transferBuffer)))
+					{
+						lastError = "asset cache full";
+					}
+				}
+				else
+				{
+					SendResponse(ResponseBadDataLength);
+				}
+				break;
+
+			case AssetCacheOp::data:
+				if (messageHeaderIn.hdr.dataLength != 0 && messageHeaderIn.hdr.dataLength <= MaxDataLength)
+				{
+					messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+					hspi.transferDwords(nullptr, transferBuffer, NumDwords(messageHeaderIn.hdr.dataLength));
+					if (!AssetCache::Write(messageHeaderIn.hdr.param32, transferBuffer, messageHeaderIn.hdr.dataLength))
+					{
+						lastError = "failed to store asset";
+					}
+				}
+				else
+				{
+					SendResponse(ResponseBadDataLength);
+				}
+				break;
+
+			case AssetCacheOp::commit:
+				SendResponse(AssetCache::Commit() ? ResponseEmpty : ResponseWrongState);
+				break;
+
+			default:
+				SendResponse(ResponseBadParameter);
+				break;
+			}
+			break;
+#endif
+
+		case NetworkCommand::networkSetServiceAccessPoint:	// start or stop the access point alongside the station connection
+			if (   (currentState == WiFiState::connected || currentState == WiFiState::autoReconnecting)
+#if SUPPORT_ETHERNET
+				&& ethState < EthState::started
+#endif
+			   )
+			{
+				deferCommand = true;
+				messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+			}
+			else
+			{
+				SendResponse(ResponseWrongState);
+			}
+			break;
+
+		case NetworkCommand::networkSetReadAhead:			// enable or disable read-ahead of socket data
+			readAhead = (messageHeaderIn.hdr.flags != 0);
+			messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+			break;
+
+#if SUPPORT_TLS
+		case NetworkCommand::networkSetTlsCredential:		// store part of the TLS certificate or private key
+			{
+				const TlsCredential cred = static_cast<TlsCredential>(messageHeaderIn.hdr.flags);
+				if (cred != TlsCredential::CERTIFICATE && cred != TlsCredential::PRIVATE_KEY)
+				{
+					SendResponse(ResponseBadParameter);
+				}
+				else if (messageHeaderIn.hdr.dataLength == 0 || messageHeaderIn.hdr.dataLength > MaxCredentialChunkSize)
+				{
+					SendResponse(ResponseBadDataLength);
+				}
+				else
+				{
+					messageHeaderIn.hdr.param32 = hspi.transfer32(ResponseEmpty);
+					hspi.transferDwords(nullptr, transferBuffer, NumDwords(messageHeaderIn.hdr.dataLength));
+					if (wirelessConfigMgr->SetTlsCredential(cred, transferBuffer, messageHeaderIn.hdr.dataLength, messageHeaderIn.hdr.param32))
+					{
+						TlsSession::CredentialsChanged();
+					}
+					else
+					{
+						lastError = "failed to store TLS credential";
+					}
+				}
+			}
+			break;
+#endif
+
 		default:
 			SendResponse(ResponseUnknownCommand);
 			break;
@@ -1906,7 +2671,21 @@ void ProcessRequest()
 			StartAccessPoint();
 			break;
 
+		case NetworkCommand::networkSetServiceAccessPoint:
+			if (messageHeaderIn.hdr.flags != 0)
+			{
+				StartServiceAccessPoint();
+			}
+			else
+			{
+				StopServiceAccessPoint();
+				RebuildServices();							// listeners on the access point may have been stopped
+			}
+			break;
+
 		case NetworkCommand::networkStop:					// disconnect from an access point, or close down our own access point
+			serviceAccessPoint = false;
+			roaming = false;
 			Connection::TerminateAll();						// terminate all connections
 			Connection::StopListen(0);							// stop listening on all ports
 			RebuildServices();								// remove the MDNS services
@@ -1968,6 +2747,7 @@ void ProcessRequest()
 				esp_wifi_start();
 			}
 
+			xSemaphoreTake(scanMutex, portMAX_DELAY);		// wait for any background scan to finish
 			if (esp_wifi_scan_start(&cfg, false) == ESP_OK) {
 				scanState = WIFI_SCANNING;
 			} else {
@@ -1975,10 +2755,19 @@ void ProcessRequest()
 				// does not happen.
 				lastError = "failed to start scan";
 			}
+			xSemaphoreGive(scanMutex);
 			break;
 
 		case NetworkCommand::diagnostics:
+			ReportBootTimes();
+			ReportRoaming();
 			Connection::ReportConnections();
+#if SUPPORT_ASSET_CACHE
+			AssetCache::Report();
+#endif
+#if SUPPORT_COMPRESSION
+			GzipEncoder::Report();
+#endif
 			delay(20);										// give the Duet main processor time to digest that
 			stats_display();
 			break;
@@ -1989,6 +2778,15 @@ void ProcessRequest()
 			hspi.InitMaster(SPI_MODE1, messageHeaderIn.hdr.param32, true);
 			break;
 
+#if SUPPORT_ASSET_CACHE
+		case NetworkCommand::networkCacheAsset:				// the only deferred asset cache operation is 'clear'
+			if (!AssetCache::Clear())
+			{
+				lastError = "failed to clear asset cache";
+			}
+			break;
+#endif
+
 		default:
 			lastError = "bad deferred command";
 			break;
@@ -2011,6 +2809,14 @@ void IRAM_ATTR TransferReadyIsr(void* p)
 	}
 }
 
+// Storage checks that don't need to hold up telling the SAM that we are ready
+static void StorageCheck(void *)
+{
+	wirelessConfigMgr->Check();
+	RecordBootPhase(BootPhase::storageCheck);
+	vTaskDelete(nullptr);
+}
+
 void setup()
 {
 	mainTaskHdl = xTaskGetCurrentTaskHandle();
@@ -2044,11 +2850,20 @@ void setup()
 	wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
 	cfg.nvs_enable = false;
 	esp_wifi_init(&cfg);
+	RecordBootPhase(BootPhase::wifiInit);
 	xTaskCreate(ConnectPoll, "connPoll", CONN_POLL_STACK, NULL, CONN_POLL_PRIO, &connPollTaskHdl);
+	scanMutex = xSemaphoreCreateMutex();
+#if CONFIG_LWIP_TCP_KEEP_CONNECTION_WHEN_IP_CHANGES
+	xTaskCreate(RoamMonitor, "roam", ROAM_STACK, NULL, ROAM_PRIO, NULL);
+#endif
 
 	esp_log_level_set("wifi", ESP_LOG_NONE);
 
 	wirelessConfigMgr->Init();
+#if SUPPORT_ASSET_CACHE
+	AssetCache::Init();
+#endif
+	RecordBootPhase(BootPhase::storageInit);
 
 #if SUPPORT_ETHERNET
 # if ETH_V0
@@ -2075,6 +2890,7 @@ void setup()
 	gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
 	gpio_isr_handler_add(SamTfrReadyPin, TransferReadyIsr, nullptr);
 	gpio_set_intr_type(SamTfrReadyPin, GPIO_INTR_POSEDGE);
+	RecordBootPhase(BootPhase::spiInit);
 
 	tfrReqExpTmr = xTimerCreate("tfrReqExpTmr", StatusReportMillis, pdFALSE, NULL,
 		[](TimerHandle_t data) {
@@ -2087,8 +2903,11 @@ void setup()
 	lastError = nullptr;
 	debugPrintAlways("Init completed\n");
 	gpio_set_level(EspReqTransferPin, 1);					// tell the SAM we are ready to receive a command
+	RecordBootPhase(BootPhase::ready);
 	led_indicator_stop(led, ONBOARD_LED_RESET);
 	led_indicator_start(led, ONBOARD_LED_IDLE);
+
+	xTaskCreate(StorageCheck, "storageChk", STORAGE_CHECK_STACK, NULL, STORAGE_CHECK_PRIO, NULL);
 }
 
 void loop()
@@ -2111,6 +2930,11 @@ void loop()
 	}
 
 	Connection::PollAll();
+	const char * const connError = Connection::TakeLastError();
+	if (connError != nullptr)
+	{
+		lastError = connError;
+	}
 
 	if (gpio_get_level(SamTfrReadyPin) == 1 &&
 		(flags == 0 || (flags & SAM_TFR_READY))) {
@@ -0,0 +1,596 @@
+/*
+ * TlsSession.cpp
+ *
+ * Server side TLS for connections accepted by secure listeners.
+ */
+
+#include "TlsSession.h"
+
+#if SUPPORT_TLS
+
+#include <cstring>
+#include <algorithm>
+#include <new>
+
+#include "lwip/tcp.h"
+#include "mbedtls/version.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+#if defined(MBEDTLS_SSL_TICKET_C)
+#include "mbedtls/ssl_ticket.h"
+#endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+#include "mbedtls/ssl_cache.h"
+#endif
+
+#include "WirelessConfigurationMgr.h"
+
+static const size_t PlainChunkSize = 1024;				// size of the pbufs we decrypt into
+static const uint32_t TicketLifetime = 24 * 60 * 60;	// how long a client may resume a session using a ticket, in seconds
+static const int MaxCachedSessions = 4;					// sessions kept for resumption by session ID
+static const uint32_t HandshakePollInterval = 10;		// how often the handshake task looks for more data from the clients, in milliseconds
+
+// Configuration shared by all sessions, allocated when the first secure listener is started
+struct TlsConfig
+{
+	mbedtls_ssl_config conf;
+	mbedtls_x509_crt cert;
+	mbedtls_pk_context key;
+	mbedtls_entropy_context entropy;
+	mbedtls_ctr_drbg_context drbg;
+#if defined(MBEDTLS_SSL_TICKET_C)
+	mbedtls_ssl_ticket_context ticket;
+#endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+	mbedtls_ssl_cache_context cache;
+#endif
+};
+
+static TlsConfig *config = nullptr;
+
+// Load a credential into a null terminated buffer, as mbedTLS needs the terminator to recognise PEM data
+static uint8_t *LoadCredential(TlsCredential cred, size_t& length)
+{
+	WirelessConfigurationMgr * const mgr = WirelessConfigurationMgr::GetInstance();
+	const size_t size = mgr->GetTlsCredentialSize(cred);
+	if (size == 0)
+	{
+		return nullptr;
+	}
+
+	uint8_t * const buff = new (std::nothrow) uint8_t[size + 1];
+	if (buff != nullptr)
+	{
+		if (mgr->GetTlsCredential(cred, buff, size))
+		{
+			buff[size] = 0;
+			length = (size >= 5 && memcmp(buff, "-----", 5) == 0) ? size + 1 : size;	// PEM length includes the terminator, DER doesn't
+			return buff;
+		}
+		delete[] buff;
+	}
+	return nullptr;
+}
+
+/*static*/ void TlsSession::Init()
+{
+	mutex = xSemaphoreCreateRecursiveMutex();
+	handshakeMutex = xSemaphoreCreateMutex();
+}
+
+// Set up the shared configuration if it isn't already, or reload it if the credentials have changed and no session is using it
+/*static*/ bool TlsSession::Configure()
+{
+	Lock lock;
+	if (config != nullptr)
+	{
+		if (!stale || numSessions != 0)
+		{
+			return true;
+		}
+		Unconfigure();
+	}
+
+	size_t certLength = 0, keyLength = 0;
+	uint8_t * const certData = LoadCredential(TlsCredential::CERTIFICATE, certLength);
+	uint8_t * const keyData = LoadCredential(TlsCredential::PRIVATE_KEY, keyLength);
+
+	bool ok = (certData != nullptr && keyData != nullptr);
+	if (!ok)
+	{
+		debugPrintAlways("no TLS certificate or key stored\n");
+	}
+	else
+	{
+		config = new (std::nothrow) TlsConfig;
+		ok = (config != nullptr);
+	}
+
+	if (ok)
+	{
+		mbedtls_ssl_config_init(&config->conf);
+		mbedtls_x509_crt_init(&config->cert);
+		mbedtls_pk_init(&config->key);
+		mbedtls_entropy_init(&config->entropy);
+		mbedtls_ctr_drbg_init(&config->drbg);
+#if defined(MBEDTLS_SSL_TICKET_C)
+		mbedtls_ssl_ticket_init(&config->ticket);
+#endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+		mbedtls_ssl_cache_init(&config->cache);
+#endif
+
+		static const unsigned char personalisation[] = "DuetWiFiServer";
+		int ret = mbedtls_ctr_drbg_seed(&config->drbg, mbedtls_entropy_func, &config->entropy, personalisation, sizeof(personalisation) - 1);
+
+		if (ret == 0)
+		{
+			ret = mbedtls_x509_crt_parse(&config->cert, certData, certLength);
+		}
+
+		if (ret == 0)
+		{
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+			ret = mbedtls_pk_parse_key(&config->key, keyData, keyLength, nullptr, 0, mbedtls_ctr_drbg_random, &config->drbg);
+#else
+			ret = mbedtls_pk_parse_key(&config->key, keyData, keyLength, nullptr, 0);
+#endif
+		}
+
+		if (ret == 0)
+		{
+			ret = mbedtls_ssl_config_defaults(&config->conf, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+		}
+
+		if (ret == 0)
+		{
+			mbedtls_ssl_conf_rng(&config->conf, Random, &config->drbg);
+			ret = mbedtls_ssl_conf_own_cert(&config->conf, &config->cert, &config->key);
+		}
+
+		// Let clients resume sessions so that reconnecting doesn't cost a full handshake.
+		// Tickets keep the session state on the client, so they cost us no memory per session.
+#if defined(MBEDTLS_SSL_TICKET_C)
+		if (ret == 0)
+		{
+			ret = mbedtls_ssl_ticket_setup(&config->ticket, Random, &config->drbg, MBEDTLS_CIPHER_AES_128_GCM, TicketLifetime);
+			if (ret == 0)
+			{
+				mbedtls_ssl_conf_session_tickets_cb(&config->conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &config->ticket);
+			}
+		}
+#endif
+#if defined(MBEDTLS_SSL_CACHE_C)
+		if (ret == 0)
+		{
+			mbedtls_ssl_cache_set_max_entries(&config->cache, MaxCachedSessions);
+			mbedtls_ssl_conf_session_cache(&config->conf, &config->cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+		}
+#endif
+
+		if (ret != 0)
+		{
+			debugPrintfAlways("TLS configuration failed: -0x%x\n", -ret);
+			Unconfigure();
+			ok = false;
+		}
+	}
+
+	delete[] certData;
+	delete[] keyData;
+
+	stale = false;
+	return ok;
+}
+
+/*static*/ void TlsSession::CredentialsChanged()
+{
+	Lock lock;
+	stale = true;
+	if (numSessions == 0)
+	{
+		Unconfigure();
+	}
+}
+
+/*static*/ void TlsSession::Unconfigure()
+{
+	if (config != nullptr)
+	{
+#if defined(MBEDTLS_SSL_CACHE_C)
+		mbedtls_ssl_cache_free(&config->cache);
+#endif
+#if defined(MBEDTLS_SSL_TICKET_C)
+		mbedtls_ssl_ticket_free(&config->ticket);
+#endif
+		mbedtls_ssl_config_free(&config->conf);
+		mbedtls_pk_free(&config->key);
+		mbedtls_x509_crt_free(&config->cert);
+		mbedtls_ctr_drbg_free(&config->drbg);
+		mbedtls_entropy_free(&config->entropy);
+		delete config;
+		config = nullptr;
+	}
+}
+
+// Sessions are used by the main task and the handshake task, so they share the random number generator through the lock
+/*static*/ int TlsSession::Random(void *ctx, unsigned char *output, size_t length)
+{
+	Lock lock;
+	return mbedtls_ctr_drbg_random(ctx, output, length);
+}
+
+// Allocate a session, setting up the configuration first if the credentials have changed since it was last used.
+// The handshake task is started when the first session is needed, so it costs no memory unless TLS is used.
+/*static*/ TlsSession *TlsSession::Allocate(struct netconn *conn)
+{
+	Lock lock;
+	if (numSessions >= MaxSessions || !Configure())
+	{
+		return nullptr;
+	}
+
+	if (handshakeTaskHdl == nullptr && xTaskCreate(HandshakeTask, "tlsHs", TLS_HANDSHAKE_STACK, NULL, TLS_HANDSHAKE_PRIO, &handshakeTaskHdl) != pdPASS)
+	{
+		handshakeTaskHdl = nullptr;
+		debugPrintAlways("can't start the TLS handshake task\n");
+		return nullptr;
+	}
+
+	TlsSession * const session = new (std::nothrow) TlsSession(conn);
+	if (session != nullptr)
+	{
+		++numSessions;
+		const int ret = mbedtls_ssl_setup(&session->ssl, &config->conf);
+		if (ret != 0)
+		{
+			debugPrintfAlways("TLS session setup failed: -0x%x\n", -ret);
+			Release(session);
+			return nullptr;
+		}
+		mbedtls_ssl_set_bio(&session->ssl, session, Send, Recv, nullptr);
+
+		for (size_t i = 0; i < MaxSessions; ++i)
+		{
+			if (sessions[i] == nullptr)
+			{
+				sessions[i] = session;
+				break;
+			}
+		}
+		xTaskNotifyGive(handshakeTaskHdl);
+	}
+	return session;
+}
+
+/*static*/ void TlsSession::Release(TlsSession *session)
+{
+	if (session != nullptr)
+	{
+		{
+			Lock lock;
+			for (size_t i = 0; i < MaxSessions; ++i)
+			{
+				if (sessions[i] == session)
+				{
+					sessions[i] = nullptr;
+				}
+			}
+		}
+
+		// The handshake task can't pick the session up again now, but it may be part way through a handshake step on it
+		if (session->phase == Phase::handshake)
+		{
+			xSemaphoreTake(handshakeMutex, portMAX_DELAY);
+			xSemaphoreGive(handshakeMutex);
+		}
+
+		Lock lock;
+		delete session;
+		--numSessions;
+		if (stale && numSessions == 0)
+		{
+			Unconfigure();
+		}
+	}
+}
+
+TlsSession::TlsSession(struct netconn *conn)
+	: conn(conn), received(nullptr), receivedIndex(0), unacknowledged(0), unsent(nullptr), unsentIndex(0), lastError(ERR_OK), phase(Phase::handshake)
+{
+	mbedtls_ssl_init(&ssl);
+}
+
+TlsSession::~TlsSession()
+{
+	mbedtls_ssl_free(&ssl);
+	if (received != nullptr)
+	{
+		pbuf_free(received);
+	}
+	if (unsent != nullptr)
+	{
+		pbuf_free(unsent);
+	}
+}
+
+void TlsSession::AddReceived(struct pbuf *p)
+{
+	if (received == nullptr)
+	{
+		received = p;
+		receivedIndex = 0;
+	}
+	else
+	{
+		pbuf_cat(received, p);
+	}
+}
+
+// Take what the client has sent and progress the handshake. Runs in the handshake task.
+// Returns true if the handshake needs more data from the client.
+bool TlsSession::Handshake()
+{
+	struct pbuf *data = nullptr;
+	err_t rc = netconn_recv_tcp_pbuf_flags(conn, &data, NETCONN_NOAUTORCVD);
+	while (rc == ERR_OK)
+	{
+		AddReceived(data);
+		data = nullptr;
+		rc = netconn_recv_tcp_pbuf_flags(conn, &data, NETCONN_NOAUTORCVD);
+	}
+
+	if (rc != ERR_WOULDBLOCK || Flush() != ERR_OK)
+	{
+		debugPrintf("TLS client went away during the handshake: %d\n", (int)rc);
+		phase = Phase::failed;
+		return false;
+	}
+
+	const int ret = mbedtls_ssl_handshake(&ssl);
+	if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+	{
+		return true;
+	}
+	if (ret != 0)
+	{
+		debugPrintfAlways("TLS handshake failed: -0x%x\n", -ret);
+		phase = Phase::failed;
+		return false;
+	}
+	phase = Phase::established;						// hand the session over to the main task
+	return false;
+}
+
+// The handshake involves a private key operation unless the client resumes a session, which takes long enough to
+// hold up SPI transfers if the main task did it. So we do it here at a lower priority, polling while any handshake needs more data.
+/*static*/ void TlsSession::HandshakeTask(void *p)
+{
+	bool waiting = false;
+	while (true)
+	{
+		ulTaskNotifyTake(pdTRUE, waiting ? pdMS_TO_TICKS(HandshakePollInterval) : portMAX_DELAY);
+
+		waiting = false;
+		for (size_t i = 0; i < MaxSessions; ++i)
+		{
+			TlsSession *session;
+			{
+				Lock lock;
+				session = sessions[i];
+				if (session == nullptr || session->phase != Phase::handshake)
+				{
+					continue;
+				}
+				xSemaphoreTake(handshakeMutex, portMAX_DELAY);		// Release waits for this before freeing the session
+			}
+
+			if (session->Handshake())
+			{
+				waiting = true;
+			}
+			xSemaphoreGive(handshakeMutex);
+		}
+	}
+}
+
+// Decrypt up to 'limit' bytes of received application data. Only the main task calls this, once the session is established.
+// Returns ERR_CLSD if the client has closed the session, or ERR_ABRT if the session has failed.
+err_t TlsSession::Receive(struct pbuf *&plain, size_t limit)
+{
+	plain = nullptr;
+
+	while (limit != 0)
+	{
+		const size_t chunk = std::min(limit, PlainChunkSize);
+		struct pbuf * const p = pbuf_alloc(PBUF_RAW, chunk, PBUF_RAM);
+		if (p == nullptr)
+		{
+			break;								// try again on the next poll
+		}
+
+		const int ret = mbedtls_ssl_read(&ssl, static_cast<unsigned char*>(p->payload), chunk);
+		if (ret > 0)
+		{
+			pbuf_realloc(p, ret);
+			if (plain == nullptr)
+			{
+				plain = p;
+			}
+			else
+			{
+				pbuf_cat(plain, p);
+			}
+			limit -= ret;
+			continue;
+		}
+
+		pbuf_free(p);
+		if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+		{
+			break;
+		}
+		if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+		{
+			return ERR_CLSD;
+		}
+		debugPrintfAlways("TLS read failed: -0x%x\n", -ret);
+		return ERR_ABRT;
+	}
+
+	return ERR_OK;
+}
+
+// Encrypt and send all the data. This never waits for the other end: the Send callback keeps whatever the TCP send buffer
+// can't take, and CanWrite reports no space until Flush has sent it, so the Duet main processor gets a partial write instead.
+err_t TlsSession::Write(const uint8_t *data, size_t length)
+{
+	if (length != 0 && phase != Phase::established)
+	{
+		return ERR_CONN;
+	}
+
+	size_t total = 0;
+	while (total < length)
+	{
+		const int ret = mbedtls_ssl_write(&ssl, data + total, length - total);
+		if (ret <= 0)
+		{
+			return (lastError != ERR_OK) ? lastError : ERR_ABRT;
+		}
+		total += ret;
+	}
+	return ERR_OK;
+}
+
+err_t TlsSession::Flush()
+{
+	while (unsent != nullptr)
+	{
+		size_t written = 0;
+		const err_t rc = netconn_write_partly(conn, static_cast<const uint8_t*>(unsent->payload) + unsentIndex, unsent->len - unsentIndex, NETCONN_COPY, &written);
+		if (rc != ERR_OK && rc != ERR_WOULDBLOCK)
+		{
+			return rc;
+		}
+
+		unsentIndex += written;
+		if (unsentIndex < unsent->len)
+		{
+			break;								// the TCP send buffer is full
+		}
+
+		struct pbuf * const pb = unsent;
+		unsent = pb->next;
+		pb->next = nullptr;
+		pbuf_free(pb);
+		unsentIndex = 0;
+	}
+	return ERR_OK;
+}
+
+// Return how much plain text we can accept, given the space in the TCP send buffer
+size_t TlsSession::CanWrite(size_t networkSpace) const
+{
+	if (phase != Phase::established || unsent != nullptr)
+	{
+		return 0;
+	}
+	const int expansion = mbedtls_ssl_get_record_expansion(&ssl);
+	return (expansion >= 0 && networkSpace > (size_t)expansion) ? networkSpace - expansion : 0;
+}
+
+void TlsSession::CloseNotify()
+{
+	if (phase == Phase::established)
+	{
+		(void)mbedtls_ssl_close_notify(&ssl);
+	}
+}
+
+// mbedTLS callback to send encrypted data. What the TCP send buffer can't take is kept to be sent by Flush.
+/*static*/ int TlsSession::Send(void *ctx, const unsigned char *buf, size_t len)
+{
+	TlsSession * const session = static_cast<TlsSession*>(ctx);
+	size_t written = 0;
+	if (session->unsent == nullptr)
+	{
+		const err_t rc = netconn_write_partly(session->conn, buf, len, NETCONN_COPY, &written);
+		if (rc != ERR_OK && rc != ERR_WOULDBLOCK)
+		{
+			session->lastError = rc;
+			return MBEDTLS_ERR_NET_SEND_FAILED;
+		}
+	}
+
+	if (written < len)
+	{
+		struct pbuf * const p = pbuf_alloc(PBUF_RAW, len - written, PBUF_RAM);
+		if (p == nullptr)
+		{
+			session->lastError = ERR_MEM;
+			return MBEDTLS_ERR_NET_SEND_FAILED;
+		}
+		memcpy(p->payload, buf + written, len - written);
+		if (session->unsent == nullptr)
+		{
+			session->unsent = p;
+			session->unsentIndex = 0;
+		}
+		else
+		{
+			pbuf_cat(session->unsent, p);
+		}
+	}
+	return (int)len;
+}
+
+// mbedTLS callback to take received encrypted data. The TCP window is opened as the data is taken.
+/*static*/ int TlsSession::Recv(void *ctx, unsigned char *buf, size_t len)
+{
+	TlsSession * const session = static_cast<TlsSession*>(ctx);
+	size_t lengthRead = 0;
+	while (session->received != nullptr && lengthRead < len)
+	{
+		struct pbuf * const pb = session->received;
+		const size_t toRead = std::min<size_t>(pb->len - session->receivedIndex, len - lengthRead);
+		memcpy(buf + lengthRead, static_cast<const uint8_t*>(pb->payload) + session->receivedIndex, toRead);
+		lengthRead += toRead;
+		session->receivedIndex += toRead;
+		if (session->receivedIndex == pb->len)
+		{
+			session->received = pb->next;
+			pb->next = nullptr;
+			pbuf_free(pb);
+			session->receivedIndex = 0;
+		}
+	}
+
+	if (lengthRead == 0)
+	{
+		return MBEDTLS_ERR_SSL_WANT_READ;
+	}
+
+	session->unacknowledged += lengthRead;
+	if (session->received == nullptr || session->unacknowledged >= TCP_MSS)
+	{
+		netconn_tcp_recvd(session->conn, session->unacknowledged);
+		session->unacknowledged = 0;
+	}
+	return lengthRead;
+}
+
+// Static data
+SemaphoreHandle_t TlsSession::mutex = nullptr;
+SemaphoreHandle_t TlsSession::handshakeMutex = nullptr;
+TaskHandle_t TlsSession::handshakeTaskHdl = nullptr;
+TlsSession *TlsSession::sessions[MaxSessions] = { nullptr };
+size_t TlsSession::numSessions = 0;
+bool TlsSession::stale = false;
+
+#endif
+
+// End
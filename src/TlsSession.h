@@ -0,0 +1,98 @@
+/*
+ * TlsSession.h
+ *
+ * Server side TLS for connections accepted by secure listeners. The ESP terminates TLS,
+ * so the Duet main processor only ever sees the plain text.
+ */
+
+#ifndef SRC_TLSSESSION_H_
+#define SRC_TLSSESSION_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "lwip/api.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "Config.h"
+
+#if SUPPORT_TLS
+
+#include "mbedtls/ssl.h"
+
+class TlsSession
+{
+public:
+	static constexpr size_t MaxSessions = 3;			// concurrent TLS sessions, each needs several KB of heap
+
+	static void Init();
+	static bool Configure();							// load the credentials and set up the shared configuration
+	static void CredentialsChanged();					// reload the credentials once no session is using them
+
+	static TlsSession *Allocate(struct netconn *conn);
+	static void Release(TlsSession *session);
+
+	// The handshake task owns a new session until its handshake has finished, so the main task must leave it alone until then
+	bool IsEstablished() const { return phase == Phase::established; }
+	bool HasFailed() const { return phase == Phase::failed; }
+
+	void AddReceived(struct pbuf *p);					// queue encrypted data received from the network
+	err_t Receive(struct pbuf *&plain, size_t limit);	// decrypt up to 'limit' bytes
+	err_t Write(const uint8_t *data, size_t length);
+	err_t Flush();										// send encrypted data that the TCP send buffer couldn't take before
+	bool HasUnsent() const { return unsent != nullptr; }
+	size_t CanWrite(size_t networkSpace) const;
+	void CloseNotify();									// queue the close_notify alert, Flush sends it
+
+private:
+	enum class Phase : uint8_t
+	{
+		handshake,				// the handshake task is negotiating the session
+		established,			// the handshake has completed and the main task may use the session
+		failed					// the handshake failed or the client went away during it
+	};
+
+	// The shared configuration and session list are used by the main task, the connection task and the handshake task
+	class Lock
+	{
+	public:
+		Lock() { xSemaphoreTakeRecursive(mutex, portMAX_DELAY); }
+		~Lock() { xSemaphoreGiveRecursive(mutex); }
+	};
+
+	TlsSession(struct netconn *conn);
+	~TlsSession();
+
+	static int Send(void *ctx, const unsigned char *buf, size_t len);
+	static int Recv(void *ctx, unsigned char *buf, size_t len);
+
+	static void Unconfigure();
+	static int Random(void *ctx, unsigned char *output, size_t length);
+	static void HandshakeTask(void *p);
+
+	bool Handshake();
+
+	mbedtls_ssl_context ssl;
+	struct netconn *conn;
+
+	struct pbuf *received;			// encrypted data not yet taken by mbedTLS
+	size_t receivedIndex;			// how much of the first pbuf has been taken
+	size_t unacknowledged;			// how much data has been taken but not yet reported to LWIP
+	struct pbuf *unsent;			// encrypted data waiting for space in the TCP send buffer
+	size_t unsentIndex;				// how much of the first pbuf has been sent
+	err_t lastError;				// the error from the last failed network write
+	volatile Phase phase;
+
+	static SemaphoreHandle_t mutex;
+	static SemaphoreHandle_t handshakeMutex;	// held by the handshake task while it works on a session
+	static TaskHandle_t handshakeTaskHdl;
+	static TlsSession *sessions[MaxSessions];
+	static size_t numSessions;
+	static bool stale;
+};
+
+#endif
+
+#endif /* SRC_TLSSESSION_H_ */
@@ -0,0 +1,131 @@
+/*
+ * WebSocket.cpp
+ *
+ * WebSocket (RFC 6455) handshake and frame header handling.
+ */
+
+#include <cstring>
+
+#include "mbedtls/version.h"
+#include "mbedtls/sha1.h"
+#include "mbedtls/base64.h"
+
+#include "WebSocket.h"
+
+static const char * const AcceptGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const size_t MaxKeyLength = 32;				// a valid key is 24 characters of base64
+
+bool WebSocketAcceptKey(const char *key, char *accept)
+{
+	const size_t keyLength = strlen(key);
+	if (keyLength == 0 || keyLength > MaxKeyLength)
+	{
+		return false;
+	}
+
+	char buf[MaxKeyLength + 36 + 1];
+	memcpy(buf, key, keyLength);
+	strcpy(buf + keyLength, AcceptGuid);
+
+	uint8_t hash[20];
+#if MBEDTLS_VERSION_NUMBER >= 0x03000000
+	if (mbedtls_sha1(reinterpret_cast<const unsigned char*>(buf), strlen(buf), hash) != 0)
+#else
+	if (mbedtls_sha1_ret(reinterpret_cast<const unsigned char*>(buf), strlen(buf), hash) != 0)
+#endif
+	{
+		return false;
+	}
+
+	size_t length;
+	return mbedtls_base64_encode(reinterpret_cast<unsigned char*>(accept), WsAcceptKeyLength + 1, &length, hash, sizeof(hash)) == 0;
+}
+
+size_t WebSocketParseHeader(const struct pbuf *p, size_t offset, WebSocketFrameHeader& frame)
+{
+	uint8_t hdr[WsMaxFrameHeaderLength];
+	const size_t available = pbuf_copy_partial(p, hdr, sizeof(hdr), offset);
+	if (available < 2)
+	{
+		return 0;
+	}
+
+	frame.final = (hdr[0] & 0x80) != 0;
+	frame.reserved = (hdr[0] & 0x70) != 0;
+	frame.opcode = hdr[0] & 0x0F;
+	frame.masked = (hdr[1] & 0x80) != 0;
+
+	size_t length = 2;
+	const uint8_t shortLength = hdr[1] & 0x7F;
+	if (shortLength == 126)
+	{
+		length += 2;
+	}
+	else if (shortLength == 127)
+	{
+		length += 8;
+	}
+
+	const size_t total = length + ((frame.masked) ? 4 : 0);
+	if (available < total)
+	{
+		return 0;
+	}
+
+	if (shortLength < 126)
+	{
+		frame.length = shortLength;
+	}
+	else
+	{
+		frame.length = 0;
+		for (size_t i = 2; i < length; ++i)
+		{
+			frame.length = (frame.length << 8) | hdr[i];
+		}
+	}
+
+	if (frame.masked)
+	{
+		memcpy(frame.mask, hdr + length, sizeof(frame.mask));
+	}
+	return total;
+}
+
+size_t WebSocketBuildHeader(uint8_t *buf, uint8_t opcode, bool final, size_t length)
+{
+	buf[0] = ((final) ? 0x80 : 0) | (opcode & 0x0F);
+	if (length < 126)
+	{
+		buf[1] = length;
+		return 2;
+	}
+	if (length <= 0xFFFF)
+	{
+		buf[1] = 126;
+		buf[2] = length >> 8;
+		buf[3] = length;
+		return 4;
+	}
+
+	buf[1] = 127;
+	uint64_t len = length;
+	for (size_t i = 9; i >= 2; --i)
+	{
+		buf[i] = len;
+		len >>= 8;
+	}
+	return 10;
+}
+
+size_t WebSocketUnmask(uint8_t *data, size_t length, const uint8_t mask[4], size_t index)
+{
+	for (size_t i = 0; i < length; ++i)
+	{
+		data[i] ^= mask[index];
+		index = (index + 1) & 3;
+	}
+	return index;
+}
+
+// End
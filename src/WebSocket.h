@@ -0,0 +1,55 @@
+/*
+ * WebSocket.h
+ *
+ * WebSocket (RFC 6455) handshake and frame header handling, so that connections
+ * can exchange bare message payloads with the Duet main processor.
+ */
+
+#ifndef SRC_WEBSOCKET_H_
+#define SRC_WEBSOCKET_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "lwip/pbuf.h"
+
+// Frame opcodes
+static constexpr uint8_t WsOpcodeContinuation = 0x0;
+static constexpr uint8_t WsOpcodeText = 0x1;
+static constexpr uint8_t WsOpcodeBinary = 0x2;
+static constexpr uint8_t WsOpcodeClose = 0x8;
+static constexpr uint8_t WsOpcodePing = 0x9;
+static constexpr uint8_t WsOpcodePong = 0xA;
+
+// Close status codes
+static constexpr uint16_t WsCloseNormal = 1000;
+static constexpr uint16_t WsCloseProtocolError = 1002;
+static constexpr uint16_t WsCloseTooBig = 1009;
+
+static constexpr size_t WsAcceptKeyLength = 28;				// base64 of a SHA-1 hash
+static constexpr size_t WsMaxFrameHeaderLength = 14;
+static constexpr size_t WsMaxControlPayload = 125;
+
+struct WebSocketFrameHeader
+{
+	uint64_t length;				// payload length
+	uint8_t mask[4];
+	uint8_t opcode;
+	bool final;
+	bool masked;
+	bool reserved;					// true if any of the reserved bits are set
+};
+
+// Compute the Sec-WebSocket-Accept value for a Sec-WebSocket-Key. 'accept' must have room for WsAcceptKeyLength plus a null terminator.
+bool WebSocketAcceptKey(const char *key, char *accept);
+
+// Parse the frame header that starts at 'offset'. Returns its length, or 0 if it has not been completely received yet.
+size_t WebSocketParseHeader(const struct pbuf *p, size_t offset, WebSocketFrameHeader& frame);
+
+// Build an unmasked frame header as sent by a server and return its length. 'buf' must have room for WsMaxFrameHeaderLength bytes.
+size_t WebSocketBuildHeader(uint8_t *buf, uint8_t opcode, bool final, size_t length);
+
+// Apply or remove the masking of payload bytes, starting at position 'index' in the masking key. Returns the updated index.
+size_t WebSocketUnmask(uint8_t *data, size_t length, const uint8_t mask[4], size_t index);
+
+#endif /* SRC_WEBSOCKET_H_ */
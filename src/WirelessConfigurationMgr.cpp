@@ -1,9 +1,12 @@
 #include "WirelessConfigurationMgr.h"
 
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <new>
+#include <algorithm>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 #include <sys/unistd.h>
 #include "nvs_flash.h"
 #include "esp_spiffs.h"
@@ -135,7 +138,7 @@ static uint8_t* GetAnyOldConfigData()
 		}
 	}
 	// no valid data found
-	delete oldData;
+	delete[] oldData;
 	return nullptr;
 }
 
@@ -156,28 +159,17 @@ void WirelessConfigurationMgr::Init()
 	// for enterprise network credentials. Credentials stored in the KVS are copied to this
 	// partition before being passed to ESP WPA2 enterprise APIs.
 	//
-	// The key-value storage partition uses SPIFFS. It is used to store wireless configuration data,
-	// the credentials, and some other bits and pieces. There are three main 'directories':
-	// 		- ssids - stores wireless configuration data, with key/path 'ssids/xx' where xx is the ssid slot
-	// 		- creds - stores credential for a particular wireless config data stored in 'ssids', with key/path
+	// The key-value storage partition holds a log-structured key-value store (see KvStore). It is used to store
+	// wireless configuration data, the credentials, and some other bits and pieces. The keys are in three main groups:
+	// 		- ssids - stores wireless configuration data, with key 'ssids/xx' where xx is the ssid slot
+	// 		- creds - stores credential for a particular wireless config data stored in 'ssids', with key
 	// 					'creds/xx/yy', where xx is the ssid slot, yy is the credential index
-	// 		- scratch - stores some values related to the scratch partition, with key/path 'scratch/ss' where
+	// 		- scratch - stores some values related to the scratch partition, with key 'scratch/ss' where
 	// 					ss is the string id
 	//
-	uint8_t* oldConfigData = GetAnyOldConfigData();
-
-	esp_vfs_spiffs_conf_t conf = {
-		.base_path = KVS_PATH,
-		.partition_label = NULL,
-		.max_files = 1,
-		.format_if_mount_failed = true
-	};
-
-	esp_err_t err = esp_vfs_spiffs_register(&conf);
-	if (err != ESP_OK)
-	{
-		debugPrintf("spiffs register returns %x\n", err);
-	}
+	// Clean-up that can wait until the SAM is able to talk to us is left to Check.
+	ClearSsidIndex();
+	mutex = xSemaphoreCreateRecursiveMutex();
 
 	// Memory map the partition, remembering the base pointer for the lifetime of the app.
 	spi_flash_mmap_handle_t mapHandle;
@@ -186,7 +178,59 @@ void WirelessConfigurationMgr::Init()
 	esp_partition_mmap(scratchPartition, 0, scratchPartition->size, SPI_FLASH_MMAP_DATA,
 						reinterpret_cast<const void**>(&scratchBase), &mapHandle);
 
+	// Earlier versions kept the keys as files in a SPIFFS file system on the same partition. These are staged
+	// in the scratch partition before the store is formatted and copied into the store from there, so that
+	// none are lost if the power fails part way through.
+	const esp_partition_t* kvsPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, "kvs");
+	uint8_t *buff = static_cast<uint8_t*>(calloc(MaxCredentialChunkSize, 1));
+	uint8_t* oldConfigData = nullptr;
+
+	const KvStore::InitResult kvsStatus = kvs.Init(kvsPartition);
+	if (kvsStatus == KvStore::InitResult::error)
+	{
+		// The partition may hold a store that we couldn't load, so don't format it. Do without stored keys until the next start.
+		debugPrintAlways("can't load the key-value store\n");
+		kvs.Init(nullptr);
+		free(buff);
+		memset(&credentialCache, 0, sizeof(credentialCache));
+		return;
+	}
+
+	if (kvsStatus == KvStore::InitResult::notAStore)
+	{
+		// Credentials from the 1.x firmware are only looked for before the store is set up, since
+		// the store is formatted and the old storage area cleared when they are found.
+		oldConfigData = GetAnyOldConfigData();
+
+		// If the keys were staged before, formatting the store may already have wiped the file system.
+		// Otherwise it is only formatted once they have all been staged, so that none are lost.
+		if (!(HasStagedKeys(buff) || StageSpiffsKeys(buff)) || !kvs.Format())
+		{
+			// Leave the keys where they are for the next start, with no networks remembered until then.
+			// The store is detached from the partition, so that nothing can be written over them.
+			debugPrintAlways("can't migrate the stored keys\n");
+			kvs.Init(nullptr);
+			free(buff);
+			delete[] oldConfigData;
+			memset(&credentialCache, 0, sizeof(credentialCache));
+			return;
+		}
+	}
+
+	if (HasStagedKeys(buff) && LoadStagedKeys(buff))
+	{
+		ResetScratch();
+	}
+
+	free(buff);
+
+	// Load the index of the credentials cached in the scratch partition
 	char key[MAX_KEY_LEN] = { 0 };
+	if (GetKVSize(GetScratchKey(key, CREDENTIAL_CACHE_ID)) != sizeof(credentialCache) ||
+		!GetKV(key, &credentialCache, sizeof(credentialCache)))
+	{
+		RebuildCredentialCache();
+	}
 
 	// Check if first time and the storage should be initialized. The marker here is SSID slot 0,
 	// since WirelessConfigurationMgr::Reset works it's way backwards to it.
@@ -210,27 +254,36 @@ void WirelessConfigurationMgr::Init()
 				}
 			}
 			debugPrintf("restored %d old SSIDs...\n", oldSsidCnt);
-			delete oldConfigData;
+			delete[] oldConfigData;
 		}
 	}
 
-#ifndef ESP8266
-	err = esp_spiffs_check(NULL);
-	if (err != ESP_OK)
+	// Build the SSID index and table from the stored slots.
+	ClearSsidIndex();
+	for (int ssid = MaxRememberedNetworks; ssid >= 0; ssid--)
 	{
-		debugPrintf("spiffs check returns %x\n", err);
+		WirelessConfigurationData temp;
+		if (GetSsid(ssid, temp))
+		{
+			UpdateSsidIndex(ssid, temp);
+		}
 	}
-#endif
+}
+
+// Checks of the storage that are done by a background task once the SAM is able to talk to us.
+void WirelessConfigurationMgr::Check()
+{
+	Lock lock(mutex);
 
 	// Storing an enterprise SSID and its credentials might not have
 	// gone all the way. Since credentials are stored first before the
 	// SSID data, if credentials are incompletely stored due to a power loss,
 	// we can detect and clean up those orphaned credentials here.
-	for (int ssid = MaxRememberedNetworks; ssid > 0; ssid--)
+	for (int ssid = MaxRememberedNetworks; ssid > AP; ssid--)
 	{
-		WirelessConfigurationData temp;
-		if ((GetSsid(ssid, temp) && IsSsidBlank(temp)))
+		if (!(ssidsUsed & (1u << ssid)) && (!pendingSsid || pendingSsid->ssid != ssid))
 		{
+			ResetIfCredentialsLoaded(ssid);
 			DeleteCredentials(ssid);
 		}
 	}
@@ -239,9 +292,10 @@ void WirelessConfigurationMgr::Init()
 
 void WirelessConfigurationMgr::Reset(bool format)
 {
+	Lock lock(mutex);
 	if (format)
 	{
-		esp_spiffs_format(NULL);
+		kvs.Format();
 
 #if ESP8266
 		debugPrint("erasing old flash memory area\n");
@@ -265,6 +319,10 @@ void WirelessConfigurationMgr::Reset(bool format)
 	// the KVS has been initialized for the first time.
 	ResetScratch();
 
+	char key[MAX_KEY_LEN] = { 0 };
+	DeleteKV(GetTlsKey(key, TlsCredential::CERTIFICATE));
+	DeleteKV(GetTlsKey(key, TlsCredential::PRIVATE_KEY));
+
 	for (int ssid = MaxRememberedNetworks; ssid >= 0; ssid--)
 	{
 		// Erase the SSID first, then the credentials. This is because if
@@ -277,6 +335,7 @@ void WirelessConfigurationMgr::Reset(bool format)
 
 int WirelessConfigurationMgr::SetSsid(const WirelessConfigurationData& data, bool ap = false)
 {
+	Lock lock(mutex);
 	WirelessConfigurationData temp;
 	memset(&temp, 0, sizeof(temp));
 
@@ -292,6 +351,12 @@ int WirelessConfigurationMgr::SetSsid(const WirelessConfigurationData& data, boo
 			if (ssid == WirelessConfigurationMgr::AP) { // reserved for AP details
 				ssid = -1;
 			}
+			else if (ssid > 0)
+			{
+				// In case an earlier SSID in the slot was erased without forgetting its access point
+				char key[MAX_KEY_LEN] = { 0 };
+				DeleteKV(GetAccessPointKey(key, ssid));
+			}
 		}
 	}
 
@@ -317,6 +382,15 @@ bool WirelessConfigurationMgr::EraseSsid(int ssid)
 {
 	if (ResetIfCredentialsLoaded(ssid))
 	{
+		// The access point is forgotten first, so that it is never left behind for another SSID in the slot
+		char key[MAX_KEY_LEN] = { 0 };
+		int32_t last = -1;
+		DeleteKV(GetAccessPointKey(key, ssid));
+		if (GetKV(LAST_AP_KEY, &last, sizeof(last)) && last == ssid)
+		{
+			DeleteKV(LAST_AP_KEY);
+		}
+
 		if (EraseSsidData(ssid))
 		{
 			return true;
@@ -328,24 +402,30 @@ bool WirelessConfigurationMgr::EraseSsid(int ssid)
 
 bool WirelessConfigurationMgr::EraseSsid(const char *ssid)
 {
+	Lock lock(mutex);
 	WirelessConfigurationData temp;
 	return EraseSsid(GetSsid(ssid, temp));
 }
 
 bool WirelessConfigurationMgr::GetSsid(int ssid, WirelessConfigurationData& data) const
 {
+	Lock lock(mutex);
 	char key[MAX_KEY_LEN] = { 0 };
 	return GetKV(GetSsidKey(key, ssid), &data, sizeof(data));
 }
 
 int WirelessConfigurationMgr::GetSsid(const char *ssid, WirelessConfigurationData& data) const
 {
+	Lock lock(mutex);
 	if (ssid)
 	{
+		// Only read the slots whose hash matches, since hashes can collide
+		const uint32_t hash = HashSsid(ssid);
 		for (int i = MaxRememberedNetworks; i >= 0; i--)
 		{
 			WirelessConfigurationData temp;
-			if (GetSsid(i, temp) && strncmp(ssid, temp.ssid, sizeof(temp.ssid)) == 0)
+			if ((ssidsUsed & (1u << i)) && ssidHashes[i] == hash
+				&& GetSsid(i, temp) && strncmp(ssid, temp.ssid, sizeof(temp.ssid)) == 0)
 			{
 				data = temp;
 				return i;
@@ -355,21 +435,24 @@ int WirelessConfigurationMgr::GetSsid(const char *ssid, WirelessConfigurationDat
 	return -1;
 }
 
+const uint8_t* WirelessConfigurationMgr::GetSsidTable(size_t& length) const
+{
+	length = ssidTableLength;
+	return ssidTable;
+}
+
 bool WirelessConfigurationMgr::BeginEnterpriseSsid(const WirelessConfigurationData &data)
 {
+	Lock lock(mutex);
 	// Personal network assumed unless otherwise stated. PSK is indicated by WirelessConfigurationData::eap.protocol == 1,
 	// which is the null terminator for the pre-shared key. Enforce that here.
 	static_assert(offsetof(WirelessConfigurationData, eap.protocol) ==
 					offsetof(WirelessConfigurationData,
 							password[sizeof(data.password) - sizeof(data.eap.protocol)]));
 
-	// Check if the credentials will fit
-	size_t total = 0;
-
-	for (uint32_t sz : data.eap.credSizes.asArr)
-	{
-		total += sz;
-	}
+	// Check if the credentials will fit. They are written straight into the scratch partition, and only
+	// copied to the key-value store when that space is needed for the credentials of another SSID.
+	const size_t total = GetTotalSize(data.eap.credSizes);
 
 	if (total < GetFree() && total < scratchPartition->size)
 	{
@@ -383,14 +466,23 @@ bool WirelessConfigurationMgr::BeginEnterpriseSsid(const WirelessConfigurationDa
 
 		if (ssid > 0)
 		{
-			if (EraseSsid(ssid))
+			if (EraseSsid(ssid) && DeleteCredentials(ssid))
 			{
-				pendingSsid = static_cast<PendingEnterpriseSsid*>(calloc(1, sizeof(PendingEnterpriseSsid)));
-				if (pendingSsid)
+				uint8_t *buff = static_cast<uint8_t*>(calloc(MaxCredentialChunkSize, 1));
+				uint32_t base = 0;
+				bool ok = buff && AllocateScratch(round2SecSz(total), base, buff);
+				free(buff);
+
+				if (ok)
 				{
-					pendingSsid->data = data;
-					pendingSsid->ssid = ssid;
-					return true;
+					pendingSsid = static_cast<PendingEnterpriseSsid*>(calloc(1, sizeof(PendingEnterpriseSsid)));
+					if (pendingSsid)
+					{
+						pendingSsid->data = data;
+						pendingSsid->ssid = ssid;
+						pendingSsid->base = base;
+						return true;
+					}
 				}
 			}
 		}
@@ -401,15 +493,23 @@ bool WirelessConfigurationMgr::BeginEnterpriseSsid(const WirelessConfigurationDa
 
 bool WirelessConfigurationMgr::SetEnterpriseCredential(int cred, const void* buff, size_t size)
 {
-	if (pendingSsid)
+	Lock lock(mutex);
+	if (pendingSsid && cred >= 0 && cred < ARRAY_SIZE(pendingSsid->sizes.asArr))
 	{
 		size_t newSize = pendingSsid->sizes.asArr[cred] + size;
 
 		if (newSize <= pendingSsid->data.eap.credSizes.asArr[cred])
 		{
-			char key[MAX_KEY_LEN] = { 0 };
-			if (SetKV(GetCredentialKey(key, pendingSsid->ssid, cred), buff, size, pendingSsid->sizes.asArr[cred]))
+			// The credentials are laid out one after the other in the scratch region
+			size_t offset = pendingSsid->base + pendingSsid->sizes.asArr[cred];
+			for (int i = 0; i < cred; i++)
+			{
+				offset += pendingSsid->data.eap.credSizes.asArr[i];
+			}
+
+			if (esp_partition_write(scratchPartition, offset, buff, size) == ESP_OK)
 			{
+				pendingSsid->crcs.asArr[cred] = KvStore::Crc32(pendingSsid->crcs.asArr[cred], buff, size);
 				pendingSsid->sizes.asArr[cred] = newSize;
 				return true;
 			}
@@ -421,37 +521,48 @@ bool WirelessConfigurationMgr::SetEnterpriseCredential(int cred, const void* buf
 
 bool WirelessConfigurationMgr::EndEnterpriseSsid(bool cancel)
 {
+	Lock lock(mutex);
 	bool ok = cancel;
 
 	if (pendingSsid)
 	{
-		if (cancel)
-		{
-			DeleteCredentials(pendingSsid->ssid);
-		}
-		else
+		// On cancel there is nothing to clean up, since the scratch region isn't in the cache index
+		if (!cancel)
 		{
 			// Make sure that the sizes sent at the beginning matches
-			// what we have received.
-			ok = true;
+			// what we have received, and that the credentials read back
+			// from the scratch partition match what we have received.
+			uint8_t *buff = static_cast<uint8_t*>(calloc(MaxCredentialChunkSize, 1));
+			ok = (buff != nullptr);
 
-			for (int cred = 0; ok && cred < ARRAY_SIZE(pendingSsid->sizes.asArr); cred++)
+			for (int cred = 0, offset = pendingSsid->base; ok && cred < ARRAY_SIZE(pendingSsid->sizes.asArr); cred++)
 			{
 				ok = ((pendingSsid->data.eap.credSizes.asArr[cred] == pendingSsid->sizes.asArr[cred]));
 
-				if (ok && !pendingSsid->sizes.asArr[cred])
+				uint32_t crc = 0;
+				for (int pos = 0, sz = 0; ok && pos < pendingSsid->sizes.asArr[cred]; pos += sz)
 				{
-					ok = DeleteCredential(pendingSsid->ssid, cred);
+					sz = std::min<size_t>(pendingSsid->sizes.asArr[cred] - pos, MaxCredentialChunkSize);
+					ok = (esp_partition_read(scratchPartition, offset + pos, buff, sz) == ESP_OK);
+					crc = KvStore::Crc32(crc, buff, sz);
 				}
+
+				ok = ok && (crc == pendingSsid->crcs.asArr[cred]);
+				offset += pendingSsid->sizes.asArr[cred];
 			}
 
+			// Commit the credentials before the SSID, so that an SSID is never stored without them
 			if (ok)
 			{
-				ok = SetSsidData(pendingSsid->ssid, pendingSsid->data);
+				ok = AddCachedCredentials(pendingSsid->ssid, pendingSsid->base,
+						round2SecSz(GetTotalSize(pendingSsid->sizes)), buff);
 			}
-			else
+
+			free(buff);
+
+			if (ok)
 			{
-				DeleteCredentials(pendingSsid->ssid);
+				ok = SetSsidData(pendingSsid->ssid, pendingSsid->data);
 			}
 		}
 
@@ -464,160 +575,409 @@ bool WirelessConfigurationMgr::EndEnterpriseSsid(bool cancel)
 
 const uint8_t* WirelessConfigurationMgr::GetEnterpriseCredentials(int ssid, const CredentialsInfo& sizes, CredentialsInfo& offsets)
 {
+	Lock lock(mutex);
 	const uint8_t *res = nullptr;
 
-	// Check that all information needed for the proceeding operations can
-	// be retrieved.
-	uint32_t loadedSsid = 0, baseOffset = 0;
+	// Store offsets from the base offset
+	for (int cred = 0, offset = 0; cred < ARRAY_SIZE(offsets.asArr); cred++)
+	{
+		offsets.asArr[cred] = offset;
+		offset += sizes.asArr[cred];
+	}
+
+	// If the credentials are in the cache, just return the existing pointer. The use is only
+	// recorded in RAM, and stored the next time the cache index changes.
+	const int cached = FindCachedCredentials(ssid);
+	if (cached >= 0)
+	{
+		credentialCache.entries[cached].lastUsed = ++credentialCache.useCount;
+		return scratchBase + credentialCache.entries[cached].offset;
+	}
+
+	// Erasing the flash storage has to be in multiples of SPI_FLASH_SEC_SZ.
+	const size_t totalSize = round2SecSz(GetTotalSize(sizes));
 
 	char key[MAX_KEY_LEN] = { 0 };
+	uint8_t *buff = static_cast<uint8_t*>(calloc(MaxCredentialChunkSize, 1));
+	uint32_t base = 0;
+	bool ok = buff && AllocateScratch(totalSize, base, buff);
 
-	if (GetKV(GetScratchKey(key, LOADED_SSID_ID), &loadedSsid, sizeof(loadedSsid)) &&
-		GetKV(GetScratchKey(key, SCRATCH_OFFSET_ID), &baseOffset, sizeof(baseOffset)))
+	for (int cred = 0; ok && cred < ARRAY_SIZE(offsets.asArr); cred++)
 	{
-		// Get the total size of credentials
-		size_t totalSize = 0;
+		for (int sz = 0, pos = 0, remain = sizes.asArr[cred];
+			ok && remain > 0; remain -= sz, pos += sz)
+		{
+			sz = (remain >= MaxCredentialChunkSize) ? MaxCredentialChunkSize : remain;
+			ok = GetKV(GetCredentialKey(key, ssid, cred), buff, sz, pos);
 
-		for (uint32_t sz: sizes.asArr)
+			if (ok)
+			{
+				ok = (esp_partition_write(scratchPartition, base + offsets.asArr[cred] + pos, buff, sz) == ESP_OK);
+			}
+		}
+	}
+
+	if (ok && AddCachedCredentials(ssid, base, totalSize, buff))
+	{
+		res = scratchBase + base;
+	}
+
+	free(buff);
+	return res;
+}
+
+int WirelessConfigurationMgr::FindCachedCredentials(int ssid) const
+{
+	for (int i = 0; i < MAX_CACHED_CREDENTIALS; i++)
+	{
+		if (ssid > 0 && credentialCache.entries[i].ssid == ssid)
 		{
-			totalSize += sz;
+			return i;
 		}
+	}
 
-		// Erasing the flash storage has to be in multiples of SPI_FLASH_SEC_SZ.
-		totalSize = round2SecSz(totalSize);
+	return -1;
+}
 
-		// If the SSID has already been loaded, just return the existing pointer
-		// and compute offsets.asMemb. If not, load it in the scratch partition.
-		if (loadedSsid == ssid)
+// Return true if a region of the scratch partition is inside it and not used by cached credentials,
+// or by the credentials of the enterprise SSID being stored
+bool WirelessConfigurationMgr::IsScratchRegionFree(uint32_t start, size_t size) const
+{
+	if (start + size > scratchPartition->size)
+	{
+		return false;
+	}
+
+	for (const CachedCredentials& entry : credentialCache.entries)
+	{
+		if (entry.ssid && start < entry.offset + entry.size && entry.offset < start + size)
 		{
-			for(int cred = 0, offset = 0; cred < ARRAY_SIZE(offsets.asArr); cred++)
-			{
-				offsets.asArr[cred] = offset;
-				offset += sizes.asArr[cred];
-			}
+			return false;
+		}
+	}
 
-			res = (scratchBase + baseOffset - totalSize);
+	if (pendingSsid)
+	{
+		const uint32_t pendingSize = round2SecSz(GetTotalSize(pendingSsid->data.eap.credSizes));
+		if (start < pendingSsid->base + pendingSize && pendingSsid->base < start + size)
+		{
+			return false;
 		}
-		else
+	}
+
+	return true;
+}
+
+// Find a free region of the scratch partition that starts at the beginning or after some
+// cached credentials. Regions from the end of the one allocated last are tried first, so that
+// use moves around the partition.
+bool WirelessConfigurationMgr::FindScratchRegion(size_t size, uint32_t& base) const
+{
+	bool found = false;
+	uint32_t best = 0;
+
+	for (int i = -2; i < MAX_CACHED_CREDENTIALS; i++)
+	{
+		if (i >= 0 && !credentialCache.entries[i].ssid)
 		{
-			bool ok = true;
-			uint8_t *buff = static_cast<uint8_t*>(calloc(MaxCredentialChunkSize, 1));
+			continue;
+		}
+
+		const uint32_t start = (i == -2) ? credentialCache.nextOffset
+								: (i == -1) ? 0
+								: credentialCache.entries[i].offset + credentialCache.entries[i].size;
+		const uint32_t distance = (start >= credentialCache.nextOffset)
+									? start - credentialCache.nextOffset
+									: start + scratchPartition->size - credentialCache.nextOffset;
+
+		if (IsScratchRegionFree(start, size) && (!found || distance < best))
+		{
+			found = true;
+			best = distance;
+			base = start;
+		}
+	}
+
+	return found;
+}
 
-			if (loadedSsid)
+// Erase a region of the scratch partition for credentials, evicting the least
+// recently used credentials from the cache until there is one
+bool WirelessConfigurationMgr::AllocateScratch(size_t size, uint32_t& base, uint8_t *buff)
+{
+	while (!FindScratchRegion(size, base))
+	{
+		int lru = -1;
+		for (int i = 0; i < MAX_CACHED_CREDENTIALS; i++)
+		{
+			if (credentialCache.entries[i].ssid &&
+				(lru < 0 || credentialCache.entries[i].lastUsed < credentialCache.entries[lru].lastUsed))
 			{
-				// Reset the loaded ssid value
-				uint32_t zero = 0;
-				bool ok = SetKV(GetScratchKey(key, LOADED_SSID_ID), &zero, sizeof(zero));
+				lru = i;
+			}
+		}
 
-				if (ok)
-				{
-					uint32_t prevTotal = 0;
+		if (lru < 0 || !EvictCredentials(lru, buff))
+		{
+			return false;
+		}
+	}
 
-					WirelessConfigurationData loaded;
-					ok = GetSsid(loadedSsid, loaded);
+	return (esp_partition_erase_range(scratchPartition, base, size) == ESP_OK);
+}
 
-					if (ok)
-					{
-						const CredentialsInfo& prevSizes = loaded.eap.credSizes;
+// Enter credentials that have been written to the scratch partition in the cache index,
+// evicting the least recently used credentials if all the entries are in use
+bool WirelessConfigurationMgr::AddCachedCredentials(int ssid, uint32_t base, size_t size, uint8_t *buff)
+{
+	int entry = -1, lru = 0;
+	for (int i = 0; i < MAX_CACHED_CREDENTIALS; i++)
+	{
+		if (!credentialCache.entries[i].ssid)
+		{
+			entry = i;
+			break;
+		}
 
-						for (uint32_t sz : prevSizes.asArr)
-						{
-							prevTotal += sz;
-						}
+		if (credentialCache.entries[i].lastUsed < credentialCache.entries[lru].lastUsed)
+		{
+			lru = i;
+		}
+	}
 
-						prevTotal = round2SecSz(prevTotal);
-					}
+	if (entry < 0)
+	{
+		if (!EvictCredentials(lru, buff))
+		{
+			return false;
+		}
+		entry = lru;
+	}
 
-					if (ok)
-					{
-						static_assert(SPI_FLASH_SEC_SIZE % MaxCredentialChunkSize == 0);
-						// Zero the currently loaded credentials memory
-						for (int pos = baseOffset - prevTotal; ok && pos < prevTotal; pos += MaxCredentialChunkSize)
-						{
-							ok = (esp_partition_write(scratchPartition, pos, buff, MaxCredentialChunkSize) == ESP_OK);
-						}
-					}
-				}
-			}
+	credentialCache.entries[entry].ssid = ssid;
+	credentialCache.entries[entry].offset = base;
+	credentialCache.entries[entry].size = size;
+	credentialCache.entries[entry].lastUsed = ++credentialCache.useCount;
+	credentialCache.nextOffset = base + size;
+	return SaveCredentialCache();
+}
 
-			if (ok)
+// Remove credentials from the cache. If they were never copied to the key-value store,
+// which is the case when they were written straight into the scratch partition, they are
+// copied first. Their region is then zeroed, so that they don't stay readable there.
+bool WirelessConfigurationMgr::EvictCredentials(int entry, uint8_t *buff)
+{
+	char key[MAX_KEY_LEN] = { 0 };
+	const CachedCredentials evicted = credentialCache.entries[entry];
+
+	// There is nothing to keep if the SSID has gone
+	WirelessConfigurationData data;
+	bool ok = true;
+
+	if (GetSsid(evicted.ssid, data) && !IsSsidBlank(data))
+	{
+		const CredentialsInfo& sizes = data.eap.credSizes;
+
+		for (int cred = 0, offset = evicted.offset; ok && cred < ARRAY_SIZE(sizes.asArr); offset += sizes.asArr[cred], cred++)
+		{
+			// A partial copy from an earlier attempt is replaced
+			if (sizes.asArr[cred] && GetKVSize(GetCredentialKey(key, evicted.ssid, cred)) != sizes.asArr[cred])
 			{
-				if (baseOffset + totalSize > scratchPartition->size)
+				for (int pos = 0, sz = 0; ok && pos < sizes.asArr[cred]; pos += sz)
 				{
-					baseOffset = 0;
+					sz = std::min<size_t>(sizes.asArr[cred] - pos, MaxCredentialChunkSize);
+					ok = (esp_partition_read(scratchPartition, offset + pos, buff, sz) == ESP_OK) &&
+							SetKV(key, buff, sz, pos != 0);
 				}
+			}
+		}
+	}
 
-				uint32_t newOffset = baseOffset + totalSize;
-				ok = SetKV(GetScratchKey(key, SCRATCH_OFFSET_ID), &newOffset, sizeof(newOffset));
+	if (ok)
+	{
+		memset(&credentialCache.entries[entry], 0, sizeof(CachedCredentials));
+		ok = SaveCredentialCache();
+	}
 
-				if (ok)
-				{
-					ok = (esp_partition_erase_range(scratchPartition, baseOffset, totalSize) == ESP_OK);
+	if (ok)
+	{
+		static_assert(SPI_FLASH_SEC_SIZE % MaxCredentialChunkSize == 0);
+		// Zero the evicted credentials memory
+		memset(buff, 0, MaxCredentialChunkSize);
+		for (uint32_t pos = evicted.offset; ok && pos < evicted.offset + evicted.size; pos += MaxCredentialChunkSize)
+		{
+			ok = (esp_partition_write(scratchPartition, pos, buff, MaxCredentialChunkSize) == ESP_OK);
+		}
+	}
 
-					if (ok)
-					{
-						// Store offsets from the base offset
-						for(int cred = 0, offset = 0; ok && cred < ARRAY_SIZE(offsets.asArr); cred++)
-						{
-							offsets.asArr[cred] = offset;
-
-							for(int sz = 0, pos = 0, remain = sizes.asArr[cred];
-								ok && remain > 0; remain -= sz, offset += sz, pos += sz)
-							{
-								memset(buff, 0, MaxCredentialChunkSize);
-
-								sz = (remain >= MaxCredentialChunkSize) ? MaxCredentialChunkSize : remain;
-								ok = GetKV(GetCredentialKey(key, ssid, cred), buff, sz, pos);
-
-								if (ok)
-								{
-									ok = (esp_partition_write(scratchPartition, baseOffset + offset, buff, sz) == ESP_OK);
-								}
-							}
-						}
-
-						if (ok)
-						{
-							loadedSsid = ssid;
-							ok = SetKV(GetScratchKey(key, LOADED_SSID_ID), &loadedSsid, sizeof(loadedSsid));
-
-							if (ok)
-							{
-								res = scratchBase + baseOffset;
-							}
-						}
-					}
-				}
+	return ok;
+}
+
+bool WirelessConfigurationMgr::SaveCredentialCache()
+{
+	char key[MAX_KEY_LEN] = { 0 };
+	return SetKV(GetScratchKey(key, CREDENTIAL_CACHE_ID), &credentialCache, sizeof(credentialCache));
+}
+
+// Make the index of the cached credentials when there is none, which is after an update from a version that kept
+// a single set in the scratch partition. That set may never have been copied to the key-value store, so it is
+// entered in the index instead of being erased. Any other enterprise SSID whose credentials are not all in the
+// store can't be used any more, so it is erased rather than left to fail each time it is tried.
+bool WirelessConfigurationMgr::RebuildCredentialCache()
+{
+	memset(&credentialCache, 0, sizeof(credentialCache));
+
+	char key[MAX_KEY_LEN] = { 0 };
+	uint32_t loadedSsid = 0, baseOffset = 0;
+	WirelessConfigurationData data;
+	if (   GetKV(GetScratchKey(key, OLD_LOADED_SSID_ID), &loadedSsid, sizeof(loadedSsid))
+		&& GetKV(GetScratchKey(key, OLD_SCRATCH_OFFSET_ID), &baseOffset, sizeof(baseOffset))
+		&& loadedSsid > AP && loadedSsid <= MaxRememberedNetworks
+		&& GetSsid(loadedSsid, data) && !IsSsidBlank(data)
+	   )
+	{
+		const size_t size = round2SecSz(GetTotalSize(data.eap.credSizes));
+		if (size != 0 && size <= baseOffset && baseOffset <= scratchPartition->size)
+		{
+			credentialCache.entries[0].ssid = loadedSsid;
+			credentialCache.entries[0].offset = baseOffset - size;
+			credentialCache.entries[0].size = size;
+			credentialCache.entries[0].lastUsed = ++credentialCache.useCount;
+			credentialCache.nextOffset = baseOffset;
+			debugPrintf("kept loaded credentials of ssid %u\n", static_cast<unsigned>(loadedSsid));
+		}
+	}
+
+	// Only the kept set has to stay in the scratch partition, which earlier versions zeroed around it
+	bool ok = (credentialCache.entries[0].ssid != 0) ? SaveCredentialCache() : ResetScratch();
+	if (ok)
+	{
+		DeleteKV(GetScratchKey(key, OLD_SCRATCH_OFFSET_ID));
+		DeleteKV(GetScratchKey(key, OLD_LOADED_SSID_ID));
+	}
+
+	for (int ssid = MaxRememberedNetworks; ok && ssid > AP; ssid--)
+	{
+		if (FindCachedCredentials(ssid) < 0 && GetSsid(ssid, data) && !IsSsidBlank(data) && data.eap.protocol != EAPProtocol::NONE)
+		{
+			bool stored = true;
+			for (int cred = 0; stored && cred < ARRAY_SIZE(data.eap.credSizes.asArr); cred++)
+			{
+				stored = (data.eap.credSizes.asArr[cred] == 0)
+						|| GetKVSize(GetCredentialKey(key, ssid, cred)) == data.eap.credSizes.asArr[cred];
 			}
 
-			free(buff);
+			if (!stored)
+			{
+				debugPrintf("credentials of ssid %d lost\n", ssid);
+				ok = EraseSsid(ssid);
+			}
 		}
 	}
 
-	return res;
+	return ok;
 }
 
-bool WirelessConfigurationMgr::DeleteKV(const char *key)
+size_t WirelessConfigurationMgr::GetTotalSize(const CredentialsInfo& sizes)
 {
-	if (key)
+	size_t total = 0;
+
+	for (uint32_t sz : sizes.asArr)
 	{
-		return (remove(key) == 0);
+		total += sz;
 	}
 
-	return false;
+	return total;
+}
+
+bool WirelessConfigurationMgr::SetTlsCredential(TlsCredential cred, const void* buff, size_t size, size_t offset)
+{
+	Lock lock(mutex);
+	char key[MAX_KEY_LEN] = { 0 };
+	if (GetTlsKey(key, cred) == nullptr)
+	{
+		return false;
+	}
+
+	// Chunks must arrive in order, the first one replacing what was stored before
+	if (offset != 0 && GetKVSize(key) != offset)
+	{
+		return false;
+	}
+
+	return SetKV(key, buff, size, offset != 0);
+}
+
+size_t WirelessConfigurationMgr::GetTlsCredentialSize(TlsCredential cred) const
+{
+	Lock lock(mutex);
+	char key[MAX_KEY_LEN] = { 0 };
+	return GetKVSize(GetTlsKey(key, cred));
+}
+
+bool WirelessConfigurationMgr::GetTlsCredential(TlsCredential cred, void* buff, size_t size) const
+{
+	Lock lock(mutex);
+	char key[MAX_KEY_LEN] = { 0 };
+	return GetKV(GetTlsKey(key, cred), buff, size);
+}
+
+// Remember the access point that an SSID connected through. This is called on every connection, so the
+// store is only written when the access point or the SSID connected to changes.
+bool WirelessConfigurationMgr::SetAccessPointInfo(int ssid, const AccessPointInfo& info)
+{
+	Lock lock(mutex);
+	if (ssid <= AP || ssid > MaxRememberedNetworks || !(ssidsUsed & (1u << ssid)))
+	{
+		return false;
+	}
+
+	char key[MAX_KEY_LEN] = { 0 };
+	AccessPointInfo stored;
+	bool ok = (GetKVSize(GetAccessPointKey(key, ssid)) == sizeof(stored) && GetKV(key, &stored, sizeof(stored))
+				&& memcmp(&stored, &info, sizeof(info)) == 0) || SetKV(key, &info, sizeof(info));
+
+	int32_t last = -1;
+	if (ok && (!GetKV(LAST_AP_KEY, &last, sizeof(last)) || last != ssid))
+	{
+		last = ssid;
+		ok = SetKV(LAST_AP_KEY, &last, sizeof(last));
+	}
+
+	return ok;
+}
+
+bool WirelessConfigurationMgr::GetAccessPointInfo(int ssid, AccessPointInfo& info) const
+{
+	Lock lock(mutex);
+	char key[MAX_KEY_LEN] = { 0 };
+	return ssid > AP && ssid <= MaxRememberedNetworks && (ssidsUsed & (1u << ssid))
+			&& GetKVSize(GetAccessPointKey(key, ssid)) == sizeof(info) && GetKV(key, &info, sizeof(info));
+}
+
+// Return the SSID slot that was connected to last, or -1 if it isn't known
+int WirelessConfigurationMgr::GetLastConnectedSsid() const
+{
+	Lock lock(mutex);
+	int32_t last = -1;
+	if (GetKVSize(LAST_AP_KEY) == sizeof(last) && GetKV(LAST_AP_KEY, &last, sizeof(last))
+		&& last > AP && last <= MaxRememberedNetworks && (ssidsUsed & (1u << last)))
+	{
+		return last;
+	}
+	return -1;
+}
+
+bool WirelessConfigurationMgr::DeleteKV(const char *key)
+{
+	return key && kvs.Delete(key);
 }
 
 bool WirelessConfigurationMgr::SetKV(const char *key, const void *buff, size_t sz, bool append)
 {
 	if (key && buff && sz)
 	{
-		int f = open(key, O_WRONLY | (append ? O_APPEND : O_CREAT | O_TRUNC));
-		if (f >= 0)
-		{
-			size_t written = write(f, buff, sz);
-			close(f);
-			return written == sz;
-		}
+		return (append) ? kvs.Append(key, buff, sz) : kvs.Set(key, buff, sz);
 	}
 
 	return false;
@@ -625,40 +985,205 @@ bool WirelessConfigurationMgr::SetKV(const char *key, const void *buff, size_t s
 
 bool WirelessConfigurationMgr::GetKV(const char *key, void* buff, size_t sz, size_t pos) const
 {
-	if (key)
+	// If buff == NULL or sz == 0, this command is only used to check
+	// if the particular key exists.
+	return key && kvs.Get(key, buff, sz, pos);
+}
+
+size_t WirelessConfigurationMgr::GetKVSize(const char *key) const
+{
+	return (key) ? kvs.GetSize(key) : 0;
+}
+
+size_t WirelessConfigurationMgr::GetFree()
+{
+	return kvs.GetFree();
+}
+
+// Return the room that a key kept in SPIFFS by earlier versions takes up when staged, or 0 if there is no such key
+uint32_t WirelessConfigurationMgr::GetStagedLength(const char *key)
+{
+	char path[sizeof(KVS_PATH) + MAX_KEY_LEN];
+	struct stat st;
+	int res = (key) ? snprintf(path, sizeof(path), "%s/%s", KVS_PATH, key) : 0;
+	if (res > 0 && res < sizeof(path) && stat(path, &st) == 0)
+	{
+		return sizeof(StagedKey) + ((st.st_size + 3) & ~3);
+	}
+
+	return 0;
+}
+
+// Copy the keys kept in the SPIFFS file system by earlier versions to the scratch partition. An SSID slot is only
+// copied along with all its credentials, which go first as they do when it is stored. Returns true if the keys
+// were all staged or there is no file system, so the store can be formatted.
+bool WirelessConfigurationMgr::StageSpiffsKeys(uint8_t *buff)
+{
+	if (!buff)
 	{
-		int f = open(key, O_RDONLY);
+		return false;
+	}
 
-		if (f >= 0)
+	esp_vfs_spiffs_conf_t conf = {
+		.base_path = KVS_PATH,
+		.partition_label = NULL,
+		.max_files = 1,
+		.format_if_mount_failed = false
+	};
+
+	esp_err_t err = esp_vfs_spiffs_register(&conf);
+	if (err != ESP_OK)
+	{
+		debugPrintf("no spiffs keys to migrate %x\n", err);
+		return true;
+	}
+
+	bool ok = (esp_partition_erase_range(scratchPartition, 0, scratchPartition->size) == ESP_OK);
+	uint32_t pos = sizeof(StageHeader), crc = 0;
+	char key[MAX_KEY_LEN] = { 0 };
+
+	for (int ssid = MaxRememberedNetworks; ok && ssid >= 0; ssid--)
+	{
+		uint32_t needed = GetStagedLength(GetSsidKey(key, ssid));
+		for (int cred = 0; cred < ARRAY_SIZE(pendingSsid->sizes.asArr); cred++)
 		{
-			bool res = true;
+			needed += GetStagedLength(GetCredentialKey(key, ssid, cred));
+		}
 
-			// If buff == NULL or sz == 0, this command is only used to check
-			// if the particular key exists. Therefore, do nothing
-			// but close the opened file.
-			if (buff && sz)
-			{
-				res = (lseek(f, pos, SEEK_SET) == pos);
+		if (pos + needed > scratchPartition->size)
+		{
+			debugPrintf("no room to migrate ssid %d\n", ssid);
+			ok = false;
+			break;
+		}
 
-				if (res)
-				{
-					res = (read(f, buff, sz) == sz);
-				}
-			}
+		for (int cred = 0; ok && cred < ARRAY_SIZE(pendingSsid->sizes.asArr); cred++)
+		{
+			ok = StageSpiffsKey(GetCredentialKey(key, ssid, cred), buff, pos, crc);
+		}
+
+		ok = ok && StageSpiffsKey(GetSsidKey(key, ssid), buff, pos, crc);
+	}
+
+	for (TlsCredential cred : { TlsCredential::CERTIFICATE, TlsCredential::PRIVATE_KEY })
+	{
+		if (ok)
+		{
+			ok = (pos + GetStagedLength(GetTlsKey(key, cred)) <= scratchPartition->size) && StageSpiffsKey(key, buff, pos, crc);
+		}
+	}
+
+	if (ok)
+	{
+		const StageHeader hdr = { STAGE_MAGIC, static_cast<uint32_t>(pos - sizeof(StageHeader)), crc };
+		ok = (esp_partition_write(scratchPartition, 0, &hdr, sizeof(hdr)) == ESP_OK);
+	}
+
+	debugPrintf("staged %u bytes of spiffs keys %d\n", static_cast<unsigned>(pos - sizeof(StageHeader)), ok);
+	esp_vfs_spiffs_unregister(NULL);
+	return ok;
+}
+
+bool WirelessConfigurationMgr::StageSpiffsKey(const char *key, uint8_t *buff, uint32_t& pos, uint32_t& crc)
+{
+	char path[sizeof(KVS_PATH) + MAX_KEY_LEN];
+	struct stat st;
+	int res = (key) ? snprintf(path, sizeof(path), "%s/%s", KVS_PATH, key) : 0;
+	if (res <= 0 || res >= sizeof(path) || stat(path, &st) != 0)
+	{
+		return true;		// nothing to copy
+	}
+
+	int f = open(path, O_RDONLY);
+	if (f < 0)
+	{
+		return false;
+	}
+
+	StagedKey staged;
+	memset(&staged, 0, sizeof(staged));
+	strncpy(staged.key, key, sizeof(staged.key) - 1);
+	staged.size = st.st_size;
+
+	bool ok = (esp_partition_write(scratchPartition, pos, &staged, sizeof(staged)) == ESP_OK);
+	crc = KvStore::Crc32(crc, &staged, sizeof(staged));
+	pos += sizeof(staged);
+
+	// Data is padded to whole words; MaxCredentialChunkSize is a multiple of 4 so only the last chunk needs it
+	static_assert(MaxCredentialChunkSize % 4 == 0);
+	for (size_t done = 0; ok && done < staged.size; )
+	{
+		size_t sz = std::min<size_t>(staged.size - done, MaxCredentialChunkSize);
+		ok = (read(f, buff, sz) == sz);
+		done += sz;
+
+		while (sz & 3)
+		{
+			buff[sz++] = 0xFF;
+		}
+
+		if (ok)
+		{
+			ok = (esp_partition_write(scratchPartition, pos, buff, sz) == ESP_OK);
+			crc = KvStore::Crc32(crc, buff, sz);
+			pos += sz;
+		}
+	}
 
-			close(f);
-			return res;
+	close(f);
+	return ok;
+}
+
+// Check for staged keys whose header was written, which means they were all copied
+bool WirelessConfigurationMgr::HasStagedKeys(uint8_t *buff) const
+{
+	StageHeader hdr;
+	if (!buff || esp_partition_read(scratchPartition, 0, &hdr, sizeof(hdr)) != ESP_OK
+		|| hdr.magic != STAGE_MAGIC || hdr.length > scratchPartition->size - sizeof(hdr))
+	{
+		return false;
+	}
+
+	uint32_t crc = 0;
+	for (uint32_t pos = 0; pos < hdr.length; )
+	{
+		const size_t sz = std::min<size_t>(hdr.length - pos, MaxCredentialChunkSize);
+		if (esp_partition_read(scratchPartition, sizeof(hdr) + pos, buff, sz) != ESP_OK)
+		{
+			return false;
 		}
+		crc = KvStore::Crc32(crc, buff, sz);
+		pos += sz;
 	}
 
-	return false;
+	return crc == hdr.crc;
 }
 
-size_t WirelessConfigurationMgr::GetFree()
+// Copy the staged keys into the key-value store. It is formatted first in case an earlier copy was interrupted.
+bool WirelessConfigurationMgr::LoadStagedKeys(uint8_t *buff)
 {
-	size_t total = 0, used = 0;
-	esp_err_t ret = esp_spiffs_info(NULL, &total, &used);
-	return (ret == ESP_OK && used < total) ? total - used : 0;
+	StageHeader hdr;
+	bool ok = (esp_partition_read(scratchPartition, 0, &hdr, sizeof(hdr)) == ESP_OK) && kvs.Format();
+
+	for (uint32_t pos = sizeof(hdr); ok && pos < sizeof(hdr) + hdr.length; )
+	{
+		StagedKey staged;
+		ok = (esp_partition_read(scratchPartition, pos, &staged, sizeof(staged)) == ESP_OK);
+		pos += sizeof(staged);
+
+		// The first chunk replaces any value, then the rest are appended
+		for (size_t done = 0, sz = 0; ok && done < staged.size; done += sz)
+		{
+			sz = std::min<size_t>(staged.size - done, MaxCredentialChunkSize);
+			ok = (esp_partition_read(scratchPartition, pos + done, buff, sz) == ESP_OK)
+				&& SetKV(staged.key, buff, sz, done != 0);
+		}
+
+		pos += (staged.size + 3) & ~3;
+	}
+
+	debugPrintf("loaded staged keys %d\n", ok);
+	return ok;
 }
 
 const char* WirelessConfigurationMgr::GetSsidKey(char *buff, int ssid)
@@ -667,7 +1192,7 @@ const char* WirelessConfigurationMgr::GetSsidKey(char *buff, int ssid)
 
 	if (buff && ssid >= 0 && ssid <= MaxRememberedNetworks)
 	{
-		res = snprintf(buff, MAX_KEY_LEN, "%s/%s/%d", KVS_PATH, SSIDS_DIR, ssid);
+		res = snprintf(buff, MAX_KEY_LEN, "%s/%d", SSIDS_DIR, ssid);
 	}
 
 	return (res > 0 && res < MAX_KEY_LEN) ? buff : nullptr;
@@ -676,7 +1201,67 @@ const char* WirelessConfigurationMgr::GetSsidKey(char *buff, int ssid)
 bool WirelessConfigurationMgr::SetSsidData(int ssid, const WirelessConfigurationData& data)
 {
 	char key[MAX_KEY_LEN] = { 0 };
-	return SetKV(GetSsidKey(key, ssid), &data, sizeof(data));
+	if (SetKV(GetSsidKey(key, ssid), &data, sizeof(data)))
+	{
+		UpdateSsidIndex(ssid, data);
+		return true;
+	}
+
+	return false;
+}
+
+// FNV-1a hash of an SSID, which is null terminated unless it is the full SsidLength
+uint32_t WirelessConfigurationMgr::HashSsid(const char *ssid)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < SsidLength && ssid[i] != 0; i++)
+	{
+		hash = (hash ^ static_cast<uint8_t>(ssid[i])) * 16777619u;
+	}
+	return hash;
+}
+
+void WirelessConfigurationMgr::ClearSsidIndex()
+{
+	ssidsUsed = 0;
+	memset(ssidTable, 0, ReducedWirelessConfigurationDataSize);
+	ssidTableLength = ReducedWirelessConfigurationDataSize;
+}
+
+void WirelessConfigurationMgr::UpdateSsidIndex(int ssid, const WirelessConfigurationData& data)
+{
+	// Slot 0 always has a table entry, the other slots only while they are in use
+	const size_t entrySize = ReducedWirelessConfigurationDataSize;
+	const bool inTable = (ssid == 0) || (ssidsUsed & (1u << ssid));
+	uint8_t *entry = ssidTable + ((ssid == 0) ? 0 : (1 + __builtin_popcount(ssidsUsed & ((1u << ssid) - 2))) * entrySize);
+	const size_t after = ssidTable + ssidTableLength - entry;
+
+	if (IsSsidBlank(data))
+	{
+		ssidsUsed &= ~(1u << ssid);
+
+		if (ssid == 0)
+		{
+			memset(entry, 0, entrySize);
+		}
+		else if (inTable)
+		{
+			memmove(entry, entry + entrySize, after - entrySize);
+			ssidTableLength -= entrySize;
+		}
+	}
+	else
+	{
+		ssidHashes[ssid] = HashSsid(data.ssid);
+		ssidsUsed |= (1u << ssid);
+
+		if (!inTable)
+		{
+			memmove(entry + entrySize, entry, after);
+			ssidTableLength += entrySize;
+		}
+		memcpy(entry, &data, entrySize);
+	}
 }
 
 bool WirelessConfigurationMgr::EraseSsidData(int ssid)
@@ -692,7 +1277,7 @@ const char* WirelessConfigurationMgr::GetScratchKey(char *buff, int id)
 
 	if (buff && id >= 0)
 	{
-		res = snprintf(buff, MAX_KEY_LEN, "%s/%s/%d", KVS_PATH, SCRATCH_DIR, id);
+		res = snprintf(buff, MAX_KEY_LEN, "%s/%d", SCRATCH_DIR, id);
 	}
 
 	return (res > 0 && res < MAX_KEY_LEN) ? buff : nullptr;
@@ -704,10 +1289,8 @@ bool WirelessConfigurationMgr::ResetScratch()
 
 	if (err == ESP_OK)
 	{
-		char key[MAX_KEY_LEN] = { 0 };
-		uint32_t zero = 0;
-		return SetKV(GetScratchKey(key, LOADED_SSID_ID), &zero, sizeof(zero)) &&
-				SetKV(GetScratchKey(key, SCRATCH_OFFSET_ID), &zero, sizeof(zero));
+		memset(&credentialCache, 0, sizeof(credentialCache));
+		return SaveCredentialCache();
 	}
 
 	return false;
@@ -720,7 +1303,7 @@ const char* WirelessConfigurationMgr::GetCredentialKey(char *buff, int ssid, int
 	if (buff && (ssid >= 0 && ssid <= MaxRememberedNetworks) &&
 		(cred >= 0 && cred < ARRAY_SIZE(pendingSsid->sizes.asArr)))
 	{
-		res = snprintf(buff, MAX_KEY_LEN, "%s/%s/%d/%d", KVS_PATH, CREDS_DIR, ssid, cred);
+		res = snprintf(buff, MAX_KEY_LEN, "%s/%d/%d", CREDS_DIR, ssid, cred);
 	}
 
 	return (res > 0 && res < MAX_KEY_LEN) ? buff : nullptr;
@@ -750,24 +1333,44 @@ bool WirelessConfigurationMgr::ResetIfCredentialsLoaded(int ssid)
 
 	if (ssid >= 0 && ssid <= MaxRememberedNetworks)
 	{
-		char key[MAX_KEY_LEN] = { 0 };
+		// If the ssid in question is not cached, do nothing
+		const int cached = FindCachedCredentials(ssid);
+		res = true;
 
-		uint32_t loadedSsid = 0;
-		res = GetKV(GetScratchKey(key, LOADED_SSID_ID), &loadedSsid, sizeof(loadedSsid));
-
-		if (res) // loadedSsid value has to be valid
+		if (cached >= 0)
 		{
-			if (loadedSsid == ssid) // if the ssid in question is not loaded, do nothing
-			{
-				loadedSsid = 0;
-				res = SetKV(GetScratchKey(key, LOADED_SSID_ID), &loadedSsid, sizeof(loadedSsid));
-			}
+			memset(&credentialCache.entries[cached], 0, sizeof(CachedCredentials));
+			res = SaveCredentialCache();
 		}
 	}
 
 	return res;
 }
 
+const char* WirelessConfigurationMgr::GetTlsKey(char *buff, TlsCredential cred)
+{
+	int res = 0;
+
+	if (buff && (cred == TlsCredential::CERTIFICATE || cred == TlsCredential::PRIVATE_KEY))
+	{
+		res = snprintf(buff, MAX_KEY_LEN, "%s/%d", TLS_DIR, static_cast<int>(cred));
+	}
+
+	return (res > 0 && res < MAX_KEY_LEN) ? buff : nullptr;
+}
+
+const char* WirelessConfigurationMgr::GetAccessPointKey(char *buff, int ssid)
+{
+	int res = 0;
+
+	if (buff && ssid > AP && ssid <= MaxRememberedNetworks)
+	{
+		res = snprintf(buff, MAX_KEY_LEN, "%s/%d", APS_DIR, ssid);
+	}
+
+	return (res > 0 && res < MAX_KEY_LEN) ? buff : nullptr;
+}
+
 bool WirelessConfigurationMgr::IsSsidBlank(const WirelessConfigurationData& data)
 {
 	return (data.ssid[0] == 0xFF);
@@ -777,8 +1380,7 @@ int WirelessConfigurationMgr::FindEmptySsidEntry() const
 {
 	for (int ssid = MaxRememberedNetworks; ssid >= 0; ssid--)
 	{
-		WirelessConfigurationData data;
-		if (GetSsid(ssid, data) && IsSsidBlank(data)
+		if (!(ssidsUsed & (1u << ssid))
 			&& (!pendingSsid || pendingSsid->ssid != ssid)
 		)
 		{
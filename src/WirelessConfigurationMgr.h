@@ -13,12 +13,23 @@
 
 #include "include/MessageFormats.h"
 #include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "KvStore.h"
 
 class WirelessConfigurationMgr
 {
 public:
 	static constexpr int AP = 0;
 
+	// The access point that an SSID was last connected through, so that it can be connected to straight away next time
+	struct AccessPointInfo
+	{
+		uint8_t bssid[6];
+		uint8_t channel;
+		uint8_t authMode;					// wifi_auth_mode_t
+	};
+
 	static WirelessConfigurationMgr* GetInstance()
 	{
 		if (!instance)
@@ -29,19 +40,40 @@ public:
 	}
 
 	void Init();
+	void Check();
 	void Reset(bool format = false);
 
 	int SetSsid(const WirelessConfigurationData& data, bool ap);
 	bool EraseSsid(const char *ssid);
 	bool GetSsid(int ssid, WirelessConfigurationData& data) const;
 	int GetSsid(const char* ssid, WirelessConfigurationData& data) const;
+	const uint8_t* GetSsidTable(size_t& length) const;
 
 	bool BeginEnterpriseSsid(const WirelessConfigurationData &data);
 	bool SetEnterpriseCredential(int cred, const void* buff, size_t size);
 	bool EndEnterpriseSsid(bool cancel);
 	const uint8_t* GetEnterpriseCredentials(int ssid, const CredentialsInfo& sizes, CredentialsInfo& offsets);
 
+	bool SetTlsCredential(TlsCredential cred, const void* buff, size_t size, size_t offset);
+	size_t GetTlsCredentialSize(TlsCredential cred) const;
+	bool GetTlsCredential(TlsCredential cred, void* buff, size_t size) const;
+
+	bool SetAccessPointInfo(int ssid, const AccessPointInfo& info);
+	bool GetAccessPointInfo(int ssid, AccessPointInfo& info) const;
+	int GetLastConnectedSsid() const;
+
 private:
+	// The storage is checked by a background task after startup, so access to it is serialised
+	class Lock
+	{
+	public:
+		Lock(SemaphoreHandle_t m) : mutex(m) { xSemaphoreTakeRecursive(mutex, portMAX_DELAY); }
+		~Lock() { xSemaphoreGiveRecursive(mutex); }
+
+	private:
+		SemaphoreHandle_t mutex;
+	};
+
 	static WirelessConfigurationMgr* instance;
 
 	static constexpr char KVS_PATH[] = "/kvs";
@@ -49,42 +81,122 @@ private:
 
 	static constexpr char SCRATCH_DIR[] = "scratch";
 	static constexpr char CREDS_DIR[] = "creds";
+	static constexpr char TLS_DIR[] = "tls";
+	static constexpr char APS_DIR[] = "aps";
+	static constexpr char LAST_AP_KEY[] = "aps/last";
+
+	static constexpr int OLD_SCRATCH_OFFSET_ID = 0;		// end of the single set of loaded credentials kept by earlier versions
+	static constexpr int OLD_LOADED_SSID_ID = 1;		// the SSID whose credentials those were
+	static constexpr int CREDENTIAL_CACHE_ID = 2;
 
-	static constexpr int SCRATCH_OFFSET_ID = 0;
-	static constexpr int LOADED_SSID_ID = 1;
+	static constexpr int MAX_CACHED_CREDENTIALS = 4;
 
 	static constexpr int MAX_KEY_LEN = 32;
+	static_assert(MAX_KEY_LEN <= KvStore::MaxKeyLength + 1, "Keys too long for the key-value store");
+
+	// Keys copied from the SPIFFS file system of earlier versions into the scratch partition, so that they
+	// survive formatting the key-value store. The header is written last, once the keys are all there.
+	static constexpr uint32_t STAGE_MAGIC = 0x4B475453;		// "STGK"
+
+	struct StageHeader
+	{
+		uint32_t magic;
+		uint32_t length;					// of the staged keys that follow
+		uint32_t crc;						// of the staged keys
+	};
+
+	struct StagedKey
+	{
+		char key[MAX_KEY_LEN];
+		uint32_t size;						// of the value that follows, which is padded to a multiple of 4 bytes
+	};
 
 	struct PendingEnterpriseSsid
 	{
 		int ssid;
 		WirelessConfigurationData data;
 		CredentialsInfo sizes;
+		CredentialsInfo crcs;				// of each credential as received
+		uint32_t base;						// of the scratch region that the credentials are written to
 	};
 
 	const esp_partition_t* scratchPartition;
 	const uint8_t* scratchBase;
 
+	// In-RAM index of the SSID slots, so that looking up an SSID by name only reads the slot that matches
+	static_assert(MaxRememberedNetworks + 1 <= 32, "Too many remembered networks for the slot bitmap");
+	uint32_t ssidHashes[MaxRememberedNetworks + 1];
+	uint32_t ssidsUsed;							// bitmap of the slots that hold an SSID
+
+	// The non-secret part of the SSID slots, packed the way networkRetrieveSsidData sends them: slot 0 first, zeroed
+	// if it is blank, then the other slots in use in order. It is built from the slots at startup.
+	uint8_t ssidTable[(MaxRememberedNetworks + 1) * ReducedWirelessConfigurationDataSize];
+	size_t ssidTableLength;						// of the entries in use
+
+	// The scratch partition holds the credentials of several enterprise SSIDs, dropping the least recently
+	// used when space is needed. The index of what is where is stored under a scratch key.
+	struct CachedCredentials
+	{
+		uint32_t ssid;							// 0 if the entry is not in use
+		uint32_t offset;						// of the region of the scratch partition
+		uint32_t size;							// of the region, a multiple of the sector size
+		uint32_t lastUsed;
+	};
+
+	struct CredentialCache
+	{
+		uint32_t nextOffset;					// end of the region allocated last
+		uint32_t useCount;
+		CachedCredentials entries[MAX_CACHED_CREDENTIALS];
+	};
+
+	CredentialCache credentialCache;
+
 	PendingEnterpriseSsid* pendingSsid;
 
+	KvStore kvs;
+	SemaphoreHandle_t mutex;
+
 	bool DeleteKV(const char *key);
 	bool SetKV(const char *key, const void *buff, size_t sz, bool append = false);
 	bool GetKV(const char *key, void* buff, size_t sz, size_t pos = 0) const;
+	size_t GetKVSize(const char *key) const;
 	size_t GetFree();
 
+	static uint32_t GetStagedLength(const char *key);
+	bool StageSpiffsKeys(uint8_t *buff);
+	bool StageSpiffsKey(const char *key, uint8_t *buff, uint32_t& pos, uint32_t& crc);
+	bool HasStagedKeys(uint8_t *buff) const;
+	bool LoadStagedKeys(uint8_t *buff);
+
 	static const char* GetSsidKey(char *buff, int ssid);
 	bool SetSsidData(int ssid, const WirelessConfigurationData& data);
 	bool EraseSsidData(int ssid);
 	bool EraseSsid(int ssid);
+	static uint32_t HashSsid(const char *ssid);
+	void ClearSsidIndex();
+	void UpdateSsidIndex(int ssid, const WirelessConfigurationData& data);
 
 	static const char* GetScratchKey(char *buff, int id);
 	bool ResetScratch();
+	int FindCachedCredentials(int ssid) const;
+	bool IsScratchRegionFree(uint32_t start, size_t size) const;
+	bool FindScratchRegion(size_t size, uint32_t& base) const;
+	bool AllocateScratch(size_t size, uint32_t& base, uint8_t *buff);
+	bool AddCachedCredentials(int ssid, uint32_t base, size_t size, uint8_t *buff);
+	bool EvictCredentials(int entry, uint8_t *buff);
+	bool SaveCredentialCache();
+	bool RebuildCredentialCache();
+	static size_t GetTotalSize(const CredentialsInfo& sizes);
 
 	static const char* GetCredentialKey(char* buff, int ssid, int cred);
 	bool DeleteCredential(int ssid, int cred);
 	bool DeleteCredentials(int ssid);
 	bool ResetIfCredentialsLoaded(int ssid);
 
+	static const char* GetTlsKey(char* buff, TlsCredential cred);
+	static const char* GetAccessPointKey(char* buff, int ssid);
+
 	int FindEmptySsidEntry() const;
 	static bool IsSsidBlank(const WirelessConfigurationData& data);
 };
@@ -72,6 +72,20 @@ enum class NetworkCommand : uint8_t
 	networkStartScan,           // start a scan for APs the module can connect to
 	networkGetScanResult,       // get the results of the previously started scan
 	networkAddEnterpriseSsid,	// add an enterprise ssid and its credentials
+
+	// Added at version 2.2
+	connGetStats,				// get the traffic statistics of a connection
+	connBindUdp,				// create a UDP socket bound to a local port
+	connSendTo,					// send a datagram from a UDP socket
+	connRecvFrom,				// receive the oldest queued datagram from a UDP socket
+	connCreateByName,			// create a new connection to a host given by name
+	networkSetTlsCredential,	// store part of the certificate or private key used by secure listeners
+	connCreateWide,				// create a new connection to an IPv4 or IPv6 address
+	networkListenWide,			// listen for incoming connections on an IPv4 or IPv6 address
+	connGetStatusWide,			// get the status of a socket including the full remote address
+	networkCacheAsset,			// manage the static assets that the ESP serves from its own flash (ESP32 only)
+	networkSetReadAhead,		// enable (flags nonzero) or disable sending received socket data in otherwise empty responses to nullCommand
+	networkSetServiceAccessPoint,	// start (flags nonzero) or stop running our access point alongside the station connection
 };
 
 // Message header sent from the SAM to the ESP
@@ -88,6 +102,18 @@ struct MessageHeaderSamToEsp
 
 	static const uint8_t FlagCloseAfterWrite = 0x01;
 	static const uint8_t FlagPush = 0x02;
+
+	// Further flags for the connWrite command (ESP32 only). The Duet main processor sends the response header fields itself,
+	// including "Content-Encoding: gzip" and "Transfer-Encoding: chunked", then the body with FlagCompress set on every write.
+	// The ESP compresses the body and sends it in chunks. The body ends with a write that has FlagCompressEnd or FlagCloseAfterWrite set.
+	static const uint8_t FlagCompress = 0x04;
+	static const uint8_t FlagCompressEnd = 0x08;
+
+	// Flags for the networkListen command
+	static const uint8_t FlagListenSecure = 0x01;		// terminate TLS on the ESP, the SAM exchanges plain text (ESP32 only)
+	static const uint8_t FlagListenHttpFraming = 0x02;	// deliver each HTTP request preceded by an HttpRequestPrefix
+	static const uint8_t FlagListenAssetCache = 0x04;	// answer GET requests for cached assets on the ESP, implies FlagListenHttpFraming
+	static const uint8_t FlagListenWebSocket = 0x08;	// accept WebSocket upgrade requests on the ESP, implies FlagListenHttpFraming
 };
 
 const size_t headerDwords = NumDwords(sizeof(MessageHeaderSamToEsp));
@@ -129,9 +155,62 @@ struct ListenOrConnectData
 {
 	uint32_t remoteIp;			// IP address to listen for, 0 means any
 	uint8_t protocol;			// Protocol for this connection (0 = HTTP, 1 = FTP, 2 = TELNET, 3 = FTP-DATA) - also see NetworkDefs.h
-	uint8_t dummy;				// To ensure alignment is the same on ESP8266 and SAM
+	uint8_t iface;				// when listening, the ListenInterface to accept connections on. Must be zero when connecting.
+	uint16_t port;				// port number to listen on if connection is incoming, or to connect to if outgoing
+	uint16_t maxConnections;	// maximum number of connections to accept if listening
+};
+
+// Network interfaces that a listener can be restricted to. A restricted listener accepts IPv4 and IPv6 connections on whatever addresses
+// its interface has at the time, and takes priority on that interface over a listener on the same port for any interface.
+// When a service access point is stopped, its listeners are stopped and the connections made through it are aborted.
+enum class ListenInterface : uint8_t
+{
+	any = 0,
+	station,					// the station or Ethernet interface
+	accessPoint
+};
+
+// IPv4 or IPv6 address, used by the wide address variants of the commands
+enum class IpAddressType : uint8_t
+{
+	ipv4 = 0,
+	ipv6,
+};
+
+struct WideIpAddress
+{
+	IpAddressType type;
+	uint8_t dummy[3];
+	uint32_t addr[4];			// IPv4 address in addr[0], or the IPv6 address, all in network byte order
+};
+
+// Message data sent from SAM to ESP for the connCreateWide and networkListenWide commands
+struct ListenOrConnectDataWide
+{
+	WideIpAddress remoteIp;		// IP address to listen for or connect to. When listening, an all-zeros address of either type means any IPv4 or IPv6 address
+	uint8_t protocol;			// Protocol for this connection, as in ListenOrConnectData
+	uint8_t iface;				// as in ListenOrConnectData
 	uint16_t port;				// port number to listen on if connection is incoming, or to connect to if outgoing
 	uint16_t maxConnections;	// maximum number of connections to accept if listening
+	uint16_t dummy2;
+};
+
+// Message data sent from SAM to ESP for a connCreateByName command
+struct ConnectByNameData
+{
+	uint8_t protocol;			// Protocol for this connection, as in ListenOrConnectData
+	uint8_t dummy;				// To ensure alignment is the same on ESP8266 and SAM
+	uint16_t port;				// port number to connect to
+	char hostName[HostNameLength];	// name of the host to connect to, null terminated unless it fills the field
+};
+
+// Header that precedes the payload of a datagram sent with connSendTo or received with connRecvFrom
+struct UdpDatagramHeader
+{
+	uint32_t remoteIp;			// destination address when sending, source address when receiving
+	uint16_t remotePort;		// destination port when sending, source port when receiving
+	uint16_t length;			// length of the payload that follows the header. When receiving this is the length of the datagram,
+								// which is more than the payload if the datagram didn't fit in the SAM's buffer.
 };
 
 const uint8_t protocolHTTP = 0;
@@ -141,6 +220,14 @@ const uint8_t protocolFtpData = 3;
 
 const size_t MaxCredentialChunkSize = MaxDataLength;
 
+// Credentials used by secure listeners, sent in the flags field of networkSetTlsCredential.
+// The param32 field gives the offset of the chunk, a chunk at offset 0 replaces the stored credential.
+enum class TlsCredential : uint8_t
+{
+	CERTIFICATE = 0,			// server certificate chain, PEM or DER
+	PRIVATE_KEY,				// private key for the server certificate, PEM or DER
+};
+
 // Message data sent from SAM to ESP to add an SSID or set the access point configuration. This is also the format of a remembered SSID entry.
 union __attribute__((__packed__)) CredentialsInfo
 {
@@ -323,6 +410,115 @@ struct ConnStatusResponse
 	uint16_t otherEndClosedSockets;		// bitmap of sockets that are in state 'otherEndClosed'
 };
 
+// HTTP request methods recognised by the ESP
+enum class HttpMethod : uint8_t
+{
+	other = 0,
+	get,
+	head,
+	post,
+	put,
+	del,
+	options,
+	patch,
+};
+
+// When a connection was accepted by a listener with FlagListenHttpFraming set, connRead returns whole requests.
+// Each request starts with this prefix, followed by the header block and then the first 'bodyLength' bytes of the body.
+// Subsequent reads return the rest of the body, never going past the end of the request.
+struct HttpRequestPrefix
+{
+	uint16_t headerLength;				// length of the request line and header fields, including the blank line that ends them
+	uint16_t bodyLength;				// number of body bytes that follow the header block in this read
+	uint32_t contentLength;				// value of the Content-Length field, 0 if there is none
+	HttpMethod method;
+	uint8_t flags;
+	uint16_t dummy;
+
+	static const uint8_t FlagChunked = 0x01;	// the body uses chunked encoding, the rest of the connection is passed through unframed
+	static const uint8_t FlagUnframed = 0x02;	// the header block was too long to frame or for the read buffer, the rest of the connection is passed through unframed
+	static const uint8_t FlagWebSocket = 0x04;	// the ESP has accepted this WebSocket upgrade request, the rest of the connection uses WebSocketPrefix
+	static const uint8_t FlagIncomplete = 0x08;	// the other end closed the connection part way through a header block, which follows unframed
+};
+
+// After a WebSocket upgrade, connRead returns message payloads and connWrite takes them, each chunk preceded by this prefix.
+// The ESP handles the handshake, masking, ping/pong and the closing handshake. A message may be split over several chunks.
+// A connWrite chunk is accepted whole or not at all, so it must fit in the write buffer space reported for the connection.
+struct WebSocketPrefix
+{
+	uint16_t length;					// length of the payload that follows
+	uint8_t opcode;						// OpcodeText or OpcodeBinary
+	uint8_t flags;
+
+	static const uint8_t OpcodeText = 1;
+	static const uint8_t OpcodeBinary = 2;
+
+	static const uint8_t FlagFirst = 0x01;		// this chunk starts a message
+	static const uint8_t FlagFinal = 0x02;		// this chunk ends a message
+};
+
+// Operations of the networkCacheAsset command, sent in the flags field.
+// An asset is stored by sending 'begin' with an AssetCacheInfo, then the content in order using 'data' with the offset in param32, then 'commit'.
+// Storing an asset with the same path as an existing one replaces it. Space is only reclaimed by 'clear'.
+enum class AssetCacheOp : uint8_t
+{
+	clear = 0,					// remove all assets
+	begin,						// start storing an asset
+	data,						// store the next chunk of the content
+	commit,						// make the asset available
+};
+
+const size_t MaxAssetPathLength = 64;
+const size_t MaxAssetEtagLength = 28;
+const size_t MaxAssetContentTypeLength = 32;
+
+struct AssetCacheInfo
+{
+	uint32_t length;								// length of the content in bytes
+	uint8_t flags;
+	uint8_t dummy[3];
+	char path[MaxAssetPathLength];					// URI that the asset is served for, null terminated
+	char etag[MaxAssetEtagLength];					// entity tag without the quotes, null terminated
+	char contentType[MaxAssetContentTypeLength];	// value for the Content-Type field, null terminated
+
+	static const uint8_t FlagGzip = 0x01;			// the content is gzip compressed
+};
+
+// When read-ahead is enabled by networkSetReadAhead, the response to nullCommand may carry data from the socket that has
+// waited longest for it to be read, instead of being empty. The data is preceded by this header and is what connRead would have returned.
+// In the same mode, the response to connGetStatus is followed by data from that socket, if any is available and it fits.
+struct ReadAheadHeader
+{
+	uint8_t socketNumber;
+	uint8_t dummy;
+	uint16_t length;					// length of the data that follows
+};
+
+// Connection status response for connGetStatusWide. The remoteIp field of 'status' is zero if the remote end uses IPv6.
+struct ConnStatusResponseWide
+{
+	ConnStatusResponse status;
+	WideIpAddress remoteIp;
+};
+
+// Connection statistics response. The counters are reset when the connection is (re)established.
+struct ConnStatsResponse
+{
+	ConnState state;
+	uint8_t socketNumber;
+	uint8_t protocol;
+	uint8_t dummy[1];
+	uint32_t bytesIn;					// bytes received from the network
+	uint32_t bytesOut;					// bytes passed to the network
+	uint32_t readCalls;					// number of connRead commands
+	uint32_t writeCalls;				// number of connWrite commands
+	uint32_t writeFailures;				// number of writes that could not be completed
+	uint32_t connectedTime;				// how long the connection has been established, in milliseconds
+	uint32_t srtt;						// smoothed round trip time in milliseconds, 0 if not yet measured
+	uint32_t rto;						// retransmission timeout in milliseconds
+	uint32_t cwnd;						// congestion window in bytes
+};
+
 // Response error codes. A non-negative code is the number of bytes of returned data.
 const int32_t ResponseEmpty = 0;				// used when there is no error and no data to return
 const int32_t ResponseUnknownCommand = -1;